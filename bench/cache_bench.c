@@ -0,0 +1,146 @@
+/* Stores the syntax trees of generated files in the AST cache, loads
+ * them back and reports how long that takes next to parsing the files.
+ *
+ * usage: cache_bench [files]
+ *
+ * File n (of 200 by default) has 1 + n % 64 functions, so the buffers
+ * of one store are freed and reused by the next at many sizes.
+ * Identifiers such as "a" and "i32" repeat in every file and within it,
+ * the function names are different in every file. Every tree loaded
+ * from the cache is dumped and compared with the dump of a fresh
+ * parse. The cache directory is created in the working directory
+ * and removed afterwards. Build it with "sh build.sh bench". */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+
+#include "libfly.h"
+#include "ast_cache.h"
+#include "dump.h"
+
+#define CACHE_DIR "cache_bench.cache"
+#define MAX_DECLS 64
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+static void* check(void* p) {
+    if (!p) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(255);
+    }
+    return p;
+}
+
+/* Writes file number file to a malloc'd string */
+static char* generate(u32 file, size_t* length) {
+    u32 count = 1 + file % MAX_DECLS;
+    size_t capacity = (size_t)count * 200, used = 0;
+    char* text = check(malloc(capacity));
+    for (u32 i = 0; i < count; i++) {
+        used += (size_t)sprintf(text + used,
+                "fn f%05u_%05u :: ( x : i32, y : i32 ) -> i32 {\n"
+                "    let a := x * y;\n"
+                "    let b : i32 = a - x;\n"
+                "    return f%05u_%05u(a, b);\n};\n",
+                file, i, file, (i + 1) % count);
+    }
+    *length = used;
+    return text;
+}
+
+static char* dump(syntree_t* tree, ast_id root, size_t* size) {
+    char* text = NULL;
+    FILE* out = check(open_memstream(&text, size));
+    dump_ast(tree, root, out);
+    fclose(out);
+    return text;
+}
+
+static void remove_cache_dir(void) {
+    DIR* dir = opendir(CACHE_DIR);
+    if (!dir)
+        return;
+    struct dirent* entry;
+    char path[512];
+    while ((entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", CACHE_DIR, entry->d_name);
+        remove(path);
+    }
+    closedir(dir);
+    remove(CACHE_DIR);
+}
+
+int main(int argc, char** argv) {
+    u32 num_files = (argc > 1) ? (u32)atoi(argv[1]) : 200;
+    if (num_files == 0) {
+        fprintf(stderr, "usage: %s [files]\n", argv[0]);
+        return 1;
+    }
+    remove_cache_dir();
+
+    double parse = 0.0, store = 0.0, load = 0.0;
+    u32 stored = 0, loaded = 0, same = 0;
+    for (u32 pass = 0; pass < 2; pass++) {
+        for (u32 f = 0; f < num_files; f++) {
+            size_t length;
+            char* text = generate(f, &length);
+            ast_cache_key_t key = ast_cache_key(text, length);
+            double start = now();
+            fly_unit_t unit;
+            if (!fly_parse_buffer("cache_bench.fly", text, length, 0, &unit)) {
+                fprintf(stderr, "Could not parse file %u\n", f);
+                return 1;
+            }
+            parse += now() - start;
+
+            if (pass == 0) {
+                start = now();
+                if (ast_cache_store(CACHE_DIR, key, &unit.syntree,
+                                    unit.program))
+                    stored++;
+                store += now() - start;
+            } else {
+                syntree_t tree;
+                ast_id program;
+                start = now();
+                bool hit = ast_cache_load(CACHE_DIR, key, &tree, &program);
+                load += now() - start;
+                if (hit) {
+                    loaded++;
+                    size_t size, fresh_size;
+                    char* cached = dump(&tree, program, &size);
+                    char* fresh = dump(&unit.syntree, unit.program,
+                                       &fresh_size);
+                    if (size == fresh_size && memcmp(cached, fresh, size) == 0)
+                        same++;
+                    free(cached);
+                    free(fresh);
+                    release_syntree(&tree);
+                }
+            }
+            fly_release_unit(&unit);
+            free(text);
+        }
+    }
+    remove_cache_dir();
+
+    printf("%u files, %u stored, %u loaded\n", num_files, stored, loaded);
+    printf("per file: parse %.1f us, store %.1f us, load %.1f us\n",
+           parse * 1e6 / (2 * num_files), store * 1e6 / num_files,
+           load * 1e6 / num_files);
+    printf("%u of %u trees from the cache match a fresh parse\n", same,
+           num_files);
+    fly_shutdown();
+    return (stored == num_files && same == num_files) ? 0 : 1;
+}
@@ -0,0 +1,256 @@
+/* Edits a generated 50000 line file the way an editor does, a few bytes
+ * at a time, and reports how long each incremental reparse takes next to
+ * a full parse of the file.
+ *
+ * usage: edit_bench [edits]
+ *
+ * Every edit is inside one function: a digit is changed, a statement is
+ * typed in and deleted again, and a ';' is deleted and typed again,
+ * which leaves a syntax error in between. Afterwards the tree and the
+ * diagnostics are compared with a full parse of the edited text, with
+ * and without the error. Before that an extern declaration is typed one
+ * token at a time into a file of three declarations, between two of
+ * them and at the end, and deleted again, with the same comparison after
+ * every step. Build it with "sh build.sh bench". */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libfly.h"
+#include "dump.h"
+
+#define LINES 50000
+/* lines per declaration in generate */
+#define DECL_LINES 9
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+static void* check(void* p) {
+    if (!p) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(255);
+    }
+    return p;
+}
+
+/* the rest of a declaration from the '2' in "x * 2" on */
+static const char tail[] =
+    "2 + y;\n"
+    "    let b : i32 = a - 7;\n"
+    "    if (a > b) {\n"
+    "        return a;\n    }\n    return b + 1;\n};\n";
+
+/* Writes count declarations to a malloc'd string and the offset of the
+ * '2' in "x * 2" of every function to digits */
+static char* generate(u32 count, u32* digits, size_t* length) {
+    size_t capacity = (size_t)count * 320, used = 0;
+    char* text = check(malloc(capacity));
+    for (u32 i = 0; i < count; i++) {
+        used += (size_t)sprintf(text + used,
+                "type T%u = struct { a : i32, b : f32, };\n"
+                "fn f%u :: ( x : i32, y : i32 ) -> i32 {\n"
+                "    let a := x * ", i, i);
+        digits[i] = (u32)used;
+        memcpy(text + used, tail, sizeof(tail) - 1);
+        used += sizeof(tail) - 1;
+    }
+    *length = used;
+    return text;
+}
+
+static char* dump(syntree_t* tree, ast_id root, size_t* size) {
+    char* text = NULL;
+    FILE* out = check(open_memstream(&text, size));
+    dump_ast(tree, root, out);
+    fclose(out);
+    return text;
+}
+
+/* Compares the document with a full parse of its text */
+static bool same_as_full_parse(fly_document_t* doc) {
+    source_file_t* source = source_get_file(doc->file);
+    fly_unit_t unit;
+    if (!fly_parse_buffer(source->path, source->data, source->size, 0,
+                          &unit))
+        return false;
+    size_t size, full_size;
+    char* text = dump(&doc->parser.syntree, doc->program, &size);
+    char* full = dump(&unit.syntree, unit.program, &full_size);
+    bool same = size == full_size && memcmp(text, full, size) == 0;
+    free(text);
+    free(full);
+
+    diag_buffer_t diag;
+    fly_document_diag(doc, 0, &diag);
+    if (diag.num_errors != unit.diag.num_errors ||
+            diag.length != unit.diag.length ||
+            (diag.length && memcmp(diag.text, unit.diag.text, diag.length)))
+        same = false;
+    diag_release(&diag);
+    fly_release_unit(&unit);
+    return same;
+}
+
+/* Types "extern fn q :: (i32) -> i32;" at offset one token at a time and
+ * deletes it again, comparing with a full parse after every step */
+static bool type_extern(fly_document_t* doc, u32 offset) {
+    static const char* tokens[] = {
+        "extern", " fn", " q", " ::", " (", "i32", ")", " ->", " i32", ";",
+        "\n"
+    };
+    u32 num_tokens = sizeof(tokens) / sizeof(tokens[0]);
+    bool same = true;
+    u32 at = offset;
+    for (u32 i = 0; i < 2 * num_tokens; i++) {
+        fly_edit_t edit = { .offset = at };
+        if (i < num_tokens) {
+            edit.inserted = tokens[i];
+            edit.length = (u32)strlen(tokens[i]);
+            at += edit.length;
+        } else {
+            edit.removed = (u32)strlen(tokens[2 * num_tokens - 1 - i]);
+            at -= edit.removed;
+            edit.offset = at;
+        }
+        if (!fly_edit_document(doc, &edit, NULL)) {
+            fprintf(stderr, "Typing extern at %u failed\n", offset);
+            return false;
+        }
+        if (!same_as_full_parse(doc))
+            same = false;
+    }
+    return same;
+}
+
+static int compare_times(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char** argv) {
+    u32 num_edits = (argc > 1) ? (u32)atoi(argv[1]) : 30000;
+    if (num_edits == 0) {
+        fprintf(stderr, "usage: %s [edits]\n", argv[0]);
+        return 1;
+    }
+    /* a small file, so that comparing after every token is cheap */
+    u32 small_digits[3];
+    size_t small_length;
+    char* small = generate(3, small_digits, &small_length);
+    fly_document_t small_doc;
+    if (!fly_open_document("edit_bench_small.fly", small, small_length,
+                           &small_doc)) {
+        fprintf(stderr, "Could not open the file\n");
+        return 1;
+    }
+    bool ok = type_extern(&small_doc, small_digits[1] + sizeof(tail) - 1) &&
+              type_extern(&small_doc, (u32)small_length);
+    fly_close_document(&small_doc);
+    free(small);
+
+    u32 count = LINES / DECL_LINES;
+    u32* digits = check(malloc(count * sizeof(u32)));
+    size_t length;
+    char* text = generate(count, digits, &length);
+
+    double start = now();
+    fly_unit_t unit;
+    if (!fly_parse_buffer("edit_bench.fly", text, length, 0, &unit)) {
+        fprintf(stderr, "Could not parse the file\n");
+        return 1;
+    }
+    double full = now() - start;
+    fly_release_unit(&unit);
+
+    fly_document_t doc;
+    start = now();
+    if (!fly_open_document("edit_bench.fly", text, length, &doc)) {
+        fprintf(stderr, "Could not open the file\n");
+        return 1;
+    }
+    double open = now() - start;
+    printf("%u lines, %.1f KiB, %u declarations, %u segments\n", LINES,
+           (double)length / 1024.0, doc.num_items, doc.num_segments);
+    printf("full parse %.2f ms, open %.2f ms\n", full * 1000.0,
+           open * 1000.0);
+
+    static const char statement[] = "    let c := a * b;\n";
+    double* times = check(malloc(num_edits * sizeof(double)));
+    u32 full_parses = 0, random = 12345, decl = 0;
+    for (u32 i = 0; i < num_edits; i++) {
+        if (i % 2 == 0) {
+            random = random * 1103515245u + 12345u;
+            decl = (random >> 8) % count;
+        }
+        /* each odd edit undoes the one before */
+        fly_edit_t edit = { .offset = digits[decl] };
+        char digit = (char)('0' + i % 10);
+        switch ((i / 2) % 3) {
+        case 0:
+            edit.removed = 1;
+            edit.inserted = &digit;
+            edit.length = 1;
+            break;
+        case 1: /* behind "2 + y;\n" */
+            edit.offset += 7;
+            if (i % 2 == 0) {
+                edit.inserted = statement;
+                edit.length = sizeof(statement) - 1;
+            } else {
+                edit.removed = sizeof(statement) - 1;
+            }
+            break;
+        case 2: /* the ';' of "2 + y;" */
+            edit.offset += 5;
+            if (i % 2 == 0) {
+                edit.removed = 1;
+            } else {
+                edit.inserted = ";";
+                edit.length = 1;
+            }
+            break;
+        }
+        fly_edit_result_t result;
+        start = now();
+        if (!fly_edit_document(&doc, &edit, &result)) {
+            fprintf(stderr, "Edit %u failed\n", i);
+            return 1;
+        }
+        times[i] = now() - start;
+        if (result.full)
+            full_parses++;
+        /* once with the syntax error in place */
+        if (i == 4 && !same_as_full_parse(&doc))
+            ok = false;
+    }
+    if (!same_as_full_parse(&doc))
+        ok = false;
+
+    double total = 0.0;
+    for (u32 i = 0; i < num_edits; i++)
+        total += times[i];
+    qsort(times, num_edits, sizeof(double), compare_times);
+    printf("%u edits, %u full parses, %u entries\n", num_edits, full_parses,
+           doc.parser.syntree.num_entries);
+    printf("per edit: mean %.1f us, median %.1f us, 99%% %.1f us, "
+           "max %.1f us\n", total * 1e6 / num_edits,
+           times[num_edits / 2] * 1e6, times[num_edits * 99 / 100] * 1e6,
+           times[num_edits - 1] * 1e6);
+    printf("tree and diagnostics %s a full parse\n",
+           ok ? "match" : "DIFFER from");
+
+    free(times);
+    free(text);
+    free(digits);
+    fly_close_document(&doc);
+    fly_shutdown();
+    return ok ? 0 : 1;
+}
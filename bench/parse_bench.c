@@ -0,0 +1,106 @@
+/* Parses a generated file without errors and one with a syntax or lexer
+ * error in every declaration, to show that error recovery keeps up with
+ * normal parsing.
+ *
+ * usage: parse_bench [declarations]
+ *
+ * Both files have the same declarations (100000 by default) and are
+ * written to the working directory and removed afterwards. They are
+ * parsed without an error limit, so that every error is recovered from.
+ * Build it with "sh build.sh bench". */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "parser.h"
+#include "source.h"
+
+#define RUNS 5
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+/* Every broken declaration has one error, of one of four kinds: a
+ * missing operand, a missing ')', a field without ':' and a character
+ * the lexer does not know, which leaves a missing operator behind and so
+ * counts twice. */
+static bool generate(const char* path, u32 count, bool errors) {
+    FILE* out = fopen(path, "w");
+    if (!out)
+        return false;
+    for (u32 i = 0; i < count; i++) {
+        u32 kind = errors ? i % 4 + 1 : 0;
+        fprintf(out, "type T%u = struct { a : i32, b %s f32, };\n", i,
+                (kind == 3) ? "" : ":");
+        fprintf(out, "fn f%u :: ( x : i32, y : i32 ) -> i32 {\n", i);
+        fprintf(out, "    let a := x * 2 %s y;\n", (kind == 4) ? "$" : "+");
+        fprintf(out, "    let b : i32 = a - %s;\n",
+                (kind == 1) ? "" : "7");
+        fprintf(out, "    if (a > b %s {\n", (kind == 2) ? "" : ")");
+        fprintf(out, "        return a;\n    }\n    return b + 1;\n};\n");
+    }
+    bool ok = !ferror(out);
+    if (fclose(out) != 0)
+        ok = false;
+    return ok;
+}
+
+/* Best time of RUNS parses */
+static double time_parse(char* path, u32* num_errors, size_t* size) {
+    double best = 1e9;
+    for (int run = 0; run < RUNS; run++) {
+        parser_t parser = { 0 };
+        double start = now();
+        if (!init_parser(&parser, path))
+            return -1.0;
+        parse_program(&parser);
+        double t = now() - start;
+        if (t < best)
+            best = t;
+        *num_errors = parser.diag.num_errors;
+        *size = source_get_file(parser.file)->size;
+        release_parser(&parser);
+    }
+    return best;
+}
+
+int main(int argc, char** argv) {
+    u32 count = (argc > 1) ? (u32)atoi(argv[1]) : 100000;
+    if (count == 0) {
+        fprintf(stderr, "usage: %s [declarations]\n", argv[0]);
+        return 1;
+    }
+    char* paths[] = { "parse_bench_clean.fly", "parse_bench_errors.fly" };
+    const char* names[] = { "clean", "errors" };
+    printf("%-8s %10s %10s %12s %12s\n", "file", "MiB", "errors",
+           "ms", "MiB/s");
+    int result = 0;
+    for (int i = 0; i < 2; i++) {
+        if (!generate(paths[i], count, i == 1)) {
+            fprintf(stderr, "Could not write %s\n", paths[i]);
+            result = 1;
+            break;
+        }
+        u32 errors = 0;
+        size_t size = 0;
+        double t = time_parse(paths[i], &errors, &size);
+        remove(paths[i]);
+        if (t < 0.0) {
+            fprintf(stderr, "Could not parse %s\n", paths[i]);
+            result = 1;
+            break;
+        }
+        double mb = (double)size / (1024.0 * 1024.0);
+        printf("%-8s %10.1f %10u %12.1f %12.1f\n", names[i], mb, errors,
+               t * 1000.0, mb / t);
+    }
+    release_sources();
+    release_interner();
+    return result;
+}
@@ -0,0 +1,145 @@
+/* Compares the scalar and vector scanning kernels (compiler/scan.c).
+ *
+ * usage: scan_bench <file.fly>
+ *
+ * For every instruction set the CPU supports it reports the time to lex
+ * the whole file, to skip it as if it were one big comment, to skip it
+ * as if it were one lazily parsed function body and to count its lines. Build it with "sh build.sh bench". */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <time.h>
+
+#include "lexer.h"
+#include "source.h"
+#include "scan.h"
+
+#define RUNS 5
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+static double time_lexer(char* path, u32* num_tokens) {
+    double best = 1e9;
+    for (int run = 0; run < RUNS; run++) {
+        lexer_t lexer;
+        if (!lexer_init(&lexer, path))
+            return -1.0;
+        u32 n = 0;
+        double start = now();
+        for (;;) {
+            n++;
+            if (lexer_get_next(&lexer).tag == TOKEN_T_EOF)
+                break;
+        }
+        double t = now() - start;
+        if (t < best)
+            best = t;
+        *num_tokens = n;
+        lexer_release(&lexer);
+    }
+    return best;
+}
+
+/* stops at every '*' and '/', like the block comment loop */
+static double time_comment(const source_file_t* source) {
+    double best = 1e9;
+    for (int run = 0; run < RUNS; run++) {
+        double start = now();
+        const char* p = source->data;
+        u32 stops = 0;
+        for (;;) {
+            p = scan_find_comment_delimiter(p);
+            if (p == source->data + source->size)
+                break;
+            p++;
+            stops++;
+        }
+        double t = now() - start;
+        if (t < best)
+            best = t;
+        if (stops == 0xffffffffu)
+            printf("\n");
+    }
+    return best;
+}
+
+/* stops at every brace and start of a comment or literal, like
+ * lexer_skip_block */
+static double time_block(const source_file_t* source) {
+    double best = 1e9;
+    for (int run = 0; run < RUNS; run++) {
+        double start = now();
+        const char* p = source->data;
+        u32 stops = 0;
+        for (;;) {
+            p = scan_find_block_delimiter(p);
+            if (p == source->data + source->size)
+                break;
+            p++;
+            stops++;
+        }
+        double t = now() - start;
+        if (t < best)
+            best = t;
+        if (stops == 0xffffffffu)
+            printf("\n");
+    }
+    return best;
+}
+
+static double time_newlines(const source_file_t* source, u32* lines) {
+    double best = 1e9;
+    for (int run = 0; run < RUNS; run++) {
+        double start = now();
+        *lines = scan_count_newlines(source->data, source->data + source->size);
+        double t = now() - start;
+        if (t < best)
+            best = t;
+    }
+    return best;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file.fly>\n", argv[0]);
+        return 1;
+    }
+    file_id_t file = source_load_file(argv[1]);
+    if (file == INVALID_FILE_ID) {
+        fprintf(stderr, "Could not read %s\n", argv[1]);
+        return 1;
+    }
+    const source_file_t* source = source_get_file(file);
+    double mb = (double)source->size / (1024.0 * 1024.0);
+    printf("%s: %.1f MiB\n", argv[1], mb);
+    printf("%-8s %14s %14s %14s %14s\n", "kernels", "lex Mtok/s",
+           "comment MiB/s", "block MiB/s", "lines MiB/s");
+
+    scan_isa_t isas[] = { SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 };
+    for (size_t i = 0; i < sizeof(isas) / sizeof(isas[0]); i++) {
+        if (!scan_set_isa(isas[i])) {
+            printf("%-8s not supported\n", scan_isa_name(isas[i]));
+            continue;
+        }
+        u32 num_tokens = 0, lines = 0;
+        double lex = time_lexer(argv[1], &num_tokens);
+        double comment = time_comment(source);
+        double block = time_block(source);
+        double newlines = time_newlines(source, &lines);
+        if (lex < 0.0) {
+            fprintf(stderr, "Could not lex %s\n", argv[1]);
+            return 1;
+        }
+        printf("%-8s %14.2f %14.0f %14.0f %14.0f\n", scan_isa_name(isas[i]),
+               (double)num_tokens / lex / 1e6, mb / comment, mb / block,
+               mb / newlines);
+    }
+    release_sources();
+    release_interner();
+    return 0;
+}
@@ -0,0 +1,63 @@
+/* Parses many small snippets from memory with libfly, the way a test
+ * runner or an editor plugin would, and reports how many it gets through
+ * per second.
+ *
+ * usage: snippet_bench [snippets]
+ *
+ * Every snippet is parsed with fly_parse_buffer and released right away,
+ * so the file ids are reused: the default of 100000 snippets is more
+ * than there are ids. Build it with "sh build.sh bench". */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "libfly.h"
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+int main(int argc, char** argv) {
+    u32 count = (argc > 1) ? (u32)atoi(argv[1]) : 100000;
+    if (count == 0) {
+        fprintf(stderr, "usage: %s [snippets]\n", argv[0]);
+        return 1;
+    }
+    char snippet[512];
+    u64 bytes = 0, nodes = 0;
+    u32 errors = 0;
+    double start = now();
+    for (u32 i = 0; i < count; i++) {
+        int length = snprintf(snippet, sizeof(snippet),
+                "type P%u = struct { x : i32, y : i32, };\n"
+                "fn area%u :: ( w : i32, h : i32 ) -> i32 {\n"
+                "    let a := w * h + %u;\n"
+                "    if (a > 100) {\n"
+                "        return a - 100;\n"
+                "    }\n"
+                "    return a;\n"
+                "};\n", i, i, i);
+        fly_unit_t unit;
+        if (!fly_parse_buffer("snippet.fly", snippet, (size_t)length, 0,
+                              &unit)) {
+            fprintf(stderr, "Could not parse snippet %u\n", i);
+            return 1;
+        }
+        bytes += (u64)length;
+        nodes += unit.syntree.num_entries;
+        errors += unit.diag.num_errors;
+        fly_release_unit(&unit);
+    }
+    double t = now() - start;
+    printf("%u snippets, %.1f KiB, %llu nodes, %u errors\n", count,
+           (double)bytes / 1024.0, (unsigned long long)nodes, errors);
+    printf("%.3f s, %.0f snippets/s, %.2f us per snippet\n", t,
+           (double)count / t, t * 1e6 / (double)count);
+    fly_shutdown();
+    return errors ? 1 : 0;
+}
@@ -4,6 +4,9 @@ mkdir build
 pushd build
 
 set CFLAGS=/nologo /I../compiler /Zi /DWIN32_BUILD
-cl ..\compiler\main.c ..\compiler\lexer.c ..\compiler\parser.c ..\compiler\parse_expr.c ..\compiler\syntree.c /Feflyc.exe %CFLAGS%
+rem libfly, the parser as a library: everything but the driver's main
+cl /c ..\compiler\lexer.c ..\compiler\parser.c ..\compiler\parse_expr.c ..\compiler\syntree.c ..\compiler\intern.c ..\compiler\source.c ..\compiler\literal.c ..\compiler\literal_table.c ..\compiler\scan.c ..\compiler\dump.c ..\compiler\parse_parallel.c ..\compiler\thread.c ..\compiler\diag.c ..\compiler\driver.c ..\compiler\stats.c ..\compiler\trace.c ..\compiler\ast_cache.c ..\compiler\libfly.c ..\compiler\document.c %CFLAGS%
+lib /nologo /OUT:libfly.lib lexer.obj parser.obj parse_expr.obj syntree.obj intern.obj source.obj literal.obj literal_table.obj scan.obj dump.obj parse_parallel.obj thread.obj diag.obj driver.obj stats.obj trace.obj ast_cache.obj libfly.obj document.obj
+cl ..\compiler\main.c libfly.lib /Feflyc.exe %CFLAGS%
 
 popd
@@ -1,5 +1,29 @@
 #!/bin/sh
 
-# compiler srcs
-SRCS="compiler/main.c compiler/lexer.c compiler/parser.c compiler/parse_expr.c compiler/syntree.c"
-gcc -o flyc -std=c11 -O2 -g -Wall -Wextra $SRCS
+# libfly, the parser as a library: everything but the driver's main
+LIB_SRCS="compiler/lexer.c compiler/parser.c compiler/parse_expr.c compiler/syntree.c compiler/intern.c compiler/source.c compiler/literal.c compiler/literal_table.c compiler/scan.c compiler/dump.c compiler/parse_parallel.c compiler/thread.c compiler/diag.c compiler/driver.c compiler/stats.c compiler/trace.c compiler/ast_cache.c compiler/libfly.c compiler/document.c"
+CFLAGS="-std=c11 -O2 -g -Wall -Wextra -pthread"
+
+# libfly.a and libfly.so are built from the same position independent
+# objects
+mkdir -p build/obj
+OBJS=""
+for SRC in $LIB_SRCS; do
+    OBJ=build/obj/$(basename $SRC .c).o
+    gcc -c -fPIC $CFLAGS -o $OBJ $SRC || exit 1
+    OBJS="$OBJS $OBJ"
+done
+rm -f libfly.a
+ar rcs libfly.a $OBJS
+gcc -shared -pthread -o libfly.so $OBJS
+gcc -o flyc $CFLAGS compiler/main.c libfly.a
+
+# "sh build.sh bench" also builds the benchmarks in bench/
+if [ "$1" = "bench" ]; then
+    gcc -o scan_bench $CFLAGS -Icompiler bench/scan_bench.c libfly.a
+    gcc -o parse_bench $CFLAGS -Icompiler bench/parse_bench.c libfly.a
+    gcc -o edit_bench $CFLAGS -Icompiler bench/edit_bench.c libfly.a
+    gcc -o cache_bench $CFLAGS -Icompiler bench/cache_bench.c libfly.a
+    # against the shared library, which is looked up next to it
+    gcc -o snippet_bench $CFLAGS -Icompiler bench/snippet_bench.c -L. -lfly -Wl,-rpath,'$ORIGIN'
+fi
@@ -0,0 +1,524 @@
+#ifndef WIN32_BUILD
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "ast_cache.h"
+#include "intern.h"
+#include "thread.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32_BUILD
+#include <direct.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define CACHE_FORMAT 1
+
+/* Sections follow the header in this order, each 8 byte aligned:
+ *   payloads      u32[num_entries]
+ *   pairs         syntree_pair_t[num_pairs]
+ *   lists         syntree_list_t[num_lists]
+ *   wide          u64[num_wide]
+ *   children      ast_id[num_children]
+ *   symbol_refs   u32[num_symbol_refs], entries whose payload is a string
+ *   string_starts u32[num_strings + 1], offsets into string_data
+ *   tags          u8[num_entries]
+ *   types         u8[num_entries]
+ *   string_data   char[string_bytes]
+ * Their offsets follow from the counts (layout), the file size has to
+ * match. Everything is in the byte order of the machine, which is part of
+ * the compiler key. */
+typedef struct {
+    char magic[8];
+    u32 format;
+    ast_id program;
+    u64 compiler;
+    u64 source_hash;
+    u64 source_size;
+    u32 num_entries;
+    u32 num_pairs;
+    u32 num_lists;
+    u32 num_wide;
+    u32 num_children;
+    u32 num_symbol_refs;
+    u32 num_strings;
+    u32 string_bytes;
+} cache_header_t;
+
+typedef struct {
+    u64 payloads;
+    u64 pairs;
+    u64 lists;
+    u64 wide;
+    u64 children;
+    u64 symbol_refs;
+    u64 string_starts;
+    u64 tags;
+    u64 types;
+    u64 string_data;
+    u64 size;
+} cache_layout_t;
+
+global_variable const char cache_magic[8] = "FLYAST\0";
+
+/* names the temporary files of this process apart */
+global_variable u32 temp_counter;
+global_variable mutex_t temp_lock = MUTEX_INITIALIZER;
+
+internal u64 align8(u64 x) {
+    return (x + 7) & ~(u64)7;
+}
+
+internal cache_layout_t layout(const cache_header_t* header) {
+    cache_layout_t l;
+    u64 at = align8(sizeof(cache_header_t));
+    l.payloads = at;
+    at = align8(at + (u64)header->num_entries * sizeof(u32));
+    l.pairs = at;
+    at = align8(at + (u64)header->num_pairs * sizeof(syntree_pair_t));
+    l.lists = at;
+    at = align8(at + (u64)header->num_lists * sizeof(syntree_list_t));
+    l.wide = at;
+    at = align8(at + (u64)header->num_wide * sizeof(u64));
+    l.children = at;
+    at = align8(at + (u64)header->num_children * sizeof(ast_id));
+    l.symbol_refs = at;
+    at = align8(at + (u64)header->num_symbol_refs * sizeof(u32));
+    l.string_starts = at;
+    at = align8(at + ((u64)header->num_strings + 1) * sizeof(u32));
+    l.tags = at;
+    at = align8(at + header->num_entries);
+    l.types = at;
+    at = align8(at + header->num_entries);
+    l.string_data = at;
+    l.size = at + header->string_bytes;
+    return l;
+}
+
+internal u64 rotl(u64 x, u32 r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+internal u64 finish(u64 h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Four independent lanes of 8 bytes each, so the multiplications of one
+ * block overlap */
+internal u64 hash_bytes(const char* data, size_t size, u64 seed) {
+    const u64 k1 = 0x9e3779b185ebca87ull;
+    const u64 k2 = 0xc2b2ae3d27d4eb4full;
+    u64 lanes[4] = { seed + k1, seed ^ k2, seed - k1, seed + k2 };
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (u32 l = 0; l < 4; l++) {
+            u64 w;
+            memcpy(&w, data + i + l * 8, sizeof(w));
+            lanes[l] = rotl(lanes[l] ^ (w * k2), 31) * k1;
+        }
+    }
+    u64 h = (u64)size;
+    for (u32 l = 0; l < 4; l++)
+        h = rotl(h ^ finish(lanes[l]), 27) * k1;
+    for (; i < size; i++)
+        h = rotl(h ^ ((u8)data[i] * k2), 23) * k1;
+    return finish(h);
+}
+
+/* Changes whenever trees of this compiler could differ from those of
+ * another one for the same source */
+internal u64 compiler_key(void) {
+    const u32 one = 1;
+    u32 facts[] = {
+        CACHE_FORMAT, AST_TAG_COUNT, TOKEN_T_COUNT, *(const u8*)&one,
+    };
+    u64 h = hash_bytes(FLY_VERSION, sizeof(FLY_VERSION) - 1, 0);
+    return hash_bytes((const char*)facts, sizeof(facts), h);
+}
+
+ast_cache_key_t ast_cache_key(const char* data, size_t size) {
+    ast_cache_key_t key;
+    key.hash = hash_bytes(data, size, 0);
+    key.size = size;
+    return key;
+}
+
+/* dir/<source hash>-<compiler key>.ast, malloc'd */
+internal char* cache_path(const char* dir, ast_cache_key_t key) {
+    size_t length = strlen(dir) + 1 + 16 + 1 + 16 + 4 + 1;
+    char* path = malloc(length);
+    if (path)
+        snprintf(path, length, "%s/%016llx-%016llx.ast", dir,
+                 (unsigned long long)key.hash,
+                 (unsigned long long)compiler_key());
+    return path;
+}
+
+internal bool is_symbol_entry(u8 tag) {
+    return tag == AST_ID || tag == AST_CONST_STRING;
+}
+
+/* Reads the whole file into memory where there is no mmap; release_syntree
+ * frees it. Otherwise the mapping is private and writable, so that the
+ * symbols can be put in place without touching the file. */
+internal void* map_cache_file(const char* path, size_t* size) {
+#ifdef WIN32_BUILD
+    FILE* f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+    char* data = NULL;
+    long length = -1;
+    if (fseek(f, 0, SEEK_END) == 0)
+        length = ftell(f);
+    if (length > 0 && fseek(f, 0, SEEK_SET) == 0)
+        data = malloc((size_t)length);
+    if (data && fread(data, 1, (size_t)length, f) != (size_t)length) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    *size = (size_t)length;
+    return data;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+    *size = (size_t)st.st_size;
+    return data;
+#endif
+}
+
+internal void unmap_cache_file(void* data, size_t size) {
+#ifdef WIN32_BUILD
+    (void)size;
+    free(data);
+#else
+    munmap(data, size);
+#endif
+}
+
+/* Whether the entries that hold a string index are just the identifiers
+ * and strings with a symbol, in entry order as ast_cache_store lists
+ * them, and there are no lazy blocks, which refer to the source */
+internal bool check_symbol_refs(u8* base, const cache_header_t* header,
+                                const cache_layout_t* l) {
+    const u32* payloads = (const u32*)(base + l->payloads);
+    const u32* refs = (const u32*)(base + l->symbol_refs);
+    const u8* tags = base + l->tags;
+    u32 next = 0;
+    for (u32 entry = 0; entry < header->num_entries; entry++) {
+        bool referenced = next < header->num_symbol_refs &&
+                          refs[next] == entry;
+        if (referenced)
+            next++;
+        if (tags[entry] == AST_LAZY_BLOCK)
+            return false;
+        if (is_symbol_entry(tags[entry]) ? !referenced && payloads[entry]
+                                         : referenced)
+            return false;
+    }
+    return next == header->num_symbol_refs;
+}
+
+/* Interns the strings of the file and puts the symbols into the entries
+ * that refer to them */
+internal bool intern_symbols(u8* base, const cache_header_t* header,
+                             const cache_layout_t* l) {
+    const u32* starts = (const u32*)(base + l->string_starts);
+    const char* data = (const char*)(base + l->string_data);
+    if (starts[0] != 0 || starts[header->num_strings] != header->string_bytes ||
+            !check_symbol_refs(base, header, l))
+        return false;
+    symbol_t* symbols = malloc(((size_t)header->num_strings + 1) *
+                               sizeof(symbol_t));
+    if (!symbols)
+        return false;
+    /* all of them first: the last one is checked, so they are all in
+     * range if none goes back */
+    bool ok = true;
+    for (u32 i = 0; i < header->num_strings && ok; i++)
+        ok = starts[i] <= starts[i + 1];
+    for (u32 i = 0; i < header->num_strings && ok; i++) {
+        symbols[i] = intern_string(data + starts[i], starts[i + 1] - starts[i]);
+        /* out of memory, a miss like any other */
+        if (symbols[i] == SYMBOL_INVALID)
+            ok = false;
+    }
+    u32* payloads = (u32*)(base + l->payloads);
+    const u32* refs = (const u32*)(base + l->symbol_refs);
+    for (u32 i = 0; i < header->num_symbol_refs && ok; i++) {
+        u32 entry = refs[i];
+        if (entry >= header->num_entries ||
+                payloads[entry] >= header->num_strings) {
+            ok = false;
+            break;
+        }
+        payloads[entry] = symbols[payloads[entry]];
+    }
+    free(symbols);
+    return ok;
+}
+
+bool ast_cache_load(const char* dir, ast_cache_key_t key, syntree_t* tree,
+                    ast_id* program) {
+    char* path = cache_path(dir, key);
+    if (!path)
+        return false;
+    size_t size = 0;
+    u8* base = map_cache_file(path, &size);
+    free(path);
+    if (!base)
+        return false;
+
+    cache_header_t header;
+    cache_layout_t l;
+    bool ok = size >= sizeof(header);
+    if (ok) {
+        memcpy(&header, base, sizeof(header));
+        l = layout(&header);
+        ok = memcmp(header.magic, cache_magic, sizeof(cache_magic)) == 0 &&
+             header.format == CACHE_FORMAT &&
+             header.compiler == compiler_key() &&
+             header.source_hash == key.hash &&
+             header.source_size == key.size &&
+             l.size == size &&
+             header.num_entries > 0 &&
+             header.program != AST_INVALID_ID &&
+             header.program <= header.num_entries;
+    }
+    if (ok)
+        ok = intern_symbols(base, &header, &l);
+    if (!ok) {
+        unmap_cache_file(base, size);
+        return false;
+    }
+
+    /* one chunk that holds all entries */
+    memset(tree, 0, sizeof(*tree));
+    u32 shift = 0;
+    while (((u64)1 << shift) < header.num_entries)
+        shift++;
+    tree->first_chunk_shift = shift;
+    tree->num_chunks = 1;
+    tree->chunks[0].payloads = (u32*)(base + l.payloads);
+    tree->chunks[0].tags = base + l.tags;
+    tree->chunks[0].types = base + l.types;
+    tree->num_entries = header.num_entries;
+    tree->pairs = (syntree_pair_t*)(base + l.pairs);
+    tree->num_pairs = tree->pair_capacity = header.num_pairs;
+    tree->lists = (syntree_list_t*)(base + l.lists);
+    tree->num_lists = tree->list_capacity = header.num_lists;
+    tree->wide = (u64*)(base + l.wide);
+    tree->num_wide = tree->wide_capacity = header.num_wide;
+    tree->children = (ast_id*)(base + l.children);
+    tree->num_children = tree->children_capacity = header.num_children;
+    tree->mapping = base;
+    tree->mapping_size = size;
+    /* a damaged file must not send anyone outside of the mapping */
+    if (!syntree_check(tree)) {
+        release_syntree(tree);
+        return false;
+    }
+    *program = header.program;
+    return true;
+}
+
+/* Symbol to string index + 1, open addressing with linear probing */
+typedef struct {
+    symbol_t* keys; /* SYMBOL_INVALID marks an empty slot */
+    u32* values;
+    u32 mask;
+} symbol_map_t;
+
+/* The value of a symbol that was not in the map yet is 0 */
+internal u32* symbol_map_slot(symbol_map_t* map, symbol_t symbol) {
+    u32 i = (u32)(symbol * 0x9e3779b1u) & map->mask;
+    while (map->keys[i] != SYMBOL_INVALID && map->keys[i] != symbol)
+        i = (i + 1) & map->mask;
+    if (map->keys[i] == SYMBOL_INVALID) {
+        map->keys[i] = symbol;
+        map->values[i] = 0;
+    }
+    return &map->values[i];
+}
+
+/* Writes data to path under a temporary name first */
+internal bool write_file(const char* dir, const char* path, const void* data,
+                         size_t size) {
+    mutex_lock(&temp_lock);
+    u32 counter = temp_counter++;
+    mutex_unlock(&temp_lock);
+#ifdef WIN32_BUILD
+    unsigned long pid = (unsigned long)_getpid();
+#else
+    unsigned long pid = (unsigned long)getpid();
+#endif
+    size_t length = strlen(path) + 32;
+    char* temp = malloc(length);
+    if (!temp)
+        return false;
+    snprintf(temp, length, "%s.%lu.%u.tmp", path, pid, counter);
+
+    FILE* out = fopen(temp, "wb");
+    if (!out) {
+        /* the first file in the cache creates it */
+#ifdef WIN32_BUILD
+        _mkdir(dir);
+#else
+        mkdir(dir, 0777);
+#endif
+        out = fopen(temp, "wb");
+    }
+    if (!out) {
+        free(temp);
+        return false;
+    }
+    bool ok = fwrite(data, 1, size, out) == size;
+    if (fclose(out) != 0)
+        ok = false;
+    /* on Windows rename fails if someone else was faster, which is fine */
+    if (!ok || rename(temp, path) != 0) {
+        remove(temp);
+        ok = false;
+    }
+    free(temp);
+    return ok;
+}
+
+bool ast_cache_store(const char* dir, ast_cache_key_t key,
+                     const syntree_t* tree, ast_id program) {
+    u32 n = tree->num_entries;
+    if (n == 0 || program == AST_INVALID_ID)
+        return false;
+
+    /* find the symbols, a slot for every entry is more than enough */
+    symbol_map_t map;
+    u32 slots = 16;
+    while (slots < 2 * n)
+        slots *= 2;
+    map.mask = slots - 1;
+    map.keys = calloc(slots, sizeof(symbol_t));
+    map.values = malloc(slots * sizeof(u32));
+    u32* refs = malloc(n * sizeof(u32));
+    symbol_t* strings = malloc(n * sizeof(symbol_t));
+    u8* file = NULL;
+    bool ok = map.keys && map.values && refs && strings;
+
+    cache_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.format = CACHE_FORMAT;
+    header.program = program;
+    header.compiler = compiler_key();
+    header.source_hash = key.hash;
+    header.source_size = key.size;
+    header.num_entries = n;
+    header.num_pairs = tree->num_pairs;
+    header.num_lists = tree->num_lists;
+    header.num_wide = tree->num_wide;
+    header.num_children = tree->num_children;
+
+    u64 string_bytes = 0;
+    for (u32 c = 0, i = 0; ok && c < tree->num_chunks && i < n; c++) {
+        const syntree_chunk_t* chunk = &tree->chunks[c];
+        u32 count = 1u << (tree->first_chunk_shift + c);
+        for (u32 j = 0; j < count && i < n; j++, i++) {
+            if (chunk->tags[j] == AST_LAZY_BLOCK) {
+                ok = false;
+                break;
+            }
+            symbol_t symbol = chunk->payloads[j];
+            if (!is_symbol_entry(chunk->tags[j]) || symbol == SYMBOL_INVALID)
+                continue;
+            refs[header.num_symbol_refs++] = i;
+            u32* index = symbol_map_slot(&map, symbol);
+            if (*index == 0) {
+                strings[header.num_strings++] = symbol;
+                *index = header.num_strings;
+                string_bytes += symbol_length(symbol);
+            }
+        }
+    }
+    ok = ok && string_bytes <= 0xffffffffu;
+    header.string_bytes = (u32)string_bytes;
+
+    cache_layout_t l = layout(&header);
+    if (ok)
+        file = calloc(1, l.size);
+    if (file) {
+        memcpy(file, &header, sizeof(header));
+        u32* payloads = (u32*)(file + l.payloads);
+        for (u32 c = 0, i = 0; c < tree->num_chunks && i < n; c++) {
+            const syntree_chunk_t* chunk = &tree->chunks[c];
+            u32 count = 1u << (tree->first_chunk_shift + c);
+            if (count > n - i)
+                count = n - i;
+            memcpy(payloads + i, chunk->payloads, count * sizeof(u32));
+            memcpy(file + l.tags + i, chunk->tags, count);
+            memcpy(file + l.types + i, chunk->types, count);
+            i += count;
+        }
+        /* symbols become string indices */
+        for (u32 i = 0; i < header.num_symbol_refs; i++)
+            payloads[refs[i]] = *symbol_map_slot(&map, payloads[refs[i]]) - 1;
+        if (header.num_symbol_refs > 0)
+            memcpy(file + l.symbol_refs, refs,
+                   header.num_symbol_refs * sizeof(u32));
+        if (tree->num_pairs > 0)
+            memcpy(file + l.pairs, tree->pairs,
+                   tree->num_pairs * sizeof(syntree_pair_t));
+        if (tree->num_lists > 0)
+            memcpy(file + l.lists, tree->lists,
+                   tree->num_lists * sizeof(syntree_list_t));
+        if (tree->num_wide > 0)
+            memcpy(file + l.wide, tree->wide, tree->num_wide * sizeof(u64));
+        if (tree->num_children > 0)
+            memcpy(file + l.children, tree->children,
+                   tree->num_children * sizeof(ast_id));
+        u32* starts = (u32*)(file + l.string_starts);
+        char* data = (char*)(file + l.string_data);
+        u32 at = 0;
+        for (u32 i = 0; i < header.num_strings; i++) {
+            size_t length = symbol_length(strings[i]);
+            starts[i] = at;
+            memcpy(data + at, symbol_string(strings[i]), length);
+            at += (u32)length;
+        }
+        starts[header.num_strings] = at;
+
+        char* path = cache_path(dir, key);
+        ok = path && write_file(dir, path, file, (size_t)l.size);
+        free(path);
+    } else {
+        ok = false;
+    }
+    free(file);
+    free(map.keys);
+    free(map.values);
+    free(refs);
+    free(strings);
+    return ok;
+}
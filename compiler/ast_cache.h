@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "fly.h"
+#include "parser.h"
+
+/* On-disk cache of syntax trees, so that files that did not change are
+ * neither lexed nor parsed again.
+ *
+ * A tree is stored in a file of its own in the cache directory, named
+ * after the hash of the source bytes and a key of the compiler (its
+ * version and the sizes of the tag enums). The file holds the entry
+ * arrays, the payload arrays, the child pool and the strings the tree
+ * refers to, at offsets from its start, so it is used where it is mapped
+ * without any pointer fix-ups: the arrays of the syntree_t point into the
+ * mapping. Only the identifiers and string literals have to be interned
+ * again; the file lists the entries that hold one.
+ *
+ * The cache is best effort: a file that cannot be written or does not
+ * match is ignored, and the source is parsed as usual. Files are written
+ * under a temporary name and renamed, so several compilers can share a
+ * directory. */
+
+typedef struct {
+    u64 hash;
+    u64 size;
+} ast_cache_key_t;
+
+ast_cache_key_t ast_cache_key(const char* data, size_t size);
+
+/* Maps the tree stored for key in dir, if there is one. The tree cannot
+ * grow, it is otherwise like a parsed one and is freed with
+ * release_syntree. *program is its AST_PROGRAM entry. A file with an
+ * index out of range (syntree_check) is a miss. */
+bool ast_cache_load(const char* dir, ast_cache_key_t key, syntree_t* tree,
+                    ast_id* program);
+
+/* Stores tree, whose root is program, for key in dir. The tree must not
+ * hold AST_LAZY_BLOCK entries, which refer to the source. */
+bool ast_cache_store(const char* dir, ast_cache_key_t key,
+                     const syntree_t* tree, ast_id program);
@@ -0,0 +1,163 @@
+#include "diag.h"
+#include "source.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+internal bool reserve(diag_buffer_t* diag, size_t length) {
+    if (diag->length + length + 1 <= diag->capacity)
+        return true;
+    size_t capacity = diag->capacity ? diag->capacity : 256;
+    while (capacity < diag->length + length + 1)
+        capacity *= 2;
+    char* text = realloc(diag->text, capacity);
+    if (!text)
+        return false;
+    diag->text = text;
+    diag->capacity = capacity;
+    return true;
+}
+
+void diag_vprintf(diag_buffer_t* diag, const char* fmt, va_list args) {
+    if (diag->muted)
+        return;
+    va_list copy;
+    va_copy(copy, args);
+    int length = vsnprintf(NULL, 0, fmt, copy);
+    va_end(copy);
+    if (length < 0 || !reserve(diag, (size_t)length))
+        return;
+    vsnprintf(diag->text + diag->length, (size_t)length + 1, fmt, args);
+    diag->length += (size_t)length;
+}
+
+void diag_printf(diag_buffer_t* diag, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    diag_vprintf(diag, fmt, args);
+    va_end(args);
+}
+
+/* Mutes diag once it holds max_errors errors */
+internal void too_many_errors(diag_buffer_t* diag) {
+    diag_printf(diag, "Too many errors (limit %u), the rest are not "
+                "shown.\n", diag->max_errors);
+    diag->muted = true;
+}
+
+void diag_error(diag_buffer_t* diag, const char* fmt, ...) {
+    if (diag->max_errors && !diag->muted) {
+        if (diag->num_errors == diag->max_errors) {
+            too_many_errors(diag);
+        } else {
+            if (!diag->error_offsets)
+                diag->error_offsets = malloc(diag->max_errors *
+                                             sizeof(size_t));
+            if (diag->error_offsets)
+                diag->error_offsets[diag->num_errors] = diag->length;
+        }
+    }
+    diag->num_errors++;
+    va_list args;
+    va_start(args, fmt);
+    diag_vprintf(diag, fmt, args);
+    va_end(args);
+}
+
+void diag_warning(diag_buffer_t* diag, const char* fmt, ...) {
+    diag->num_warnings++;
+    va_list args;
+    va_start(args, fmt);
+    diag_vprintf(diag, fmt, args);
+    va_end(args);
+}
+
+void diag_source_marker(diag_buffer_t* diag, location_t loc) {
+    if (diag->muted)
+        return;
+    int line, column;
+    source_get_position(loc.file, loc.offset, &line, &column);
+    u32 length;
+    const char* text = source_get_line(loc.file, line, &length);
+    if (!text)
+        return;
+    u32 start = (u32)column - 1;
+    if (start > length)
+        start = length;
+    u32 carets = loc.length;
+    if (carets > length - start)
+        carets = length - start;
+    if (carets == 0)
+        carets = 1;
+
+    /* the line, then the marker, written straight into the buffer */
+    if (!reserve(diag, (size_t)length + start + carets + 2))
+        return;
+    char* out = diag->text + diag->length;
+    memcpy(out, text, length);
+    out += length;
+    *out++ = '\n';
+    /* keep tabs, so that the carets line up */
+    for (u32 i = 0; i < start; i++)
+        *out++ = (text[i] == '\t') ? '\t' : ' ';
+    memset(out, '^', carets);
+    out += carets;
+    *out++ = '\n';
+    *out = '\0';
+    diag->length = (size_t)(out - diag->text);
+}
+
+void diag_append(diag_buffer_t* diag, const diag_buffer_t* from) {
+    size_t length = diag->muted ? 0 : from->length;
+    u32 kept = 0;
+    bool cut = false;
+    if (length > 0 && diag->max_errors && from->num_errors > 0) {
+        /* from keeps no more than its own limit */
+        kept = from->num_errors;
+        if (from->max_errors && kept > from->max_errors)
+            kept = from->max_errors;
+        u32 room = diag->max_errors - diag->num_errors;
+        if (room < kept) {
+            kept = room;
+            cut = true;
+        }
+        if (!from->error_offsets)
+            length = 0;
+        else if (cut)
+            length = from->error_offsets[kept];
+        if (!diag->error_offsets)
+            diag->error_offsets = malloc(diag->max_errors * sizeof(size_t));
+        if (diag->error_offsets) {
+            for (u32 i = 0; i < kept; i++)
+                diag->error_offsets[diag->num_errors + i] =
+                    diag->length + from->error_offsets[i];
+        }
+    }
+    if (length > 0 && reserve(diag, length)) {
+        memcpy(diag->text + diag->length, from->text, length);
+        diag->length += length;
+        diag->text[diag->length] = '\0';
+    }
+    if (cut && !diag->muted) {
+        diag->num_errors += kept;
+        too_many_errors(diag);
+        diag->num_errors += from->num_errors - kept;
+    } else {
+        diag->num_errors += from->num_errors;
+        if (from->muted)
+            diag->muted = true;
+    }
+    diag->num_warnings += from->num_warnings;
+}
+
+void diag_flush(diag_buffer_t* diag, FILE* out) {
+    if (diag->length > 0)
+        fwrite(diag->text, 1, diag->length, out);
+    diag->length = 0;
+}
+
+void diag_release(diag_buffer_t* diag) {
+    free(diag->text);
+    free(diag->error_offsets);
+    memset(diag, 0, sizeof(*diag));
+}
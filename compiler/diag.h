@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+
+#include "fly.h"
+#include "location.h"
+
+/* Diagnostics of one parse. They are collected in memory instead of
+ * being printed right away, so that a driver that parses several files
+ * at once can print them in input order. Running out of memory drops
+ * the text, the counts are always right.
+ *
+ * With max_errors set, the error after the last one that is kept adds a
+ * note and mutes the buffer: from then on messages are only counted. */
+typedef struct {
+    char* text;
+    size_t length;
+    size_t capacity;
+    u32 num_errors;
+    u32 num_warnings;
+
+    /* 0 for no limit */
+    u32 max_errors;
+    bool muted;
+    /* where each kept error begins in text, so that diag_append can cut
+     * at the limit. Only used with max_errors set. */
+    size_t* error_offsets;
+} diag_buffer_t;
+
+void diag_error(diag_buffer_t* diag, const char* fmt, ...);
+void diag_warning(diag_buffer_t* diag, const char* fmt, ...);
+/* Adds a message that is neither an error nor a warning, e.g. a note
+ * that belongs to the message before it */
+void diag_printf(diag_buffer_t* diag, const char* fmt, ...);
+void diag_vprintf(diag_buffer_t* diag, const char* fmt, va_list args);
+
+/* Adds the source line that holds loc and a row of carets under the
+ * characters of loc, clipped to that line. Does nothing if the file or
+ * line is not known. */
+void diag_source_marker(diag_buffer_t* diag, location_t loc);
+
+/* Appends the text and counts of from. Errors beyond the limit of diag
+ * are left out, as if they had been added one by one. */
+void diag_append(diag_buffer_t* diag, const diag_buffer_t* from);
+
+/* Writes out the text collected so far and forgets it. Keeps the counts. */
+void diag_flush(diag_buffer_t* diag, FILE* out);
+void diag_release(diag_buffer_t* diag);
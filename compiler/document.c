@@ -0,0 +1,476 @@
+#include "libfly.h"
+#include "lexer.h"
+#include "scan.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/* In parser.c */
+extern int init_parser_lexer(parser_t* parser, lexer_t* lexer);
+extern int continue_parser_lexer(parser_t* parser, lexer_t* lexer);
+
+/* Small documents may grow by this many entries before they are parsed
+ * again as a whole */
+#define GARBAGE_SLACK 4096
+
+typedef struct {
+    u32* values;
+    u32 count;
+    u32 capacity;
+} u32_array_t;
+
+/* Running out of memory sets doc->parser.syntree.out_of_memory, as it
+ * does in the parser. The edit that ran into it fails, and the next one
+ * parses the whole text again. */
+
+internal bool push(u32_array_t* array, u32 value) {
+    if (array->count == array->capacity) {
+        u32 capacity = array->capacity ? array->capacity * 2 : 16;
+        u32* values = realloc(array->values, capacity * sizeof(u32));
+        if (!values)
+            return false;
+        array->values = values;
+        array->capacity = capacity;
+    }
+    array->values[array->count++] = value;
+    return true;
+}
+
+/* Returns array with room for count elements of size bytes, which may
+ * have moved. If out of memory, it returns array as it was and sets
+ * tree->out_of_memory. */
+internal void* reserve(syntree_t* tree, void* array, u32* capacity,
+                       size_t size, u32 count) {
+    if (count <= *capacity)
+        return array;
+    u32 new_capacity = *capacity ? *capacity : 64;
+    while (new_capacity < count)
+        new_capacity *= 2;
+    void* grown = realloc(array, new_capacity * size);
+    if (!grown) {
+        tree->out_of_memory = true;
+        return array;
+    }
+    *capacity = new_capacity;
+    return grown;
+}
+
+/* Replaces the elements [at, at + removed) of an array of count elements
+ * of size bytes with room for inserted ones, which the caller fills in.
+ * The room has to be reserved. */
+internal void splice(void* array, u32* count, u32 capacity, size_t size,
+                     u32 at, u32 removed, u32 inserted) {
+    u32 new_count = *count - removed + inserted;
+    assert(new_count <= capacity);
+    char* bytes = array;
+    memmove(bytes + (at + inserted) * size, bytes + (at + removed) * size,
+            (*count - at - removed) * size);
+    *count = new_count;
+}
+
+internal u32 file_size(fly_document_t* doc) {
+    return (u32)source_get_file(doc->file)->size;
+}
+
+internal u32 segment_end(fly_document_t* doc, u32 segment) {
+    return (segment + 1 < doc->num_segments)
+        ? doc->segments[segment + 1].begin : file_size(doc);
+}
+
+/* Index of the segment that holds offset, the last one that begins at or
+ * before it */
+internal u32 find_segment(fly_document_t* doc, u32 offset) {
+    u32 low = 0, high = doc->num_segments;
+    while (high - low > 1) {
+        u32 mid = low + (high - low) / 2;
+        if (doc->segments[mid].begin <= offset)
+            low = mid;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/* Splits the text from begin, a segment boundary, into segments and
+ * writes their begins to begins. They end at the begin of segment *next
+ * (or the end of the file) if that is still a boundary in the new text;
+ * if not, say an edit opened a comment or a brace, segment *next is
+ * taken in and *next moves on, until they meet a boundary again.
+ * Returns false if out of memory. */
+internal bool split(fly_document_t* doc, u32 begin, u32* next,
+                    u32_array_t* begins) {
+    u32 size = file_size(doc);
+    u32 end = (*next < doc->num_segments) ? doc->segments[*next].begin : size;
+    u32 at = begin;
+    if (!push(begins, begin))
+        goto fail;
+    for (;;) {
+        u32 boundary = (at < end) ? lexer_next_boundary(doc->file, at, end)
+                                  : 0;
+        if (boundary == end)
+            break;
+        if (boundary) {
+            if (!push(begins, boundary))
+                goto fail;
+            at = boundary;
+            continue;
+        }
+        if (end == size)
+            break;
+        (*next)++;
+        end = (*next < doc->num_segments) ? doc->segments[*next].begin
+                                          : size;
+    }
+    return true;
+
+fail:
+    doc->parser.syntree.out_of_memory = true;
+    return false;
+}
+
+/* The same loop as parse_program. Adds the top-level entries to items if
+ * that is not NULL and returns their number. Sets *clean if the last
+ * declaration went without errors. Stops if out of memory. */
+internal u32 parse_items(parser_t* parser, u32_array_t* items, bool* clean) {
+    u32 count = 0;
+    *clean = true;
+    while (parser->next.tag != TOKEN_T_EOF) {
+        u32 errors = parser->diag.num_errors;
+        ast_id item = parse_top_level(parser);
+        *clean = parser->diag.num_errors == errors;
+        if (!item)
+            continue;
+        if (items && !push(items, item)) {
+            parser->syntree.out_of_memory = true;
+            break;
+        }
+        count++;
+    }
+    return count;
+}
+
+/* Lexes and parses the bytes [segment->begin, end) into the tree.
+ *
+ * Returns false if the end may not be where the whole file would be
+ * split: lexer_split only looks at brackets, comments and literals, so
+ * after an edit it may cut where the parser sees no end of a
+ * declaration, say inside a block whose '(' was deleted. The parser
+ * only looks past a declaration when it fails, so the cut is right if
+ * the last declaration has no errors and the lexer found none either. */
+internal bool parse_segment(fly_document_t* doc, fly_segment_t* segment,
+                            u32 end, u32_array_t* items) {
+    parser_t* parser = &doc->parser;
+    lexer_t lexer;
+    lexer_init_slice(&lexer, doc->file, segment->begin, end);
+    memset(&parser->diag, 0, sizeof(parser->diag));
+    segment->num_items = 0;
+    bool clean = false;
+    if (continue_parser_lexer(parser, &lexer)) {
+        bool lexed = parser->diag.num_errors == 0;
+        segment->num_items = parse_items(parser, items, &clean);
+        clean = clean && lexed;
+    }
+    lexer_release(&lexer);
+    /* a failed lexer leaves its error behind */
+    segment->diag = parser->diag;
+    memset(&parser->diag, 0, sizeof(parser->diag));
+    return clean;
+}
+
+/* Replaces segments [first, next) with new ones that begin at begins and
+ * parses them. The last one ends where segment next begins. A segment
+ * that parse_segment does not trust to end where it does is joined with
+ * the one behind it, which may take in segment next and more. Sets
+ * *behind to the index of the first segment behind the new ones.
+ *
+ * Returns false if out of memory; the segments and items are as they
+ * were then, the tree has whatever was parsed. */
+internal bool replace_segments(fly_document_t* doc, u32 first, u32 next,
+                               const u32_array_t* begins,
+                               fly_edit_result_t* result, u32* behind) {
+    syntree_t* tree = &doc->parser.syntree;
+    u32 size = file_size(doc);
+    u32 first_item = (first < doc->num_segments)
+        ? doc->segments[first].first_item : doc->num_items;
+    fly_segment_t* parsed = malloc(begins->count * sizeof(fly_segment_t));
+    if (!parsed) {
+        tree->out_of_memory = true;
+        return false;
+    }
+    u32 num_parsed = 0;
+    u32_array_t items = { 0 };
+
+    stats_phase_t phase = stats_begin(STATS_PARSE);
+    for (u32 i = 0; i < begins->count; ) {
+        fly_segment_t* segment = &parsed[num_parsed++];
+        segment->begin = begins->values[i++];
+        segment->first_item = first_item + items.count;
+        for (;;) {
+            u32 end;
+            if (i < begins->count)
+                end = begins->values[i];
+            else
+                end = (next < doc->num_segments)
+                    ? doc->segments[next].begin : size;
+            u32 mark = items.count;
+            if (parse_segment(doc, segment, end, &items) || end == size ||
+                    tree->out_of_memory)
+                break;
+            items.count = mark;
+            diag_release(&segment->diag);
+            if (i < begins->count)
+                i++;
+            else
+                next++;
+        }
+    }
+    stats_end(phase);
+
+    /* all or nothing: room for everything first */
+    u32 end_item = (next < doc->num_segments)
+        ? doc->segments[next].first_item : doc->num_items;
+    if (!tree->out_of_memory) {
+        doc->segments = reserve(tree, doc->segments, &doc->segment_capacity,
+            sizeof(fly_segment_t),
+            doc->num_segments - (next - first) + num_parsed);
+        doc->items = reserve(tree, doc->items, &doc->item_capacity,
+            sizeof(ast_id),
+            doc->num_items - (end_item - first_item) + items.count);
+    }
+    if (tree->out_of_memory) {
+        for (u32 i = 0; i < num_parsed; i++)
+            diag_release(&parsed[i].diag);
+        free(items.values);
+        free(parsed);
+        return false;
+    }
+
+    for (u32 i = first; i < next; i++)
+        diag_release(&doc->segments[i].diag);
+    splice(doc->segments, &doc->num_segments, doc->segment_capacity,
+           sizeof(fly_segment_t), first, next - first, num_parsed);
+    memcpy(doc->segments + first, parsed, num_parsed * sizeof(fly_segment_t));
+    for (u32 i = first + num_parsed; i < doc->num_segments; i++) {
+        fly_segment_t* before = &doc->segments[i - 1];
+        doc->segments[i].first_item = before->first_item + before->num_items;
+    }
+    splice(doc->items, &doc->num_items, doc->item_capacity, sizeof(ast_id),
+           first_item, end_item - first_item, items.count);
+    if (items.count > 0)
+        memcpy(doc->items + first_item, items.values,
+               items.count * sizeof(ast_id));
+    result->first = first_item;
+    result->removed = end_item - first_item;
+    result->inserted = items.count;
+    free(items.values);
+    free(parsed);
+    *behind = first + num_parsed;
+    return true;
+}
+
+/* Points the AST_PROGRAM entry at the items after result. With as many
+ * items as before, they are overwritten in place; otherwise a new list
+ * takes the place of the old one (syntree_replace). Returns false if
+ * out of memory. */
+internal bool update_program(fly_document_t* doc,
+                             const fly_edit_result_t* result) {
+    syntree_t* tree = &doc->parser.syntree;
+    if (doc->program && result->removed == result->inserted) {
+        for (u32 i = 0; i < result->inserted; i++)
+            syntree_set_child(tree, doc->program, result->first + i,
+                              doc->items[result->first + i]);
+        return true;
+    }
+    u32 mark = syntree_list_begin(tree);
+    for (u32 i = 0; i < doc->num_items; i++)
+        syntree_list_push(tree, doc->items[i]);
+    ast_id program = syntree_list_commit(tree, AST_PROGRAM, mark);
+    if (!program)
+        return false;
+    if (doc->program)
+        syntree_replace(tree, doc->program, program);
+    else
+        doc->program = program;
+    return true;
+}
+
+/* Parses the whole text into a new tree. Returns false if out of
+ * memory. */
+internal bool parse_document(fly_document_t* doc, fly_edit_result_t* result) {
+    u32 old_items = doc->num_items;
+    for (u32 i = 0; i < doc->num_segments; i++)
+        diag_release(&doc->segments[i].diag);
+    doc->num_segments = 0;
+    doc->num_items = 0;
+    release_syntree(&doc->parser.syntree);
+    doc->program = AST_INVALID_ID;
+    /* about one entry every 18 bytes, as in init_parser_lexer */
+    if (!init_syntree(&doc->parser.syntree, file_size(doc) / 18)) {
+        doc->parser.syntree.out_of_memory = true;
+        return false;
+    }
+
+    u32_array_t begins = { 0 };
+    u32 next = 0, behind;
+    bool ok = split(doc, 0, &next, &begins) &&
+              replace_segments(doc, 0, 0, &begins, result, &behind) &&
+              update_program(doc, result);
+    free(begins.values);
+    if (!ok)
+        return false;
+    result->removed = old_items;
+    result->full = true;
+    doc->base_entries = doc->parser.syntree.num_entries;
+    doc->base_children = doc->parser.syntree.num_children;
+    return true;
+}
+
+bool fly_open_document(const char* name, const char* data, size_t length,
+                       fly_document_t* doc) {
+    memset(doc, 0, sizeof(*doc));
+    doc->file = source_add_buffer(name, data, length);
+    if (doc->file == INVALID_FILE_ID)
+        return false;
+    trace_begin_string("open", name);
+    fly_edit_result_t result;
+    bool ok = parse_document(doc, &result);
+    trace_end();
+    if (!ok)
+        fly_close_document(doc);
+    return ok;
+}
+
+/* Parses a segment once more, into a tree of its own, for up to date
+ * diagnostics: they quote line, column and the line's text. Keeps the
+ * old ones if out of memory. */
+internal void refresh_segment(fly_document_t* doc, u32 index) {
+    fly_segment_t* segment = &doc->segments[index];
+    if (segment->diag.num_errors == 0 && segment->diag.num_warnings == 0)
+        return;
+    parser_t parser;
+    memset(&parser, 0, sizeof(parser));
+    lexer_t lexer;
+    lexer_init_slice(&lexer, doc->file, segment->begin,
+                     segment_end(doc, index));
+    bool clean;
+    if (init_parser_lexer(&parser, &lexer))
+        parse_items(&parser, NULL, &clean);
+    lexer_release(&lexer);
+    if (parser.syntree.out_of_memory) {
+        release_parser(&parser);
+        return;
+    }
+    diag_release(&segment->diag);
+    segment->diag = parser.diag;
+    memset(&parser.diag, 0, sizeof(parser.diag));
+    release_parser(&parser);
+}
+
+/* Brings the diagnostics of the segments around the new ones [first,
+ * behind) up to date, so that the entries of the document keep their
+ * ids: those that share a line with the new segments, and all behind
+ * them if the edit added or removed lines. */
+internal void refresh_diag(fly_document_t* doc, u32 first, u32 behind,
+                           bool lines_moved) {
+    source_file_t* source = source_get_file(doc->file);
+    u32 line_start = doc->segments[first].begin;
+    while (line_start > 0 && source->data[line_start - 1] != '\n')
+        line_start--;
+    /* segment i - 1 ends where segment i begins */
+    for (u32 i = first; i > 0 && doc->segments[i].begin > line_start; i--)
+        refresh_segment(doc, i - 1);
+    if (behind >= doc->num_segments)
+        return;
+    u32 line_end = (u32)source->size;
+    if (!lines_moved) {
+        u32 begin = doc->segments[behind].begin;
+        const char* newline = memchr(source->data + begin, '\n',
+                                     source->size - begin);
+        if (newline)
+            line_end = (u32)(newline - source->data);
+    }
+    for (u32 i = behind; i < doc->num_segments &&
+            doc->segments[i].begin <= line_end; i++)
+        refresh_segment(doc, i);
+}
+
+bool fly_edit_document(fly_document_t* doc, const fly_edit_t* edit,
+                       fly_edit_result_t* result) {
+    fly_edit_result_t ignored;
+    if (!result)
+        result = &ignored;
+    memset(result, 0, sizeof(*result));
+    source_file_t* source = source_get_file(doc->file);
+    if (edit->offset > source->size ||
+            edit->removed > source->size - edit->offset)
+        return false;
+    const char* removed = source->data + edit->offset;
+    int lines = -(int)scan_count_newlines(removed, removed + edit->removed);
+    if (edit->length > 0)
+        lines += (int)scan_count_newlines(edit->inserted,
+                                          edit->inserted + edit->length);
+
+    /* after running out of memory the segments may be out of date */
+    syntree_t* tree = &doc->parser.syntree;
+    bool full = tree->out_of_memory ||
+                tree->num_entries > 2 * doc->base_entries + GARBAGE_SLACK ||
+                tree->num_children > 2 * doc->base_children + GARBAGE_SLACK;
+    /* the segments the edit touches, with the ones that just end or begin
+     * where it does: the edit may join their tokens */
+    u32 first = 0, last = 0;
+    if (!full) {
+        first = find_segment(doc, edit->offset);
+        if (first > 0 && doc->segments[first].begin == edit->offset)
+            first--;
+        last = find_segment(doc, edit->offset + edit->removed);
+    }
+    if (!source_edit_buffer(doc->file, edit->offset, edit->removed,
+                            edit->inserted, edit->length))
+        return false;
+
+    trace_begin("edit", SYMBOL_INVALID);
+    bool ok;
+    if (full) {
+        ok = parse_document(doc, result);
+    } else {
+        u32 delta = edit->length - edit->removed; /* modulo 2^32 */
+        for (u32 i = last + 1; i < doc->num_segments; i++)
+            doc->segments[i].begin += delta;
+
+        u32_array_t begins = { 0 };
+        u32 next = last + 1, behind;
+        ok = split(doc, doc->segments[first].begin, &next, &begins) &&
+             replace_segments(doc, first, next, &begins, result, &behind) &&
+             update_program(doc, result);
+        if (ok)
+            refresh_diag(doc, first, behind, lines != 0);
+        free(begins.values);
+    }
+    trace_end();
+    if (!ok)
+        memset(result, 0, sizeof(*result));
+    return ok;
+}
+
+void fly_document_diag(fly_document_t* doc, u32 max_errors,
+                       diag_buffer_t* diag) {
+    memset(diag, 0, sizeof(*diag));
+    diag->max_errors = max_errors;
+    for (u32 i = 0; i < doc->num_segments; i++)
+        diag_append(diag, &doc->segments[i].diag);
+}
+
+void fly_close_document(fly_document_t* doc) {
+    for (u32 i = 0; i < doc->num_segments; i++)
+        diag_release(&doc->segments[i].diag);
+    free(doc->segments);
+    free(doc->items);
+    release_parser(&doc->parser);
+    if (doc->file != INVALID_FILE_ID)
+        source_release_file(doc->file);
+    memset(doc, 0, sizeof(*doc));
+    doc->file = INVALID_FILE_ID;
+}
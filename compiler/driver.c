@@ -0,0 +1,610 @@
+#ifndef WIN32_BUILD
+#define _XOPEN_SOURCE 700 /* realpath */
+#endif
+
+#include "driver.h"
+#include "parser.h"
+#include "ast_cache.h"
+#include "source.h"
+#include "dump.h"
+#include "scan.h"
+#include "thread.h"
+#include "intern.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/* add_unit ran out of memory */
+#define NO_UNIT 0xffffffffu
+
+enum {
+    MARK_NONE,
+    MARK_ACTIVE,  /* on the output stack */
+    MARK_WRITTEN,
+};
+
+typedef struct {
+    char* path;
+    bool owns_path;
+    /* canonical path, SYMBOL_INVALID if the file does not exist */
+    symbol_t key;
+    parser_t parser;
+    ast_id program;
+    diag_buffer_t diag;
+    /* units named by the #loads of this one, in source order */
+    u32* loads;
+    u32 num_loads;
+    /* split across file_threads, for the only input file */
+    bool split;
+    bool done;
+    u8 mark;
+    /* position in the output */
+    u32 order;
+    stats_t stats;
+} unit_t;
+
+/* A #load that was found on disk, before it is looked up in the table */
+typedef struct {
+    char* path;
+    symbol_t key;
+} module_ref_t;
+
+typedef struct {
+    u32 unit;
+    u32 next_load;
+} visit_t;
+
+typedef struct {
+    /* pointers, so that workers can use a unit while the array grows */
+    unit_t** units;
+    u32 num_units;
+    u32 unit_capacity;
+    u32 next_unit;   /* next one to parse */
+    u32 busy;        /* units being parsed */
+    u32 num_failed;
+
+    /* key -> unit index + 1, open addressing */
+    u32* slots;
+    u32 slot_mask;
+
+    /* unit of every input file, NO_UNIT if it could not be added */
+    u32* inputs;
+    char** input_paths;
+    u32 num_inputs;
+    /* depth-first output, resumed whenever a unit is done */
+    u32 next_input;
+    /* a unit is on it at most once, add_unit makes room for it */
+    visit_t* stack;
+    u32 depth;
+    u32 stack_capacity;
+    u32 num_written;
+
+    /* threads for the only input file */
+    u32 file_threads;
+    thread_t* threads;
+    u32 num_threads;
+    u32 started;
+    const driver_options_t* options;
+    FILE* out;
+    FILE* err;
+    mutex_t lock;
+    condvar_t work;
+} driver_t;
+
+internal int worker(void* arg);
+
+#ifdef WIN32_BUILD
+internal char* canonical_path(const char* path) {
+    if (GetFileAttributesA(path) == INVALID_FILE_ATTRIBUTES)
+        return NULL;
+    return _fullpath(NULL, path, 0);
+}
+
+internal bool is_separator(char c) {
+    return c == '/' || c == '\\';
+}
+#else
+internal char* canonical_path(const char* path) {
+    return realpath(path, NULL);
+}
+
+internal bool is_separator(char c) {
+    return c == '/';
+}
+#endif
+
+internal symbol_t path_key(const char* path) {
+    char* canonical = canonical_path(path);
+    if (!canonical)
+        return SYMBOL_INVALID;
+    symbol_t key = intern_string(canonical, strlen(canonical));
+    free(canonical);
+    return key;
+}
+
+/* Caller holds the lock */
+internal u32* find_slot(driver_t* driver, symbol_t key) {
+    u32 i = (key * 2654435761u) & driver->slot_mask;
+    while (driver->slots[i] &&
+            driver->units[driver->slots[i] - 1]->key != key)
+        i = (i + 1) & driver->slot_mask;
+    return &driver->slots[i];
+}
+
+/* Caller holds the lock. Starts another worker for every queued unit,
+ * up to the thread count; the calling thread is the first worker. */
+internal void start_workers(driver_t* driver) {
+    while (driver->started + 1 < driver->num_threads &&
+            driver->started + 1 < driver->num_units) {
+        if (!thread_create(&driver->threads[driver->started + 1],
+                           worker, driver))
+            break;
+        driver->started++;
+    }
+}
+
+/* Caller holds the lock. Queues a unit for path, or returns the one that
+ * has the same key. Takes over path if owns_path is set, and frees it
+ * if it returns NO_UNIT: out of memory. */
+internal u32 add_unit(driver_t* driver, char* path, bool owns_path,
+                      symbol_t key) {
+    if (key != SYMBOL_INVALID) {
+        u32 slot = *find_slot(driver, key);
+        if (slot) {
+            if (owns_path)
+                free(path);
+            return slot - 1;
+        }
+    }
+
+    /* the arrays only grow, so giving up halfway leaves them intact */
+    if (driver->num_units == driver->unit_capacity) {
+        u32 capacity = driver->unit_capacity ? driver->unit_capacity * 2 : 16;
+        unit_t** units = realloc(driver->units, capacity * sizeof(unit_t*));
+        if (!units)
+            goto fail;
+        driver->units = units;
+        driver->unit_capacity = capacity;
+    }
+    if (driver->num_units == driver->stack_capacity) {
+        u32 capacity = driver->stack_capacity ? driver->stack_capacity * 2 : 16;
+        visit_t* stack = realloc(driver->stack, capacity * sizeof(visit_t));
+        if (!stack)
+            goto fail;
+        driver->stack = stack;
+        driver->stack_capacity = capacity;
+    }
+    if ((driver->num_units + 1) * 2 > driver->slot_mask + 1) {
+        /* keep the table at most half full */
+        u32 old_size = driver->slot_mask + 1;
+        u32* old_slots = driver->slots;
+        u32* slots = calloc(old_size * 2, sizeof(u32));
+        if (!slots)
+            goto fail;
+        driver->slots = slots;
+        driver->slot_mask = old_size * 2 - 1;
+        for (u32 i = 0; i < old_size; i++) {
+            if (old_slots[i])
+                *find_slot(driver, driver->units[old_slots[i] - 1]->key) =
+                    old_slots[i];
+        }
+        free(old_slots);
+    }
+
+    unit_t* unit = calloc(1, sizeof(unit_t));
+    if (!unit)
+        goto fail;
+    unit->path = path;
+    unit->owns_path = owns_path;
+    unit->key = key;
+    u32 index = driver->num_units++;
+    driver->units[index] = unit;
+    if (key != SYMBOL_INVALID)
+        *find_slot(driver, key) = index + 1;
+    start_workers(driver);
+    condvar_signal(&driver->work);
+    return index;
+
+fail:
+    if (owns_path)
+        free(path);
+    return NO_UNIT;
+}
+
+/* Looks the file up in the AST cache. On a miss *key is what the tree
+ * is stored under after parsing, and *keyed is set unless the file could
+ * not be loaded. */
+internal bool load_cached(const char* dir, unit_t* unit, ast_cache_key_t* key,
+                          bool* keyed) {
+    file_id_t file = source_load_file(unit->path);
+    if (file == INVALID_FILE_ID)
+        return false; /* parse_unit reports it */
+    *keyed = true;
+    stats_phase_t phase = stats_begin(STATS_READ);
+    trace_begin_string("cache load", unit->path);
+    const source_file_t* source = source_get_file(file);
+    *key = ast_cache_key(source->data, source->size);
+    bool hit = ast_cache_load(dir, *key, &unit->parser.syntree,
+                              &unit->program);
+    if (hit)
+        unit->parser.file = file;
+    stats_count(hit ? STATS_CACHE_HITS : STATS_CACHE_MISSES, 1);
+    trace_end();
+    stats_end(phase);
+    return hit;
+}
+
+internal void parse_unit(driver_t* driver, unit_t* unit) {
+    parser_t* parser = &unit->parser;
+    memset(parser, 0, sizeof(*parser));
+    parser->lazy_bodies = driver->options->lazy_bodies;
+    parser->max_errors = driver->options->max_errors;
+    /* skipped bodies refer to the source, such trees are not cached */
+    const char* cache_dir = parser->lazy_bodies ? NULL
+                                                : driver->options->cache_dir;
+    ast_cache_key_t key;
+    bool keyed = false;
+    if (cache_dir && load_cached(cache_dir, unit, &key, &keyed)) {
+        memset(&unit->diag, 0, sizeof(unit->diag));
+        return;
+    }
+    if (unit->split) {
+        unit->program = parse_program_parallel(parser, unit->path,
+                                               driver->file_threads);
+    } else if (init_parser(parser, unit->path)) {
+        unit->program = parse_program(parser);
+    } else {
+        bool out_of_memory = parser->syntree.out_of_memory;
+        memset(parser, 0, sizeof(*parser));
+        parser->syntree.out_of_memory = out_of_memory;
+        unit->program = AST_INVALID_ID;
+    }
+    /* the diagnostics outlive the tree if it is not dumped */
+    unit->diag = parser->diag;
+    memset(&parser->diag, 0, sizeof(parser->diag));
+    if (parser->syntree.out_of_memory)
+        diag_error(&unit->diag, "Out of memory while parsing %s\n",
+                   unit->path);
+    else if (!unit->program && unit->diag.num_errors == 0)
+        diag_error(&unit->diag, "Could not read %s\n", unit->path);
+
+    /* only trees without diagnostics, which would be lost */
+    if (keyed && unit->program && unit->diag.num_errors == 0 &&
+            unit->diag.num_warnings == 0) {
+        stats_phase_t phase = stats_begin(STATS_OUTPUT);
+        trace_begin_string("cache store", unit->path);
+        ast_cache_store(cache_dir, key, &parser->syntree, unit->program);
+        trace_end();
+        stats_end(phase);
+    }
+}
+
+/* Returns name.fly in the directory dir (length bytes), or NULL if there
+ * is no such file or *out_of_memory was set */
+internal char* try_module(const char* dir, size_t length, const char* name,
+                          symbol_t* key, bool* out_of_memory) {
+    size_t name_length = strlen(name);
+    char* path = malloc(length + name_length + 6);
+    if (!path) {
+        *out_of_memory = true;
+        return NULL;
+    }
+    memcpy(path, dir, length);
+    if (length > 0 && !is_separator(dir[length - 1]))
+        path[length++] = '/';
+    memcpy(path + length, name, name_length);
+    memcpy(path + length + name_length, ".fly", 5);
+    *key = path_key(path);
+    if (*key == SYMBOL_INVALID) {
+        free(path);
+        return NULL;
+    }
+    return path;
+}
+
+/* Looks for the module of every #load in the unit, without the lock.
+ * Modules that cannot be found are reported on the unit, and so is
+ * running out of memory. */
+internal module_ref_t* find_modules(driver_t* driver, unit_t* unit,
+                                    u32* num_refs) {
+    *num_refs = 0;
+    if (!unit->program)
+        return NULL;
+    syntree_t* tree = &unit->parser.syntree;
+    u32 count;
+    const ast_id* loads = syntree_get_tagged(tree, AST_META_LOAD, &count);
+    module_ref_t* refs = (count > 0) ? malloc(count * sizeof(module_ref_t))
+                                     : NULL;
+    if (tree->out_of_memory || (count > 0 && !refs)) {
+        diag_error(&unit->diag, "Out of memory while looking for the "
+                   "modules of %s\n", unit->path);
+        return NULL;
+    }
+    if (count == 0)
+        return NULL;
+
+    /* the directory of the loading file comes first */
+    size_t dir_length = strlen(unit->path);
+    while (dir_length > 0 && !is_separator(unit->path[dir_length - 1]))
+        dir_length--;
+
+    for (u32 i = 0; i < count; i++) {
+        ast_id id = syntree_get_entry(tree, loads[i]).value.tag;
+        if (!id)
+            continue; /* syntax error, already reported */
+        symbol_t symbol = syntree_get_entry(tree, id).value.symbol;
+        const char* name = symbol_string(symbol);
+        module_ref_t* ref = &refs[*num_refs];
+        bool out_of_memory = false;
+        ref->path = try_module(unit->path, dir_length, name, &ref->key,
+                               &out_of_memory);
+        const driver_options_t* options = driver->options;
+        for (u32 j = 0; !ref->path && !out_of_memory &&
+                j < options->num_search_paths; j++) {
+            const char* dir = options->search_paths[j];
+            ref->path = try_module(dir, strlen(dir), name, &ref->key,
+                                   &out_of_memory);
+        }
+        if (ref->path)
+            (*num_refs)++;
+        else if (out_of_memory)
+            diag_error(&unit->diag, "Out of memory while looking for module "
+                       "%s loaded by %s\n", name, unit->path);
+        else
+            diag_error(&unit->diag, "Could not find module %s loaded by %s\n",
+                       name, unit->path);
+    }
+    return refs;
+}
+
+/* Caller holds the lock. The unit at depth is already on the stack. */
+internal void report_cycle(driver_t* driver, u32 depth) {
+    unit_t* last = driver->units[driver->stack[driver->depth - 1].unit];
+    diag_warning(&last->diag, "#load cycle: ");
+    for (u32 i = depth; i < driver->depth; i++)
+        diag_printf(&last->diag, "%s -> ",
+                    driver->units[driver->stack[i].unit]->path);
+    diag_printf(&last->diag, "%s\n",
+                driver->units[driver->stack[depth].unit]->path);
+}
+
+internal void push_visit(driver_t* driver, u32 index) {
+    assert(driver->depth < driver->stack_capacity);
+    driver->stack[driver->depth++] = (visit_t){ .unit = index };
+    driver->units[index]->mark = MARK_ACTIVE;
+}
+
+/* Counts the entries of each tag, with --stats */
+internal void count_nodes(unit_t* unit) {
+    if (!stats_enabled || !unit->program)
+        return;
+    syntree_t* tree = &unit->parser.syntree;
+    for (u32 tag = 0; tag < AST_TAG_COUNT; tag++) {
+        u32 count;
+        syntree_get_tagged(tree, (synentry_tag_t)tag, &count);
+        unit->stats.nodes[tag] += count;
+        unit->stats.counters[STATS_NODES] += count;
+    }
+}
+
+internal void write_unit(driver_t* driver, unit_t* unit) {
+    stats_attach(&unit->stats);
+    stats_phase_t phase = stats_begin(STATS_OUTPUT);
+    trace_begin_string("output", unit->path);
+    diag_flush(&unit->diag, driver->err);
+    bool failed = !unit->program || unit->diag.num_errors > 0;
+    if (unit->program && driver->options->dump_ast &&
+            !dump_ast(&unit->parser.syntree, unit->program, driver->out)) {
+        fprintf(driver->err, "Out of memory while writing %s\n", unit->path);
+        failed = true;
+    }
+    if (failed)
+        driver->num_failed++;
+    if (driver->options->dump_ast)
+        release_parser(&unit->parser);
+    diag_release(&unit->diag);
+    unit->mark = MARK_WRITTEN;
+    unit->order = driver->num_written++;
+    trace_end();
+    stats_end(phase);
+    stats_attach(NULL);
+}
+
+/* Caller holds the lock. Continues the depth-first walk over the inputs
+ * and their #loads and writes out every unit whose loads are all written,
+ * until it reaches a unit that is not parsed yet. */
+internal void write_finished(driver_t* driver) {
+    for (;;) {
+        if (driver->depth == 0) {
+            if (driver->next_input == driver->num_inputs)
+                return;
+            u32 index = driver->inputs[driver->next_input];
+            if (index == NO_UNIT) {
+                fprintf(driver->err, "Out of memory, %s was not parsed\n",
+                        driver->input_paths[driver->next_input]);
+                driver->num_failed++;
+                driver->next_input++;
+            } else if (driver->units[index]->mark == MARK_WRITTEN) {
+                driver->next_input++;
+            } else if (driver->units[index]->done) {
+                driver->next_input++;
+                push_visit(driver, index);
+            } else {
+                return;
+            }
+            continue;
+        }
+
+        visit_t* top = &driver->stack[driver->depth - 1];
+        unit_t* unit = driver->units[top->unit];
+        if (top->next_load == unit->num_loads) {
+            driver->depth--;
+            write_unit(driver, unit);
+            continue;
+        }
+        u32 index = unit->loads[top->next_load];
+        unit_t* module = driver->units[index];
+        if (module->mark == MARK_WRITTEN) {
+            top->next_load++;
+        } else if (module->mark == MARK_ACTIVE) {
+            top->next_load++;
+            u32 depth = 0;
+            while (driver->stack[depth].unit != index)
+                depth++;
+            report_cycle(driver, depth);
+        } else if (module->done) {
+            top->next_load++;
+            push_visit(driver, index);
+        } else {
+            return;
+        }
+    }
+}
+
+internal int worker(void* arg) {
+    driver_t* driver = arg;
+    mutex_lock(&driver->lock);
+    for (;;) {
+        if (driver->next_unit < driver->num_units) {
+            unit_t* unit = driver->units[driver->next_unit++];
+            driver->busy++;
+            mutex_unlock(&driver->lock);
+
+            stats_attach(&unit->stats);
+            trace_begin_string("file", unit->path);
+            parse_unit(driver, unit);
+            u32 num_refs;
+            module_ref_t* refs = find_modules(driver, unit, &num_refs);
+            trace_end();
+            count_nodes(unit);
+            if (!driver->options->dump_ast)
+                release_parser(&unit->parser);
+            stats_attach(NULL);
+
+            mutex_lock(&driver->lock);
+            if (num_refs > 0)
+                unit->loads = malloc(num_refs * sizeof(u32));
+            bool lost = false;
+            for (u32 i = 0; i < num_refs; i++) {
+                u32 index = NO_UNIT;
+                if (unit->loads)
+                    index = add_unit(driver, refs[i].path, true, refs[i].key);
+                else
+                    free(refs[i].path);
+                if (index != NO_UNIT)
+                    unit->loads[unit->num_loads++] = index;
+                else
+                    lost = true;
+            }
+            if (lost)
+                diag_error(&unit->diag, "Out of memory while loading the "
+                           "modules of %s\n", unit->path);
+            free(refs);
+            unit->done = true;
+            driver->busy--;
+            write_finished(driver);
+            if (driver->busy == 0 && driver->next_unit == driver->num_units)
+                condvar_broadcast(&driver->work);
+        } else if (driver->busy == 0) {
+            break;
+        } else {
+            trace_begin("wait", SYMBOL_INVALID);
+            condvar_wait(&driver->work, &driver->lock);
+            trace_end();
+        }
+    }
+    mutex_unlock(&driver->lock);
+    return 0;
+}
+
+internal void print_stats(driver_t* driver, u64 wall_ns) {
+    stats_t* stats = malloc(driver->num_units * sizeof(stats_t));
+    const char** paths = malloc(driver->num_units * sizeof(char*));
+    if (!stats || !paths) {
+        fprintf(driver->err, "Out of memory, no statistics\n");
+        free(paths);
+        free(stats);
+        return;
+    }
+    for (u32 i = 0; i < driver->num_units; i++) {
+        unit_t* unit = driver->units[i];
+        stats[unit->order] = unit->stats;
+        paths[unit->order] = unit->path;
+    }
+    const char* tag_names[AST_TAG_COUNT];
+    for (u32 tag = 0; tag < AST_TAG_COUNT; tag++)
+        tag_names[tag] = ast_tag_name((synentry_tag_t)tag);
+    stats_print(driver->options->stats_out, driver->options->stats_format,
+                wall_ns, stats, paths, driver->num_units,
+                tag_names, AST_TAG_COUNT);
+    free(paths);
+    free(stats);
+}
+
+u32 driver_parse_files(char** files, u32 num_files,
+                       const driver_options_t* options,
+                       FILE* out, FILE* err) {
+    if (num_files == 0)
+        return 0;
+    stats_enabled = options->stats_out != NULL;
+    u64 start = stats_now();
+    driver_t driver = {
+        .num_threads = options->num_threads ? options->num_threads
+                                            : thread_cpu_count(),
+        .options = options,
+        .out = out,
+        .err = err,
+    };
+    driver.file_threads = driver.num_threads;
+    driver.threads = calloc(driver.num_threads, sizeof(thread_t));
+    driver.inputs = malloc(num_files * sizeof(u32));
+    driver.slots = calloc(16, sizeof(u32));
+    if (!driver.threads || !driver.inputs || !driver.slots) {
+        fprintf(err, "Out of memory!\n");
+        free(driver.slots);
+        free(driver.inputs);
+        free(driver.threads);
+        return num_files;
+    }
+    driver.input_paths = files;
+    driver.slot_mask = 15;
+    mutex_init(&driver.lock);
+    condvar_init(&driver.work);
+    scan_init();
+
+    mutex_lock(&driver.lock);
+    for (u32 i = 0; i < num_files; i++)
+        driver.inputs[i] = add_unit(&driver, files[i], false,
+                                    path_key(files[i]));
+    driver.num_inputs = num_files;
+    if (num_files == 1 && driver.inputs[0] != NO_UNIT)
+        driver.units[0]->split = driver.num_threads > 1;
+    /* inputs that could not be added come first */
+    write_finished(&driver);
+    mutex_unlock(&driver.lock);
+
+    /* the calling thread is one of the workers */
+    worker(&driver);
+    for (u32 i = 1; i <= driver.started; i++)
+        thread_join(&driver.threads[i]);
+    if (options->stats_out)
+        print_stats(&driver, stats_now() - start);
+
+    for (u32 i = 0; i < driver.num_units; i++) {
+        unit_t* unit = driver.units[i];
+        if (unit->owns_path)
+            free(unit->path);
+        free(unit->loads);
+        free(unit);
+    }
+    free(driver.units);
+    free(driver.slots);
+    free(driver.inputs);
+    free(driver.stack);
+    free(driver.threads);
+    condvar_destroy(&driver.work);
+    mutex_destroy(&driver.lock);
+    return driver.num_failed;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "fly.h"
+#include "stats.h"
+
+typedef struct {
+    /* worker threads, 0 for one per CPU */
+    u32 num_threads;
+    bool lazy_bodies;
+    bool dump_ast;
+    /* errors reported per file before its parse stops, 0 for no limit */
+    u32 max_errors;
+    /* directory of the AST cache (ast_cache.h), NULL for none. Not used
+     * with lazy_bodies. */
+    const char* cache_dir;
+    /* directories searched for #load modules after the directory of the
+     * loading file, in order */
+    char** search_paths;
+    u32 num_search_paths;
+    /* where --stats goes, NULL for none */
+    FILE* stats_out;
+    stats_format_t stats_format;
+} driver_options_t;
+
+/* Parses every file in files, and every module they #load, on a pool of
+ * worker threads; each worker parses one file at a time with its own
+ * parser. A single file is split across the threads instead
+ * (parse_program_parallel).
+ *
+ * #load name reads name.fly. A module is queued as soon as the file that
+ * loads it is parsed and is parsed only once, however many files load
+ * it; files are told apart by their canonical path.
+ *
+ * The output of a file, its diagnostics on err and its syntax tree on out
+ * if dump_ast is set, comes in depth-first order: the modules a file
+ * loads, in the order of its #loads, then the file itself, then the next
+ * input file. Each is written as soon as everything before it is done,
+ * so the order does not depend on the schedule. A #load cycle is reported
+ * as a warning on the file that closes it.
+ *
+ * With stats_out set, the times and counters of each file are collected
+ * and reported there at the end, files in output order.
+ * Returns the number of files that could not be read or had errors. */
+u32 driver_parse_files(char** files, u32 num_files,
+                       const driver_options_t* options,
+                       FILE* out, FILE* err);
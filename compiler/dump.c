@@ -0,0 +1,262 @@
+#include "dump.h"
+#include "fly.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#define DUMP_BUFFER_SIZE (1024 * 1024)
+
+typedef struct {
+    FILE* file;
+    /* NULL if there was no memory for it, writes go straight to file */
+    char* buffer;
+    size_t used;
+
+    /* children left to print on each level above the current entry */
+    u32* remaining;
+    u32 depth;
+    u32 max_depth;
+    /* out of memory for remaining, nothing is written from then on */
+    bool failed;
+} dump_ctx_t;
+
+internal void flush(dump_ctx_t* ctx) {
+    fwrite(ctx->buffer, 1, ctx->used, ctx->file);
+    ctx->used = 0;
+}
+
+internal void write_bytes(dump_ctx_t* ctx, const char* s, size_t length) {
+    if (!ctx->buffer) {
+        fwrite(s, 1, length, ctx->file);
+        return;
+    }
+    if (ctx->used + length > DUMP_BUFFER_SIZE) {
+        flush(ctx);
+        if (length > DUMP_BUFFER_SIZE) {
+            fwrite(s, 1, length, ctx->file);
+            return;
+        }
+    }
+    memcpy(ctx->buffer + ctx->used, s, length);
+    ctx->used += length;
+}
+
+internal void write_string(dump_ctx_t* ctx, const char* s) {
+    write_bytes(ctx, s, strlen(s));
+}
+
+internal void write_indent(dump_ctx_t* ctx, u32 depth) {
+    local_persist const char spaces[] = "                                ";
+    size_t n = (size_t)depth * 4;
+    while (n > 0) {
+        size_t chunk = (n < sizeof(spaces) - 1) ? n : sizeof(spaces) - 1;
+        write_bytes(ctx, spaces, chunk);
+        n -= chunk;
+    }
+}
+
+#define OPERATOR_SPELLING(tag, spelling, kinds, precedence, assoc) \
+        case tag: return spelling;
+
+internal const char* operator_spelling(token_tag_t op) {
+    switch (op) {
+        FLY_OPERATORS(OPERATOR_SPELLING)
+        default: return NULL;
+    }
+}
+
+#undef OPERATOR_SPELLING
+
+/* Names of the entries that are printed without a value */
+global_variable const char* tag_names[AST_TAG_COUNT] = {
+    [AST_FIELD_ACCESS] = ".",
+    [AST_STRUCT] = "struct",
+    [AST_UNION] = "union",
+    [AST_ENUM] = "enum",
+    [AST_FIELD] = "field",
+    [AST_ARRAY] = "array",
+    [AST_POINTER] = "pointer",
+    [AST_FUNC_TYPE] = "func type",
+    [AST_AUTO] = "auto",
+    [AST_IF] = "if",
+    [AST_ELSE_IF] = "else if",
+    [AST_ELSE] = "else",
+    [AST_FOR] = "for",
+    [AST_WHILE] = "while",
+    [AST_DO_WHILE] = "do",
+    [AST_SWITCH] = "switch",
+    [AST_CASE] = "case",
+    [AST_DEFAULT] = "default",
+    [AST_RETURN] = "return",
+    [AST_DEFER] = "defer",
+    [AST_INFIX_EXPR] = "infix_exp",
+    [AST_PREFIX_EXPR] = "prefix_exp",
+    [AST_POSTFIX_EXPR] = "postfix_exp",
+    [AST_ASSIGN] = "assign",
+    [AST_CAST] = "cast",
+    [AST_CALL] = "call",
+    [AST_CALL_PARAM] = "call param",
+    [AST_ARRAY_ACCESS] = "array access",
+    [AST_META_LOAD] = "#load",
+    [AST_META_RUN] = "#run",
+    [AST_ANNOTATION] = "annotation",
+    [AST_VAR_DECL] = "let",
+    [AST_FUNC_DECL] = "fn",
+    [AST_TYPE_DECL] = "type",
+    [AST_EXT_FUNC_DECL] = "extern fn",
+    [AST_BLOCK] = "block",
+    [AST_CAPTURE] = "capture",
+    [AST_LAZY_BLOCK] = "lazy block",
+    [AST_FUNCTION] = "function",
+    [AST_FUNC_PARAMS] = "func params",
+    [AST_FUNC_PARAM] = "param",
+    [AST_RET_TYPE] = "return types",
+    [AST_ELLIPSIS] = "...",
+    [AST_PROGRAM] = "program",
+};
+
+const char* ast_tag_name(synentry_tag_t tag) {
+    switch (tag) {
+        case AST_CONST_INT: return "int";
+        case AST_CONST_UINT: return "uint";
+        case AST_CONST_INTL: return "long";
+        case AST_CONST_UINTL: return "ulong";
+        case AST_CONST_FLOAT32: return "f32";
+        case AST_CONST_FLOAT64: return "f64";
+        case AST_CONST_BOOL: return "bool";
+        case AST_CONST_CHAR: return "char";
+        case AST_CONST_STRING: return "string";
+        case AST_ID: return "id";
+        case AST_OPERATOR: return "operator";
+        default: return (tag < AST_TAG_COUNT) ? tag_names[tag] : NULL;
+    }
+}
+
+internal void write_entry(dump_ctx_t* ctx, const synentry_t* entry) {
+    char number[64];
+    switch (entry->tag) {
+        case AST_CONST_INT:
+            snprintf(number, sizeof(number), "%" PRId32, entry->value.integer);
+            write_string(ctx, number);
+            break;
+        case AST_CONST_UINT:
+            snprintf(number, sizeof(number), "%" PRIu32 "u",
+                     entry->value.unsigned_int);
+            write_string(ctx, number);
+            break;
+        case AST_CONST_INTL:
+            snprintf(number, sizeof(number), "%" PRId64 "L",
+                     entry->value.long_int);
+            write_string(ctx, number);
+            break;
+        case AST_CONST_UINTL:
+            snprintf(number, sizeof(number), "%" PRIu64 "uL",
+                     entry->value.unsigned_long);
+            write_string(ctx, number);
+            break;
+        case AST_CONST_FLOAT32:
+            snprintf(number, sizeof(number), "%.9gf",
+                     (double)entry->value.float32);
+            write_string(ctx, number);
+            break;
+        case AST_CONST_FLOAT64:
+            snprintf(number, sizeof(number), "%.17g", entry->value.float64);
+            write_string(ctx, number);
+            break;
+        case AST_CONST_BOOL:
+            write_string(ctx, entry->value.boolean ? "true" : "false");
+            break;
+        case AST_CONST_CHAR:
+            write_bytes(ctx, "'", 1);
+            write_bytes(ctx, &entry->value.character, 1);
+            write_bytes(ctx, "'", 1);
+            break;
+        case AST_CONST_STRING:
+            write_bytes(ctx, "\"", 1);
+            write_bytes(ctx, symbol_string(entry->value.symbol),
+                        symbol_length(entry->value.symbol));
+            write_bytes(ctx, "\"", 1);
+            break;
+        case AST_LAZY_BLOCK:
+            snprintf(number, sizeof(number), "lazy block %" PRIu32 "..%" PRIu32,
+                     (u32)entry->value.unsigned_long,
+                     (u32)(entry->value.unsigned_long >> 32));
+            write_string(ctx, number);
+            break;
+        case AST_ID:
+            write_bytes(ctx, symbol_string(entry->value.symbol),
+                        symbol_length(entry->value.symbol));
+            break;
+        case AST_OPERATOR: {
+            const char* spelling = operator_spelling(entry->value.operator);
+            if (spelling) {
+                write_string(ctx, spelling);
+            } else {
+                char c = (char)entry->value.operator;
+                write_bytes(ctx, &c, 1);
+            }
+            break;
+        }
+        default:
+            write_string(ctx, tag_names[entry->tag] ? tag_names[entry->tag]
+                                                    : "?");
+            break;
+    }
+    write_bytes(ctx, "\n", 1);
+}
+
+internal int dump_entry(syntree_t* tree, ast_id id, const synentry_t* entry,
+                        void* data) {
+    (void)id;
+    dump_ctx_t* ctx = data;
+    if (ctx->failed)
+        return 0;
+
+    /* pre-order: the entry is the next child of the deepest level that
+     * still has children left */
+    while (ctx->depth > 0 && ctx->remaining[ctx->depth - 1] == 0)
+        ctx->depth--;
+    if (ctx->depth > 0)
+        ctx->remaining[ctx->depth - 1]--;
+
+    write_indent(ctx, ctx->depth);
+    write_entry(ctx, entry);
+
+    u32 children = syntree_count_children(tree, entry);
+    if (children > 0) {
+        if (ctx->depth == ctx->max_depth) {
+            u32 max_depth = ctx->max_depth ? ctx->max_depth * 2 : 64;
+            u32* remaining = realloc(ctx->remaining, max_depth * sizeof(u32));
+            if (!remaining) {
+                ctx->failed = true;
+                return 0;
+            }
+            ctx->remaining = remaining;
+            ctx->max_depth = max_depth;
+        }
+        ctx->remaining[ctx->depth++] = children;
+    }
+    return 1;
+}
+
+bool dump_ast(syntree_t* tree, ast_id root, FILE* out) {
+    dump_ctx_t ctx = {
+        .file = out,
+        .buffer = malloc(DUMP_BUFFER_SIZE),
+        .used = 0,
+        .remaining = NULL,
+        .depth = 0,
+        .max_depth = 0,
+        .failed = false,
+    };
+
+    if (!syntree_traverse(tree, root, SYNTREE_PRE_ORDER, dump_entry, &ctx))
+        ctx.failed = true;
+
+    flush(&ctx);
+    fflush(out);
+    free(ctx.buffer);
+    free(ctx.remaining);
+    return !ctx.failed;
+}
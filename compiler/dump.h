@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "parser.h"
+
+/* Writes the tree below root to out, one entry per line, indented by four
+ * spaces per level. Output goes through one large buffer, so this is
+ * meant for debugging and tests, not for the parse itself. Returns false
+ * if memory ran out; the output stops short then. */
+bool dump_ast(syntree_t* tree, ast_id root, FILE* out);
+
+/* Short name of a tag, e.g. "fn" or "id" */
+const char* ast_tag_name(synentry_tag_t tag);
@@ -17,3 +17,6 @@ typedef double      f64;
 #define global_variable     static
 #define internal            static
 #define local_persist       static
+
+/* Part of the key of cached syntax trees (ast_cache.h) */
+#define FLY_VERSION "0.1.0"
@@ -0,0 +1,218 @@
+#include "intern.h"
+#include "thread.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define ARENA_CHUNK_SIZE (16 * 1024)
+#define INITIAL_SLOTS 64
+
+/* The table is split into shards by the top bits of the hash, each with
+ * its own lock, so that lexers on different threads rarely wait for
+ * each other. A symbol is the index of its entry in the shard, shifted
+ * up, or'ed with the shard. */
+#define SHARD_BITS 6
+#define NUM_SHARDS (1u << SHARD_BITS)
+#define SHARD_MASK (NUM_SHARDS - 1)
+
+/* Entries live in blocks that double in size, block k holds
+ * FIRST_BLOCK_SIZE << k of them. They never move, so reading a symbol
+ * needs no lock: whoever holds a symbol got it from intern_string, or
+ * from a thread that did, after its entry was written. */
+#define FIRST_BLOCK_SHIFT 8
+#define MAX_BLOCKS (32 - SHARD_BITS - FIRST_BLOCK_SHIFT)
+
+/* String storage. Chunks are never moved or freed before
+ * release_interner, which keeps symbol_string pointers stable. */
+typedef struct arena_chunk {
+    struct arena_chunk* next;
+    size_t used;
+    size_t size;
+    char data[];
+} arena_chunk_t;
+
+typedef struct {
+    const char* string;
+    u32 length;
+    u32 hash;
+} symbol_entry_t;
+
+typedef struct {
+    arena_chunk_t* chunks;
+
+    /* indexed by the symbol's index in the shard, entry 0 is unused */
+    symbol_entry_t* blocks[MAX_BLOCKS];
+    u32 num_symbols;
+
+    /* open addressing with linear probing, 0 marks an empty slot */
+    symbol_t* slots;
+    u32 slot_mask;
+} shard_t;
+
+global_variable shard_t shards[NUM_SHARDS];
+
+#define LOCKS_4 MUTEX_INITIALIZER, MUTEX_INITIALIZER, MUTEX_INITIALIZER, \
+                MUTEX_INITIALIZER
+#define LOCKS_16 LOCKS_4, LOCKS_4, LOCKS_4, LOCKS_4
+/* The hash is computed before taking the lock */
+global_variable mutex_t shard_locks[NUM_SHARDS] = {
+    LOCKS_16, LOCKS_16, LOCKS_16, LOCKS_16
+};
+
+internal u32 hash_string(const char* str, size_t length) {
+    /* FNV-1a */
+    u32 hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (u8)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+internal u32 highest_bit(u32 x) {
+#if defined(__GNUC__)
+    return 31 - (u32)__builtin_clz(x);
+#else
+    u32 bit = 0;
+    while (x >>= 1)
+        bit++;
+    return bit;
+#endif
+}
+
+/* Entry index of a shard. The block must exist. */
+internal symbol_entry_t* locate(const shard_t* shard, u32 index) {
+    u32 n = index + (1u << FIRST_BLOCK_SHIFT);
+    u32 bit = highest_bit(n);
+    symbol_entry_t* block = shard->blocks[bit - FIRST_BLOCK_SHIFT];
+    assert(block);
+    return &block[n - (1u << bit)];
+}
+
+/* NULL if out of memory */
+internal char* arena_alloc(shard_t* shard, size_t size) {
+    arena_chunk_t* chunk = shard->chunks;
+    if (!chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = (size > ARENA_CHUNK_SIZE) ? size : ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(arena_chunk_t) + chunk_size);
+        if (!chunk)
+            return NULL;
+        chunk->next = shard->chunks;
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        shard->chunks = chunk;
+    }
+    char* mem = chunk->data + chunk->used;
+    chunk->used += size;
+    return mem;
+}
+
+/* Leaves the slots as they were if out of memory */
+internal bool grow_slots(shard_t* shard) {
+    u32 num_slots = shard->slots ? (shard->slot_mask + 1) * 2 : INITIAL_SLOTS;
+    symbol_t* slots = calloc(num_slots, sizeof(symbol_t));
+    if (!slots)
+        return false;
+    u32 mask = num_slots - 1;
+    for (u32 index = 1; index <= shard->num_symbols; index++) {
+        u32 i = locate(shard, index)->hash & mask;
+        while (slots[i] != SYMBOL_INVALID)
+            i = (i + 1) & mask;
+        slots[i] = (index << SHARD_BITS) | (u32)(shard - shards);
+    }
+    free(shard->slots);
+    shard->slots = slots;
+    shard->slot_mask = mask;
+    return true;
+}
+
+/* Caller holds the shard's lock. Nothing changes if a new string does
+ * not fit. */
+internal symbol_t intern_locked(shard_t* shard, const char* str,
+                                size_t length, u32 hash) {
+    if (!shard->slots && !grow_slots(shard))
+        return SYMBOL_INVALID;
+
+    u32 i = hash & shard->slot_mask;
+    while (shard->slots[i] != SYMBOL_INVALID) {
+        symbol_t symbol = shard->slots[i];
+        symbol_entry_t* entry = locate(shard, symbol >> SHARD_BITS);
+        if (entry->hash == hash && entry->length == length &&
+                memcmp(entry->string, str, length) == 0)
+            return symbol;
+        i = (i + 1) & shard->slot_mask;
+    }
+
+    /* new string. keep the load factor below 1/2 */
+    if ((shard->num_symbols + 1) * 2 > shard->slot_mask + 1) {
+        if (!grow_slots(shard))
+            return SYMBOL_INVALID;
+        i = hash & shard->slot_mask;
+        while (shard->slots[i] != SYMBOL_INVALID)
+            i = (i + 1) & shard->slot_mask;
+    }
+    u32 index = shard->num_symbols + 1;
+    u32 block = highest_bit(index + (1u << FIRST_BLOCK_SHIFT)) -
+                FIRST_BLOCK_SHIFT;
+    /* too many symbols */
+    if (block >= MAX_BLOCKS)
+        return SYMBOL_INVALID;
+    if (!shard->blocks[block]) {
+        shard->blocks[block] = malloc(((size_t)1 << FIRST_BLOCK_SHIFT << block) *
+                                      sizeof(symbol_entry_t));
+        if (!shard->blocks[block])
+            return SYMBOL_INVALID;
+    }
+
+    char* copy = arena_alloc(shard, length + 1);
+    if (!copy)
+        return SYMBOL_INVALID;
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+
+    symbol_entry_t* entry = locate(shard, index);
+    entry->string = copy;
+    entry->length = (u32)length;
+    entry->hash = hash;
+    shard->num_symbols = index;
+    symbol_t symbol = (index << SHARD_BITS) | (u32)(shard - shards);
+    shard->slots[i] = symbol;
+    return symbol;
+}
+
+symbol_t intern_string(const char* str, size_t length) {
+    u32 hash = hash_string(str, length);
+    /* the slots use the low bits */
+    u32 s = hash >> (32 - SHARD_BITS);
+    mutex_lock(&shard_locks[s]);
+    symbol_t symbol = intern_locked(&shards[s], str, length, hash);
+    mutex_unlock(&shard_locks[s]);
+    return symbol;
+}
+
+const char* symbol_string(symbol_t symbol) {
+    assert(symbol != SYMBOL_INVALID);
+    return locate(&shards[symbol & SHARD_MASK], symbol >> SHARD_BITS)->string;
+}
+
+size_t symbol_length(symbol_t symbol) {
+    assert(symbol != SYMBOL_INVALID);
+    return locate(&shards[symbol & SHARD_MASK], symbol >> SHARD_BITS)->length;
+}
+
+void release_interner(void) {
+    for (u32 s = 0; s < NUM_SHARDS; s++) {
+        shard_t* shard = &shards[s];
+        arena_chunk_t* chunk = shard->chunks;
+        while (chunk) {
+            arena_chunk_t* next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }
+        for (u32 b = 0; b < MAX_BLOCKS; b++)
+            free(shard->blocks[b]);
+        free(shard->slots);
+        memset(shard, 0, sizeof(*shard));
+    }
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "fly.h"
+
+/* String interning.
+ *
+ * Every distinct identifier or string literal is stored exactly once and
+ * handed out as a 32 bit symbol. Two symbols are equal if and only if the
+ * strings are equal, so later passes can compare names with ==.
+ * The table is global and symbols stay valid until release_interner.
+ * All functions may be called from several threads at once; reading a
+ * symbol's string takes no lock.
+ */
+typedef u32 symbol_t;
+
+#define SYMBOL_INVALID 0
+
+/* Returns SYMBOL_INVALID if out of memory, or if the table is full */
+symbol_t intern_string(const char* str, size_t length);
+
+/* NUL-terminated, stable for the lifetime of the table */
+const char* symbol_string(symbol_t symbol);
+size_t symbol_length(symbol_t symbol);
+
+void release_interner(void);
@@ -3,354 +3,412 @@
 //
 
 #include "lexer.h"
+#include "source.h"
+#include "literal.h"
+#include "scan.h"
+#include "stats.h"
+#include "trace.h"
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <stdarg.h>
+
+#define KEYWORD_HASH(length, first, second, last) \
+    (((first) * 2 + (second) * 2 + (last) * 5 + (length) * 3) & 63)
+
+/* Perfect hash over FLY_KEYWORDS (lexer.h): every keyword has its own case
+ * label, so an identifier costs one jump and at most one compare. */
+static token_tag_t keyword_lookup(const char* id, size_t length) {
+    if (length < 2)
+        return TOKEN_T_ID;
+    switch (KEYWORD_HASH((int)length, id[0], id[1], id[length - 1])) {
+#define KEYWORD_CASE(tag, spelling, first, second, last) \
+        case KEYWORD_HASH((int)sizeof(spelling) - 1, first, second, last): \
+            if (length == sizeof(spelling) - 1 && \
+                    memcmp(id, spelling, length) == 0) \
+                return tag; \
+            break;
+        FLY_KEYWORDS(KEYWORD_CASE)
+#undef KEYWORD_CASE
+    }
+    return TOKEN_T_ID;
+}
 
 int lexer_init(lexer_t* lexer, char* file) {
-    /* attempt to open the file */
-    FILE* f = fopen(file, "r");
-    if (!f)
-        return 0;
-    /* copy file path */
-    lexer->path = malloc(strlen(file) + 1);
-    if (!lexer->path) {
-        fclose(f);
+    /* attempt to load the file */
+    file_id_t id = source_load_file(file);
+    if (id == INVALID_FILE_ID)
         return 0;
-    }
-    strcpy(lexer->path, file);
+    source_file_t* source = source_get_file(id);
+    lexer->file = id;
+    lexer->path = source->path;
+    lexer->buffer = source->data;
+    lexer->cursor = lexer->buffer;
+    lexer->end = lexer->buffer + source->size;
+    lexer->limit = lexer->end;
+
+#ifndef NDEBUG
+    /* catch typos in the characters listed in FLY_KEYWORDS */
+#define KEYWORD_CHECK(tag, spelling, first, second, last) \
+    assert(keyword_lookup(spelling, sizeof(spelling) - 1) == tag);
+    FLY_KEYWORDS(KEYWORD_CHECK)
+#undef KEYWORD_CHECK
+#endif
 
-    lexer->start_line = 1;
-    lexer->start_column = 1;
-    lexer->current_line = 1;
-    lexer->current_column = 1;
-    lexer->file = f;
     lexer->block_comment_depth = 0;
     lexer->inside_line_comment = false;
     lexer->inside_string = false;
+    lexer->diag = NULL;
+    lexer->failed = false;
 
     return 1;
 }
 
-void lexer_release(lexer_t* lexer) {
-    if (!lexer)
-        return;
-    if (lexer->file) fclose(lexer->file);
-    if (lexer->path) free(lexer->path);
+void lexer_init_slice(lexer_t* lexer, file_id_t file, u32 begin, u32 end) {
+    source_file_t* source = source_get_file(file);
+    assert(begin <= end && end <= source->size);
+    lexer->file = file;
+    lexer->path = source->path;
+    lexer->buffer = source->data;
+    lexer->cursor = lexer->buffer + begin;
+    lexer->end = lexer->buffer + source->size;
+    lexer->limit = lexer->buffer + end;
+    lexer->block_comment_depth = 0;
+    lexer->inside_line_comment = false;
+    lexer->inside_string = false;
+    lexer->diag = NULL;
+    lexer->failed = false;
 }
 
-static bool char_in_string(char c, const char* str) {
-    for (size_t i = 0; i < strlen(str); i++) {
-        if (c == str[i])
-            return true;
+/* If p starts a comment, string or character literal, returns the first
+ * byte after it, otherwise p. Follows the lexer's rules for them, but
+ * checks nothing, so the prescans below can look at code only. */
+static const char* skip_comment_or_literal(const char* p, const char* end) {
+    char c = *p;
+    if (c == '/' && p[1] == '/') {
+        p = scan_find_newline(p + 2);
+    } else if (c == '/' && p[1] == '*') {
+        int comment_depth = 1;
+        p += 2;
+        while (comment_depth > 0 && p < end) {
+            p = scan_find_comment_delimiter(p);
+            if (p[0] == '*' && p[1] == '/') {
+                comment_depth--;
+                p += 2;
+            } else if (p[0] == '/' && p[1] == '*') {
+                comment_depth++;
+                p += 2;
+            } else {
+                p++;
+            }
+        }
+    } else if (c == '"') {
+        p = scan_find_quote(p + 1);
+        while (*p != '"' && p < end)
+            p = scan_find_quote(p + 1);
+        p++;
+    } else if (c == '\'') {
+        p++;
+        if (*p == '\\')
+            p++;
+        p += 2; /* the character and the closing ' */
     }
-    return false;
+    return (p > end) ? end : p;
 }
 
-static int get_next_char(lexer_t* lexer) {
-    return fgetc(lexer->file);
+u32 lexer_split(file_id_t file, u32 min_size, u32* ends, u32 max_slices) {
+    assert(max_slices > 0);
+    stats_phase_t phase = stats_begin(STATS_LEX);
+    trace_begin("split", SYMBOL_INVALID);
+    source_file_t* source = source_get_file(file);
+    const char* begin = source->data;
+    const char* end = begin + source->size;
+    const char* slice_start = begin;
+    const char* p = begin;
+    u32 num_slices = 0;
+    int depth = 0;
+
+    while (p < end && num_slices + 1 < max_slices) {
+        const char* next = skip_comment_or_literal(p, end);
+        if (next != p) {
+            p = next;
+            continue;
+        }
+        char c = *p;
+        if (c == '{' || c == '(' || c == '[') {
+            depth++;
+        } else if (c == '}' || c == ')' || c == ']') {
+            if (depth > 0)
+                depth--;
+        } else if (c == ';' && depth == 0 &&
+                (size_t)(p + 1 - slice_start) >= min_size) {
+            slice_start = p + 1;
+            ends[num_slices++] = (u32)(slice_start - begin);
+        }
+        p++;
+    }
+    ends[num_slices++] = (u32)source->size;
+    trace_end();
+    stats_end(phase);
+    return num_slices;
 }
 
-token_t lexer_get_next(lexer_t* lexer) {
-    token_t token;
-    size_t curBufSize = 40;
-    char* buffer = (char*)malloc(curBufSize);
-    if (!buffer) {
-        fprintf(stderr, "Out of memory!\n");
-        exit(1);
+u32 lexer_next_boundary(file_id_t file, u32 begin, u32 end) {
+    source_file_t* source = source_get_file(file);
+    assert(begin <= end && end <= source->size);
+    const char* data = source->data;
+    const char* file_end = data + source->size;
+    const char* limit = data + end;
+    const char* p = data + begin;
+    int depth = 0;
+
+    while (p < limit) {
+        /* a comment or literal may run past end, which then is no
+         * boundary either */
+        const char* next = skip_comment_or_literal(p, file_end);
+        if (next != p) {
+            p = next;
+            continue;
+        }
+        char c = *p;
+        if (c == '{' || c == '(' || c == '[') {
+            depth++;
+        } else if (c == '}' || c == ')' || c == ']') {
+            if (depth > 0)
+                depth--;
+        } else if (c == ';' && depth == 0) {
+            return (u32)(p + 1 - data);
+        }
+        p++;
     }
+    return 0;
+}
 
-    // skip leading whitespaces
-    bool skippingWhitespaces = true;
-    while (skippingWhitespaces) {
-        int nextChar = get_next_char(lexer);
-        if (nextChar == -1) {
-            token_t eof_token = { .tag = TOKEN_T_EOF };
-            return eof_token;
-        } else if (nextChar == ' ' || nextChar == '\t') {
-            lexer->current_column++;
-        } else if (nextChar == '\n') {
-            lexer->current_column = 1;
-            lexer->current_line++;
-        } else {
-            skippingWhitespaces = false;
-            ungetc(nextChar, lexer->file); // re-read that character
+bool lexer_skip_block(lexer_t* lexer, u32 open, u32* close_end) {
+    stats_phase_t phase = stats_begin(STATS_LEX);
+    const char* p = lexer->buffer + open;
+    assert(*p == '{');
+    const char* limit = lexer->limit;
+    int depth = 0;
+    bool closed = false;
+    while (p < limit) {
+        p = scan_find_block_delimiter(p);
+        if (p >= limit)
+            break;
+        const char* next = skip_comment_or_literal(p, limit);
+        if (next != p) {
+            p = next;
+            continue;
+        }
+        if (*p == '{') {
+            depth++;
+        } else if (*p == '}' && --depth == 0) {
+            p++;
+            closed = true;
+            break;
         }
+        p++;
     }
+    if (!closed)
+        p = limit;
+    lexer->cursor = p;
+    *close_end = (u32)(p - lexer->buffer);
+    stats_end(phase);
+    return closed;
+}
 
-    lexer->start_line = lexer->current_line;
-    lexer->start_column = lexer->current_column;
+/* The source buffer belongs to the source table and stays alive for
+ * diagnostics. */
+void lexer_release(lexer_t* lexer) {
+    if (!lexer)
+        return;
+    lexer->buffer = lexer->cursor = lexer->end = NULL;
+}
 
-    int firstChar = get_next_char(lexer);
-    if (firstChar == -1) { // TODO: I don't think this can happen...
-        token.tag = TOKEN_T_EOF;
-        goto out;
+static bool is_digit(int c) {
+    return c >= '0' && c <= '9';
+}
+
+static bool is_id_start(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static bool is_id_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '_';
+}
+
+/* Characters that can start a token, a comment or whitespace. '\0' is
+ * one of them as well, it ends the buffer. */
+static bool is_token_start(char c) {
+    return is_id_start(c) || is_digit(c) ||
+           strchr(" \t\r\n\"'(){}[]<>#;.,:+-*/%&|^~!=", c) != NULL;
+}
+
+static void report(lexer_t* lexer, const char* at, bool error,
+        const char* fmt, va_list args) {
+    int line, column;
+    source_get_position(lexer->file, (u32)(at - lexer->buffer), &line, &column);
+    const char* kind = error ? "" : "Warning: ";
+    if (!lexer->diag) {
+        fprintf(stderr, "[Lexer] %s", kind);
+        vfprintf(stderr, fmt, args);
+        fprintf(stderr, " %s %d:%d\n", lexer->path, line, column);
+        return;
     }
-    lexer->current_column++;
-
-    if ((char)firstChar == '/') {
-        // comment
-        int leadingChar = get_next_char(lexer);
-        if (leadingChar == -1) {
-            fprintf(stderr, "[Lexer] Unexpected end of file. %s in line %d\n", lexer->path, lexer->current_line);
-            exit(1);
-        }
-        lexer->current_column++;
-        if ((char)leadingChar == '/') {
+    if (error)
+        diag_error(lexer->diag, "[Lexer] ");
+    else
+        diag_warning(lexer->diag, "[Lexer] Warning: ");
+    diag_vprintf(lexer->diag, fmt, args);
+    diag_printf(lexer->diag, " %s %d:%d\n", lexer->path, line, column);
+    location_t loc = {
+        .offset = (u32)(at - lexer->buffer),
+        .file = lexer->file,
+        .length = 1,
+    };
+    diag_source_marker(lexer->diag, loc);
+}
+
+/* Reports an error at the given position in the buffer. The token is
+ * still returned, so that the parser sees the rest of the file. */
+static void lexer_error(lexer_t* lexer, const char* at, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    report(lexer, at, true, fmt, args);
+    va_end(args);
+}
+
+/* Reports an error the lexer cannot continue after, a literal or comment
+ * that runs to the end of the file: the current and all following tokens
+ * are TOKEN_T_EOF. */
+static void lexer_fatal(lexer_t* lexer, const char* at, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    report(lexer, at, true, fmt, args);
+    va_end(args);
+    lexer->failed = true;
+}
+
+static void lexer_warning(lexer_t* lexer, const char* at, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    report(lexer, at, false, fmt, args);
+    va_end(args);
+}
+
+/* Returns -1 at the end of the buffer. Only a '\0' can be the end, so
+ * the bounds check is off the common path. */
+static inline int get_next_char(lexer_t* lexer) {
+    char c = *lexer->cursor;
+    if (c == '\0' && lexer->cursor == lexer->end)
+        return -1;
+    lexer->cursor++;
+    return (unsigned char)c;
+}
+
+static inline void unget_char(lexer_t* lexer, int c) {
+    if (c != -1)
+        lexer->cursor--;
+}
+
+token_t lexer_get_next(lexer_t* lexer) {
+    token_t token;
+    token.value.unsigned_long = 0;
+
+again:
+    ;
+    // skip leading whitespaces and comments
+    const char* p = lexer->cursor;
+    for (;;) {
+        if (lexer->failed)
+            break;
+        p = scan_skip_whitespace(p);
+        if (p >= lexer->limit) {
+            break;
+        } else if (p[0] == '/' && p[1] == '/') {
             // line comment
             // read until end of line
-            int c = 0;
-            do {
-                c = get_next_char(lexer);
-                if (c == -1) {
-                    fprintf(stderr, "[Lexer] Unexpected end of file. %s in line %d\n", lexer->path, lexer->current_line);
-                    exit(1);
-                }
-                lexer->current_column++;
-            } while ((char)c != '\n');
-            lexer->current_line++;
-            lexer->current_column = 1;
-            token = lexer_get_next(lexer);
-        } else if ((char)leadingChar == '*') {
+            p = scan_find_newline(p + 2);
+        } else if (p[0] == '/' && p[1] == '*') {
             // block comment
             int blockCommentDepth = 1;
-            int prevChar, c = leadingChar;
+            p += 2;
             while (blockCommentDepth > 0) {
-                prevChar = c;
-                c = get_next_char(lexer);
-                if (c == -1) {
-                    fprintf(stderr, "[Lexer] Unexpected end of file. %s in line %d\n", lexer->path, lexer->current_line);
-                    exit(1);
-                }
-                lexer->current_column++;
-                if (c == '\n') {
-                    lexer->current_line++;
-                    lexer->current_column = 1;
-                } else if ((c == '/') && (prevChar == '*')) {
+                p = scan_find_comment_delimiter(p);
+                if (*p == '\0' && p == lexer->end) {
+                    lexer_fatal(lexer, p, "Unexpected end of file in block comment.");
+                    break;
+                } else if (p[0] == '*' && p[1] == '/') {
                     blockCommentDepth--;
-                } else if ((c == '*') && (prevChar == '/')) {
+                    p += 2;
+                } else if (p[0] == '/' && p[1] == '*') {
                     blockCommentDepth++;
+                    p += 2;
+                } else {
+                    p++;
                 }
             }
-            token = lexer_get_next(lexer);
         } else {
-            fprintf(stderr, "[Lexer] Unexpected character %c at %s %d:%d\n",
-                    leadingChar, lexer->path, lexer->current_line, lexer->current_column);
-            exit(1);
+            break;
         }
-    } else if (char_in_string((char)firstChar, "0123456789")) {
+    }
+    lexer->cursor = p;
+
+    const char* token_start = lexer->cursor;
+
+    int firstChar = (p < lexer->limit && !lexer->failed) ?
+        get_next_char(lexer) : -1;
+    if (firstChar == -1) {
+        token.tag = TOKEN_T_EOF;
+        goto out;
+    }
+
+    if (is_digit(firstChar)) {
         // numbers
-        int base = 10;
-        int i = 0;
-        bool couldBeBinary = true;
-        bool isLong = false, isUnsigned = false;
-        bool isFloat32 = false, isFloat64 = false;
-        if ((char)firstChar == '0') {
-            // this may be an hex- or octal number
-            int peek = get_next_char(lexer);
-            if (peek == -1) {
-                fprintf(stderr, "[Lexer] Unexpected end of file. %s in line %d\n", lexer->path, lexer->current_line);
-                exit(1);
-            }
-            if ((char)peek == 'x') {
-                base = 16;
-                lexer->current_column++;
-                couldBeBinary = false;
-                isUnsigned = true;
-            } else {
-                base = 8;
-                ungetc(peek, lexer->file);
-                isUnsigned = true;
-            }
-        } else {
-            buffer[0] = firstChar;
-            i = 1;
-        }
-        bool readingNumber = true;
-        while (readingNumber) {
-            int nextChar = get_next_char(lexer);
-            lexer->current_column++;
-            if (nextChar == -1) {
-                fprintf(stderr, "[Lexer] Unexpected end of file. %s in line %d\n", lexer->path, lexer->current_line);
-                exit(1);
-            } else if (char_in_string((char)nextChar, "01")) {
-                buffer[i] = (char)nextChar;
-                i++;
-            } else if (char_in_string((char)nextChar, "234567")) {
-                couldBeBinary = false;
-                buffer[i] = (char)nextChar;
-                i++;
-            } else if (char_in_string((char)nextChar, "89")) {
-                if (base == 8) {
-                    fprintf(stderr, "[Lexer] Digits 8 and 9 are not allowed in octal numbers. %s %d:%d-%d:%d\n",
-                            lexer->path, lexer->start_line, lexer->start_column, lexer->current_line, lexer->current_column);
-                    exit(1);
-                }
-                buffer[i] = (char)nextChar;
-                i++;
-            } else if ((base == 16) && char_in_string((char)nextChar, "abcdefABCDEF")) {
-                if (base != 16) {
-                    fprintf(stderr, "[Lexer] Digits a-f are only allowed in hexadecimal numbers. %s %d:%d-%d:%d\n",
-                            lexer->path, lexer->start_line, lexer->start_column, lexer->current_line, lexer->current_column);
-                    exit(1);
-                }
-                if (char_in_string((char)nextChar, "ABCDEF")) {
-                    nextChar += 'a' - 'A'; // convert to lower case
-                }
-                buffer[i] = (char)nextChar;
-                i++;
-            } else if ((char)nextChar == 'b') {
-                if (couldBeBinary) {
-                    base = 2;
-                    isLong = i >= 32;
-                    isUnsigned = true;
-                } else {
-                    fprintf(stderr, "[Lexer] Suffix 'b' is only allowed after binary numbers. %s %d:%d-%d:%d\n",
-                            lexer->path, lexer->start_line, lexer->start_column, lexer->current_line, lexer->current_column);
-                    exit(1);
-                }
-                readingNumber = false;
-            } else if ((char)nextChar == 'L') {
-                isLong = true;
-                readingNumber = false;
-            } else if ((char)nextChar == 'u') {
-                isUnsigned = true;
-                readingNumber = false;
-            } else if ((char)nextChar == '.') {
-                isFloat64 = true;
-                buffer[i] = (char)nextChar;
-                i++;
-            } else if ((char)nextChar == 'f') {
-                isFloat32 = true;
-                isFloat64 = false;
-                isLong = false;
-                isUnsigned = false;
-                readingNumber = false;
-            } else {
-                readingNumber = false;
-                ungetc(nextChar, lexer->file);
-                lexer->current_column--;
-            }
-            if ((size_t)i == curBufSize) {
-                curBufSize *= 2;
-                buffer = (char*)realloc(buffer, curBufSize);
-                if (!buffer) {
-                    fprintf(stderr, "Out of memory.\n");
-                    exit(1);
-                }
-            }
-        }
-        buffer[i] = '\0';
-        if (isFloat32) {
-            token.tag = TOKEN_T_FLOAT32;
-            sscanf(buffer, "%f", &token.value.float32);
-        } else if (isFloat64) {
-            token.tag = TOKEN_T_FLOAT64;
-            sscanf(buffer, "%lf", &token.value.float64);
-        } else if (isUnsigned) {
-            if (isLong) {
-                token.tag = TOKEN_T_UINTL;
-                if (base == 10)
-                    sscanf(buffer, "%llu", &token.value.unsigned_long);
-                else if (base == 8)
-                    sscanf(buffer, "%llo", &token.value.unsigned_long);
-                else if (base == 16)
-                    sscanf(buffer, "%llx", &token.value.unsigned_long);
-                else if (base == 2) {
-                    i -= 1; // skip '\0'
-                    uint64_t d = 1;
-                    token.value.unsigned_long = 0;
-                    do {
-                        if (buffer[i] == '1') {
-                            token.value.unsigned_long += d;
-                        }
-                        d *= 2;
-                        i--;
-                    } while (i >= 0);
-                }
-            } else {
-                token.tag = TOKEN_T_UINT;
-                if (base == 10)
-                    sscanf(buffer, "%u", &token.value.unsigned_int);
-                else if (base == 8)
-                    sscanf(buffer, "%o", &token.value.unsigned_int);
-                else if (base == 16)
-                    sscanf(buffer, "%x", &token.value.unsigned_int);
-                else if (base == 2) {
-                    i -= 1; // skip '\0'
-                    uint32_t d = 1;
-                    token.value.unsigned_int = 0;
-                    do {
-                        if (buffer[i] == '1') {
-                            token.value.unsigned_long += d;
-                        }
-                        d *= 2;
-                        i--;
-                    } while (i >= 0);
-                }
-            }
-        } else {
-            if (isLong) {
-                token.tag = TOKEN_T_INTL;
-                assert(base == 10);
-                sscanf(buffer, "%lld", &token.value.signed_long);
-            } else {
-                token.tag = TOKEN_T_INT;
-                assert(base == 10);
-                sscanf(buffer, "%d", &token.value.signed_int);
-            }
+        literal_error_t error;
+        lexer->cursor = scan_number(token_start, &token.tag, &token.value, &error);
+        switch (error) {
+            case LITERAL_OK:
+                break;
+            case LITERAL_OVERFLOW:
+                lexer_error(lexer, token_start, "Integer literal is too large.");
+                break;
+            case LITERAL_BAD_OCTAL_DIGIT:
+                lexer_error(lexer, token_start, "Digits 8 and 9 are not allowed in octal numbers.");
+                break;
+            case LITERAL_BAD_BINARY_DIGIT:
+                lexer_error(lexer, token_start, "Suffix 'b' is only allowed after binary numbers.");
+                break;
         }
     } else if ((char)firstChar == '"') {
         // string literal
-        int i = 0;
-        int nextChar = 0;
-        while ((char)nextChar != '"') {
-            nextChar = get_next_char(lexer);
-            if (nextChar == -1) {
-                fprintf(stderr, "[Lexer] Unexpected end of file in string literal. %s in line %d\n",
-                        lexer->path, lexer->current_line);
-                exit(1);
-            }
-            lexer->current_column++;
-            if ((char)nextChar == '\n') {
-                lexer->current_column = 1;
-                lexer->current_line++;
-            }
-            buffer[i] = ((char)nextChar == '"') ? '\0' : (char)nextChar;
-            i++;
-            if ((size_t)i == curBufSize) {
-                curBufSize *= 2;
-                buffer = (char*)realloc(buffer, curBufSize);
-                if (!buffer) {
-                    fprintf(stderr, "Out of memory.\n");
-                    exit(1);
-                }
+        const char* start = lexer->cursor;
+        p = scan_find_quote(start);
+        while (*p != '"') {
+            if (p == lexer->end) {
+                lexer_fatal(lexer, token_start, "Unexpected end of file in string literal.");
+                break;
             }
+            // '\0' inside the file
+            p = scan_find_quote(p + 1);
         }
+        lexer->cursor = p + 1;
         token.tag = TOKEN_T_STRING;
-        token.value.string = malloc(strlen(buffer) + 1);
-        strcpy(token.value.string, buffer);
+        token.value.symbol = intern_string(start, (size_t)(p - start));
     } else if ((char)firstChar == '\'') {
         // character literal
         token.tag = TOKEN_T_CHAR;
         int c = get_next_char(lexer);
-        lexer->current_column++;
         if (c == -1) {
-            fprintf(stderr, "[Lexer] Unexpected end of file in character literal. %s in line %d\n",
-                    lexer->path, lexer->current_line);
-            exit(1);
+            lexer_fatal(lexer, token_start, "Unexpected end of file in character literal.");
         } else if ((char)c == '\n') {
-            fprintf(stderr, "[Lexer] Unexpected newline in character literal at %s %d:%d\n",
-                    lexer->path, lexer->current_line, lexer->current_column);
-            exit(1);
+            lexer_error(lexer, token_start, "Unexpected newline in character literal.");
         } else if ((char)c == '\'') {
-            fprintf(stderr, "[Lexer] Error: Empty character literal at %s %d:%d\n",
-                    lexer->path, lexer->current_line, lexer->current_column);
-            exit(1);
+            lexer_error(lexer, token_start, "Empty character literal.");
         } else if ((char)c == '\\') {
             // escape character
             c = get_next_char(lexer);
-            lexer->current_column++;
             switch (c) {
                 case 'n':
                     token.value.character = '\n';
@@ -365,9 +423,7 @@ token_t lexer_get_next(lexer_t* lexer) {
                     token.value.character = '\\';
                     break;
                 default:
-                    fprintf(stderr, "[Lexer] Unrecognized escape character %c at %s %d:%d\n",
-                            c, lexer->path, lexer->current_line, lexer->current_column);
-                    exit(1);
+                    lexer_error(lexer, lexer->cursor - 1, "Unrecognized escape character %c.", c);
                     break;
             }
         } else {
@@ -375,11 +431,8 @@ token_t lexer_get_next(lexer_t* lexer) {
         }
         c = get_next_char(lexer); // must be closed by another '
         if ((char)c != '\'') {
-            fprintf(stderr, "[Lexer] Missing ' in character literal at %s %d:%d\n", lexer->path,
-                    lexer->current_line, lexer->current_column);
-            exit(1);
+            lexer_error(lexer, token_start, "Missing ' in character literal.");
         }
-        lexer->current_column++;
     } else if ((char)firstChar == '(') { /* Braces */
         token.tag = TOKEN_T_LBRACE;
     } else if ((char)firstChar == ')') {
@@ -396,38 +449,32 @@ token_t lexer_get_next(lexer_t* lexer) {
         int peek = get_next_char(lexer);
         if (peek == '=') {
             token.tag = TOKEN_T_LESS_EQUAL;
-            lexer->current_column++;
         } else if (peek == '<') {
-            lexer->current_column++;
             int peek2 = get_next_char(lexer);
             if (peek2 == '=') {
-                lexer->current_column++;
                 token.tag = TOKEN_T_SHIFT_LEFT_ASSIGN;
             } else {
-                ungetc(peek2, lexer->file);
+                unget_char(lexer, peek2);
                 token.tag = TOKEN_T_SHIFT_LEFT;
             }
         } else {
-            ungetc(peek, lexer->file);
+            unget_char(lexer, peek);
             token.tag = TOKEN_T_LANGLE;
         }
     } else if ((char)firstChar == '>') {
         int peek = get_next_char(lexer);
         if (peek == '=') {
             token.tag = TOKEN_T_GREATER_EQUAL;
-            lexer->current_column++;
         } else if (peek == '>') {
-            lexer->current_column++;
             int peek2 = get_next_char(lexer);
             if (peek2 == '=') {
-                lexer->current_column++;
                 token.tag = TOKEN_T_SHIFT_RIGHT_ASSIGN;
             } else {
-                ungetc(peek2, lexer->file);
+                unget_char(lexer, peek2);
                 token.tag = TOKEN_T_SHIFT_RIGHT;
             }
         } else {
-            ungetc(peek, lexer->file);
+            unget_char(lexer, peek);
             token.tag = TOKEN_T_RANGLE;
         }
     } else if ((char)firstChar == '#') {
@@ -438,16 +485,14 @@ token_t lexer_get_next(lexer_t* lexer) {
         int peek = get_next_char(lexer);
         if (peek == '.') {
             int peek2 = get_next_char(lexer);
-            lexer->current_column++;
             if (peek2 == '.') {
-                lexer->current_column++;
                 token.tag = TOKEN_T_ELLIPSIS;
             } else {
-                ungetc(peek2, lexer->file);
+                unget_char(lexer, peek2);
                 token.tag = TOKEN_T_RANGE;
             }
         } else {
-            ungetc(peek, lexer->file);
+            unget_char(lexer, peek);
             token.tag = TOKEN_T_DOT;
         }
     } else if ((char)firstChar == ',') {
@@ -456,18 +501,16 @@ token_t lexer_get_next(lexer_t* lexer) {
         int peek = get_next_char(lexer);
         if (peek == ':') {
             token.tag = TOKEN_T_FUNC_DECL;
-            lexer->current_column++;
         } else if (peek == '=') {
             token.tag = TOKEN_T_DECL_ASSIGN;
-            lexer->current_column++;
         } else {
-            ungetc(peek, lexer->file);
+            unget_char(lexer, peek);
             token.tag = TOKEN_T_COLON;
         }
     } else if ((char)firstChar == '+') { /* Operators */
         int peek = get_next_char(lexer);
-        if (char_in_string((char)peek, "0123456789")) {
-            ungetc(peek, lexer->file);
+        if (is_digit(peek)) {
+            unget_char(lexer, peek);
             token_t number = lexer_get_next(lexer);
             switch (number.tag) { // do nothing, but print an error if we are not followed by '+'
                 case TOKEN_T_INT:
@@ -478,27 +521,22 @@ token_t lexer_get_next(lexer_t* lexer) {
                 case TOKEN_T_FLOAT64:
                     break;
                 default:
-                    fprintf(stderr, "[Lexer] Expected number after '+' in file %s line %d.\n",
-                            number.loc.file, number.loc.start_line);
-                    exit(1);
+                    lexer_error(lexer, token_start, "Expected number after '+'.");
             }
-            number.loc.start_column -= 1;
             token = number;
 
         } else if (peek == '+') {
             token.tag = TOKEN_T_INC;
-            lexer->current_column++;
         } else if (peek == '=') {
             token.tag = TOKEN_T_ADD_ASSIGN;
-            lexer->current_column++;
         } else {
-            ungetc(peek, lexer->file);
+            unget_char(lexer, peek);
             token.tag = TOKEN_T_ADD;
         }
     } else if ((char)firstChar == '-') {
         int peek = get_next_char(lexer);
-        if (char_in_string((char)peek, "0123456789")) {
-            ungetc(peek, lexer->file);
+        if (is_digit(peek)) {
+            unget_char(lexer, peek);
             token_t number = lexer_get_next(lexer);
             switch (number.tag) {
                 case TOKEN_T_INT:
@@ -509,8 +547,7 @@ token_t lexer_get_next(lexer_t* lexer) {
                     break;
                 case TOKEN_T_UINT:
                 case TOKEN_T_UINTL:
-                    fprintf(stderr, "Warning, '-' before unsigned integer in file %s line %d.\n",
-                            number.loc.file, number.loc.start_line);
+                    lexer_warning(lexer, token_start, "'-' before unsigned integer.");
                     break;
                 case TOKEN_T_FLOAT32:
                     number.value.float32 *= -1;
@@ -519,83 +556,69 @@ token_t lexer_get_next(lexer_t* lexer) {
                     number.value.float64 *= -1;
                     break;
                 default:
-                    fprintf(stderr, "[Lexer] Expected number after '-' in file %s line %d.\n",
-                            number.loc.file, number.loc.start_line);
-                    exit(1);
+                    lexer_error(lexer, token_start, "Expected number after '-'.");
             }
-            number.loc.start_column -= 1;
             token = number;
         } else if (peek == '-') {
             token.tag = TOKEN_T_DEC;
-            lexer->current_column++;
         } else if (peek == '=') {
             token.tag = TOKEN_T_SUB_ASSIGN;
-            lexer->current_column++;
         } else if (peek == '>') {
             token.tag = TOKEN_T_ARROW;
-            lexer->current_column++;
         } else {
-            ungetc(peek, lexer->file);
+            unget_char(lexer, peek);
             token.tag = TOKEN_T_SUB;
         }
     } else if ((char)firstChar == '*') {
         int peek = get_next_char(lexer);
         if (peek == '=') {
             token.tag = TOKEN_T_MUL_ASSIGN;
-            lexer->current_column++;
         } else {
-            ungetc(peek, lexer->file);
+            unget_char(lexer, peek);
             token.tag = TOKEN_T_MUL;
         }
     } else if ((char)firstChar == '/') {
         int peek = get_next_char(lexer);
         if (peek == '=') {
             token.tag = TOKEN_T_DIV_ASSIGN;
-            lexer->current_column++;
         } else {
-            ungetc(peek, lexer->file);
+            unget_char(lexer, peek);
             token.tag = TOKEN_T_DIV;
         }
     } else if ((char)firstChar == '%') {
         int peek = get_next_char(lexer);
         if (peek == '=') {
             token.tag = TOKEN_T_MOD_ASSIGN;
-            lexer->current_column++;
         } else {
-            ungetc(peek, lexer->file);
+            unget_char(lexer, peek);
             token.tag = TOKEN_T_MOD;
         }
     } else if ((char)firstChar == '&') {
         int peek = get_next_char(lexer);
         if (peek == '=') {
             token.tag = TOKEN_T_BITWISE_AND_ASSIGN;
-            lexer->current_column++;
         } else if (peek == '&') {
             token.tag = TOKEN_T_AND;
-            lexer->current_column++;
         } else {
-            ungetc(peek, lexer->file);
+            unget_char(lexer, peek);
             token.tag = TOKEN_T_BITWISE_AND;
         }
     } else if ((char)firstChar == '|') {
         int peek = get_next_char(lexer);
         if (peek == '=') {
             token.tag = TOKEN_T_BITWISE_OR_ASSIGN;
-            lexer->current_column++;
         } else if (peek == '|') {
             token.tag = TOKEN_T_OR;
-            lexer->current_column++;
         } else {
-            ungetc(peek, lexer->file);
+            unget_char(lexer, peek);
             token.tag = TOKEN_T_BITWISE_OR;
         }
     } else if ((char)firstChar == '^') {
         int peek = get_next_char(lexer);
         if (peek == '=') {
             token.tag = TOKEN_T_BITWISE_XOR_ASSIGN;
-            lexer->current_column++;
         } else {
-            ungetc(peek, lexer->file);
+            unget_char(lexer, peek);
             token.tag = TOKEN_T_BITWISE_XOR;
         }
     } else if ((char)firstChar == '~') {
@@ -604,131 +627,195 @@ token_t lexer_get_next(lexer_t* lexer) {
         int peek = get_next_char(lexer);
         if (peek == '=') {
             token.tag = TOKEN_T_NOT_EQUAL;
-            lexer->current_column++;
         } else {
-            ungetc(peek, lexer->file);
+            unget_char(lexer, peek);
             token.tag = TOKEN_T_NOT;
         }
     } else if ((char)firstChar == '=') {
         int peek = get_next_char(lexer);
         if (peek == '=') {
             token.tag = TOKEN_T_EQUAL;
-            lexer->current_column++;
         } else if (peek == '>') {
             token.tag = TOKEN_T_BIG_ARROW;
-            lexer->current_column++;
         } else {
-            ungetc(peek, lexer->file);
+            unget_char(lexer, peek);
             token.tag = TOKEN_T_ASSIGN;
         }
-    } else if (char_in_string((char)firstChar, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_")) {
+    } else if (is_id_start((char)firstChar)) {
         // identifier
-        int i = 1;
-        buffer[0] = (char)firstChar;
-        bool done = false;
-        while (!done) {
-            if ((size_t)i == curBufSize) {
-                curBufSize *= 2;
-                buffer = (char*)realloc(buffer, curBufSize);
-                if (!buffer) {
-                    fprintf(stderr, "Out of memory!\n");
-                    exit(1);
-                }
-            }
-
-            int nextChar = get_next_char(lexer);
-            if (nextChar == -1) {
-                fprintf(stderr, "[Lexer] Unexpected end of file. %s in line %d\n", lexer->path, lexer->current_line);
-                exit(1);
-            }
-            if (!char_in_string((char)nextChar, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_")) {
-                done = true;
-                buffer[i] = '\0';
-                ungetc(nextChar, lexer->file);
-            } else {
-                buffer[i] = (char)nextChar;
-                lexer->current_column++;
-            }
-
-            i++;
-        }
+        const char* start = lexer->cursor - 1;
+        p = lexer->cursor;
+        while (is_id_char(*p))
+            p++;
+        size_t length = (size_t)(p - start);
+        lexer->cursor = p;
         // check if we got an keyword or boolean constant
-        if (strcmp(buffer, "true") == 0) {
-            token.tag = TOKEN_T_BOOL;
-            token.value.boolean = true;
-        } else if (strcmp(buffer, "false") == 0) {
-            token.tag = TOKEN_T_BOOL;
-            token.value.boolean = false;
-        } else if (strcmp(buffer, "mod") == 0) {
-            token.tag = TOKEN_T_KW_MOD;
-        } else if (strcmp(buffer, "let") == 0) {
-            token.tag = TOKEN_T_KW_LET;
-        } else if (strcmp(buffer, "type") == 0) {
-            token.tag = TOKEN_T_KW_TYPE;
-        } else if (strcmp(buffer, "static") == 0) {
-            token.tag = TOKEN_T_KW_STATIC;
-        } else if (strcmp(buffer, "const") == 0) {
-            token.tag = TOKEN_T_KW_CONST;
-        } else if (strcmp(buffer, "new") == 0) {
-            token.tag = TOKEN_T_KW_NEW;
-        } else if (strcmp(buffer, "delete") == 0) {
-            token.tag = TOKEN_T_KW_DELETE;
-        } else if (strcmp(buffer, "auto") == 0) {
-            token.tag = TOKEN_T_KW_AUTO;
-        } else if (strcmp(buffer, "struct") == 0) {
-            token.tag = TOKEN_T_KW_STRUCT;
-        } else if (strcmp(buffer, "union") == 0) {
-            token.tag = TOKEN_T_KW_UNION;
-        } else if (strcmp(buffer, "enum") == 0) {
-            token.tag = TOKEN_T_KW_ENUM;
-        } else if (strcmp(buffer, "if") == 0) {
-            token.tag = TOKEN_T_KW_IF;
-        } else if (strcmp(buffer, "else") == 0) {
-            token.tag = TOKEN_T_KW_ELSE;
-        } else if (strcmp(buffer, "cast") == 0) {
-            token.tag = TOKEN_T_KW_CAST;
-        } else if (strcmp(buffer, "fn") == 0) {
-            token.tag = TOKEN_T_KW_FUNC;
-        } else if (strcmp(buffer, "extern") == 0) {
-            token.tag = TOKEN_T_KW_EXTERN;
-        } else if (strcmp(buffer, "for") == 0) {
-            token.tag = TOKEN_T_KW_FOR;
-        } else if (strcmp(buffer, "while") == 0) {
-            token.tag = TOKEN_T_KW_WHILE;
-        } else if (strcmp(buffer, "do") == 0) {
-            token.tag = TOKEN_T_KW_DO;
-        } else if (strcmp(buffer, "defer") == 0) {
-            token.tag = TOKEN_T_KW_DEFER;
-        } else if (strcmp(buffer, "switch") == 0) {
-            token.tag = TOKEN_T_KW_SWITCH;
-        } else if (strcmp(buffer, "case") == 0) {
-            token.tag = TOKEN_T_KW_CASE;
-        } else if (strcmp(buffer, "default") == 0) {
-            token.tag = TOKEN_T_KW_DEFAULT;
-        } else if (strcmp(buffer, "return") == 0) {
-            token.tag = TOKEN_T_KW_RETURN;
-        } else {
-            token.tag = TOKEN_T_ID;
-            token.value.string = malloc(strlen(buffer) + 1);
-            strcpy(token.value.string, buffer);
+        token.tag = keyword_lookup(start, length);
+        if (token.tag == TOKEN_T_BOOL) {
+            token.value.boolean = (start[0] == 't');
+        } else if (token.tag == TOKEN_T_ID) {
+            token.value.symbol = intern_string(start, length);
         }
     } else {
-        fprintf(stderr, "[Lexer] Unexpected character %c at %s %d:%d\n", firstChar, lexer->path, lexer->current_line, lexer->current_column);
-        exit(1);
+        /* skip it and report the run of characters only once */
+        lexer_error(lexer, token_start, "Unexpected character %c.", firstChar);
+        while (lexer->cursor < lexer->limit && !is_token_start(*lexer->cursor))
+            lexer->cursor++;
+        goto again;
+    }
+    if (lexer->failed) {
+        token.tag = TOKEN_T_EOF;
+        lexer->cursor = lexer->end;
     }
 
 out:
-    if (lexer->path) {
-        token.loc.file = malloc(strlen(lexer->path) + 1);
-        strcpy(token.loc.file, lexer->path);
-    } else {
-        token.loc.file = NULL;
-    }
-    token.loc.start_line = lexer->start_line;
-    token.loc.start_column = lexer->start_column;
-    token.loc.end_line = lexer->current_line;
-    token.loc.end_column = lexer->current_column;
-    free(buffer);
+    token.loc.file = lexer->file;
+    token.loc.offset = (u32)(token_start - lexer->buffer);
+    token.loc.length = (lexer->cursor - token_start > 0xffff) ?
+        0xffff : (u16)(lexer->cursor - token_start);
     return token;
 
 }
+
+static bool reserve_tokens(token_buffer_t* tokens, u32 capacity) {
+    stats_count(STATS_ALLOCATIONS, 3);
+    stats_count(STATS_ALLOCATED_BYTES, (u64)capacity *
+                (sizeof(u16) + sizeof(location_t) + sizeof(u32)));
+    u16* tags = realloc(tokens->tags, capacity * sizeof(u16));
+    if (!tags)
+        return false;
+    tokens->tags = tags;
+    location_t* locs = realloc(tokens->locs, capacity * sizeof(location_t));
+    if (!locs)
+        return false;
+    tokens->locs = locs;
+    u32* payloads = realloc(tokens->payloads, capacity * sizeof(u32));
+    if (!payloads)
+        return false;
+    tokens->payloads = payloads;
+    tokens->capacity = capacity;
+    return true;
+}
+
+static u32 add_value(token_buffer_t* tokens, token_value_t value) {
+    if (tokens->num_values == tokens->value_capacity) {
+        u32 capacity = tokens->value_capacity * 2;
+        stats_count(STATS_ALLOCATIONS, 1);
+        stats_count(STATS_ALLOCATED_BYTES, capacity * sizeof(token_value_t));
+        token_value_t* values = realloc(tokens->values,
+                                        capacity * sizeof(token_value_t));
+        if (!values)
+            return 0;
+        tokens->values = values;
+        tokens->value_capacity = capacity;
+    }
+    tokens->values[tokens->num_values] = value;
+    return tokens->num_values++;
+}
+
+static int tokenize_some(lexer_t* lexer, token_buffer_t* tokens, u32 count) {
+    if (!tokens->values) {
+        tokens->value_capacity = 256;
+        stats_count(STATS_ALLOCATIONS, 1);
+        stats_count(STATS_ALLOCATED_BYTES, 256 * sizeof(token_value_t));
+        tokens->values = malloc(tokens->value_capacity * sizeof(token_value_t));
+        if (!tokens->values)
+            goto fail;
+        tokens->num_values = 1; /* payload 0 means "no value" */
+    }
+    if (tokens->capacity == 0 && !reserve_tokens(tokens, 1024))
+        goto fail;
+
+    for (u32 n = 0; n < count; n++) {
+        token_t token = lexer_get_next(lexer);
+        if (tokens->num_tokens == tokens->capacity) {
+            if (tokens->capacity > 0x3fffffff ||
+                    !reserve_tokens(tokens, tokens->capacity * 2))
+                goto fail;
+        }
+        u32 payload = 0;
+        switch (token.tag) {
+            case TOKEN_T_ID:
+            case TOKEN_T_STRING:
+                /* the interner is out of memory */
+                if (token.value.symbol == SYMBOL_INVALID)
+                    goto fail;
+                payload = token.value.symbol;
+                break;
+            case TOKEN_T_INT:
+            case TOKEN_T_UINT:
+            case TOKEN_T_INTL:
+            case TOKEN_T_UINTL:
+            case TOKEN_T_FLOAT32:
+            case TOKEN_T_FLOAT64:
+            case TOKEN_T_CHAR:
+            case TOKEN_T_BOOL:
+                payload = add_value(tokens, token.value);
+                if (!payload)
+                    goto fail;
+                break;
+            default:
+                break;
+        }
+        u32 i = tokens->num_tokens++;
+        tokens->tags[i] = (u16)token.tag;
+        tokens->locs[i] = token.loc;
+        tokens->payloads[i] = payload;
+        if (token.tag == TOKEN_T_EOF)
+            break;
+    }
+    return 1;
+
+fail:
+    return 0;
+}
+
+int lexer_tokenize_some(lexer_t* lexer, token_buffer_t* tokens, u32 count) {
+    stats_phase_t phase = stats_begin(STATS_LEX);
+    u32 before = tokens->num_tokens;
+    int ok = tokenize_some(lexer, tokens, count);
+    if (ok)
+        stats_count(STATS_TOKENS, tokens->num_tokens - before);
+    stats_end(phase);
+    return ok;
+}
+
+int lexer_tokenize(lexer_t* lexer, token_buffer_t* tokens) {
+    memset(tokens, 0, sizeof(*tokens));
+    /* a token every six bytes is about what real code has */
+    size_t hint = (size_t)(lexer->limit - lexer->cursor) / 6 + 16;
+    if (hint > 0x7fffffff || !reserve_tokens(tokens, (u32)hint)) {
+        token_buffer_release(tokens);
+        return 0;
+    }
+    trace_begin("lex", SYMBOL_INVALID);
+    int ok = lexer_tokenize_some(lexer, tokens, 0xffffffffu);
+    trace_end();
+    if (!ok)
+        token_buffer_release(tokens);
+    return ok;
+}
+
+void token_buffer_release(token_buffer_t* tokens) {
+    free(tokens->tags);
+    free(tokens->locs);
+    free(tokens->payloads);
+    free(tokens->values);
+    memset(tokens, 0, sizeof(*tokens));
+}
+
+token_t token_buffer_get(const token_buffer_t* tokens, u32 index) {
+    assert(tokens->num_tokens > 0);
+    if (index >= tokens->num_tokens)
+        index = tokens->num_tokens - 1;
+    token_t token;
+    token.tag = (token_tag_t)tokens->tags[index];
+    token.loc = tokens->locs[index];
+    if (token.tag == TOKEN_T_ID || token.tag == TOKEN_T_STRING)
+        token.value.symbol = tokens->payloads[index];
+    else if (tokens->payloads[index])
+        token.value = tokens->values[tokens->payloads[index]];
+    else
+        token.value.unsigned_long = 0;
+    return token;
+}
@@ -10,22 +10,36 @@
 #include <stdint.h>
 
 #include "location.h"
+#include "intern.h"
+#include "diag.h"
 #include "fly.h"
 
 typedef struct {
     /* location data */
-    char* path;
-    int current_line;
-    int current_column;
-    int start_line;
-    int start_column;
+    file_id_t file;
+    const char* path; /* owned by the source table */
 
     /* state */
     bool inside_string;
     bool inside_line_comment;
     int block_comment_depth;
 
-    FILE* file;
+    /* source buffer: the whole file, owned by the source table.
+     * *end is always '\0', so scanning loops can stop on the sentinel
+     * instead of checking the bounds on every character. */
+    const char* buffer;
+    const char* cursor;
+    const char* end;
+    /* lexing stops at the first token that starts here, == end unless
+     * the lexer only handles a slice of the file */
+    const char* limit;
+
+    /* errors and warnings go here, or to stderr if NULL. Most errors
+     * are reported and lexing goes on; after one it cannot recover from
+     * (failed), such as an unterminated literal, the lexer only returns
+     * TOKEN_T_EOF. */
+    diag_buffer_t* diag;
+    bool failed;
 } lexer_t;
 
 typedef enum {
@@ -126,30 +140,124 @@ typedef enum {
     TOKEN_T_COUNT,
 } token_tag_t;
 
+/* Keywords, in the form X(tag, spelling, first, second, last char).
+ * The characters feed the perfect hash in lexer.c (keyword_lookup), so
+ * adding a keyword is a single new line here. If the new keyword collides
+ * with an existing one the compiler reports a duplicate case label;
+ * change the constants in KEYWORD_HASH in that case.
+ */
+#define FLY_KEYWORDS(X) \
+    X(TOKEN_T_BOOL,            "true",    't', 'r', 'e') \
+    X(TOKEN_T_BOOL,            "false",   'f', 'a', 'e') \
+    X(TOKEN_T_KW_MOD,          "mod",     'm', 'o', 'd') \
+    X(TOKEN_T_KW_LET,          "let",     'l', 'e', 't') \
+    X(TOKEN_T_KW_TYPE,         "type",    't', 'y', 'e') \
+    X(TOKEN_T_KW_STATIC,       "static",  's', 't', 'c') \
+    X(TOKEN_T_KW_CONST,        "const",   'c', 'o', 't') \
+    X(TOKEN_T_KW_AUTO,         "auto",    'a', 'u', 'o') \
+    X(TOKEN_T_KW_NEW,          "new",     'n', 'e', 'w') \
+    X(TOKEN_T_KW_DELETE,       "delete",  'd', 'e', 'e') \
+    X(TOKEN_T_KW_STRUCT,       "struct",  's', 't', 't') \
+    X(TOKEN_T_KW_UNION,        "union",   'u', 'n', 'n') \
+    X(TOKEN_T_KW_ENUM,         "enum",    'e', 'n', 'm') \
+    X(TOKEN_T_KW_IF,           "if",      'i', 'f', 'f') \
+    X(TOKEN_T_KW_ELSE,         "else",    'e', 'l', 'e') \
+    X(TOKEN_T_KW_FOR,          "for",     'f', 'o', 'r') \
+    X(TOKEN_T_KW_WHILE,        "while",   'w', 'h', 'e') \
+    X(TOKEN_T_KW_DO,           "do",      'd', 'o', 'o') \
+    X(TOKEN_T_KW_CAST,         "cast",    'c', 'a', 't') \
+    X(TOKEN_T_KW_FUNC,         "fn",      'f', 'n', 'n') \
+    X(TOKEN_T_KW_EXTERN,       "extern",  'e', 'x', 'n') \
+    X(TOKEN_T_KW_DEFER,        "defer",   'd', 'e', 'r') \
+    X(TOKEN_T_KW_SWITCH,       "switch",  's', 'w', 'h') \
+    X(TOKEN_T_KW_CASE,         "case",    'c', 'a', 'e') \
+    X(TOKEN_T_KW_DEFAULT,      "default", 'd', 'e', 't') \
+    X(TOKEN_T_KW_RETURN,       "return",  'r', 'e', 'n')
+
+typedef union {
+    symbol_t symbol; /* identifiers and string literals */
+    char character;
+    bool boolean;
+    i32 signed_int;
+    u32 unsigned_int;
+    i64 signed_long;
+    u64 unsigned_long;
+    f32 float32;
+    f64 float64;
+} token_value_t;
+
 typedef struct {
     /* location data */
     location_t loc;
 
-    union {
-        char* string;
-        char character;
-        bool boolean;
-        i32 signed_int;
-        u32 unsigned_int;
-        i64 signed_long;
-        u64 unsigned_long;
-        f32 float32;
-        f64 float64;
-    } value;
+    token_value_t value;
 
     token_tag_t tag;
 } token_t;
 
+/* A whole file worth of tokens, stored as parallel arrays.
+ * payloads[i] holds the symbol of identifiers and string literals, the
+ * index into values for all other literals and 0 for everything else.
+ * The last token is always TOKEN_T_EOF. */
+typedef struct {
+    u16* tags;
+    location_t* locs;
+    u32* payloads;
+    u32 num_tokens;
+    u32 capacity;
+
+    token_value_t* values;
+    u32 num_values;
+    u32 value_capacity;
+} token_buffer_t;
+
 /** Initialize a new lexer instance, responsible for the given file
  */
 int lexer_init(lexer_t* lexer, char* file);
+/* Lexer for the bytes [begin, end) of an already loaded file. Both have
+ * to lie between two top-level declarations, see lexer_split. */
+void lexer_init_slice(lexer_t* lexer, file_id_t file, u32 begin, u32 end);
 void lexer_release(lexer_t* lexer);
 
 token_t lexer_get_next(lexer_t* lexer);
 
+/* Splits a loaded file into at most max_slices slices of at least
+ * min_size bytes (except the last one) for parallel parsing. Slices end
+ * after a ';' that is outside of any braces, comments, strings and
+ * character literals, which is where top-level declarations end.
+ * Writes the end offset of each slice and returns their number; the
+ * last slice ends at the end of the file. */
+u32 lexer_split(file_id_t file, u32 min_size, u32* ends, u32 max_slices);
+
+/* The first place after begin at which lexer_split could end a slice,
+ * the offset behind a ';' outside of braces, comments and literals.
+ * begin has to be such a place itself, or 0. Returns 0 if there is none
+ * before end, or a comment or literal reaches past end. */
+u32 lexer_next_boundary(file_id_t file, u32 begin, u32 end);
+
+/* Lexes the rest of the file (or slice) into tokens */
+int lexer_tokenize(lexer_t* lexer, token_buffer_t* tokens);
+/* Appends up to count more tokens, stopping after the EOF token. tokens
+ * has to be zeroed or come from an earlier call. Returns 0 if out of
+ * memory; the tokens appended before stay. */
+int lexer_tokenize_some(lexer_t* lexer, token_buffer_t* tokens, u32 count);
+
+/* Skips the block that starts with the '{' at byte offset open, without
+ * lexing it, and continues lexing after the matching '}'. Only braces
+ * outside of comments and literals count. Writes the offset after the
+ * '}'; returns false (and stops at the limit) if there is none. */
+bool lexer_skip_block(lexer_t* lexer, u32 open, u32* close_end);
+void token_buffer_release(token_buffer_t* tokens);
+
+/* Returns the last token (EOF once the whole input is lexed) for indices
+ * past the end */
+token_t token_buffer_get(const token_buffer_t* tokens, u32 index);
+
+static inline token_tag_t token_buffer_tag(const token_buffer_t* tokens,
+                                           u32 index) {
+    if (index >= tokens->num_tokens)
+        index = tokens->num_tokens - 1;
+    return (token_tag_t)tokens->tags[index];
+}
+
 #endif //MULTITHREADED_COMPILER_LEXER_H
@@ -0,0 +1,43 @@
+#include "libfly.h"
+#include "intern.h"
+
+#include <string.h>
+
+bool fly_parse_buffer(const char* name, const char* data, size_t length,
+                      u32 max_errors, fly_unit_t* unit) {
+    memset(unit, 0, sizeof(*unit));
+    unit->file = INVALID_FILE_ID;
+    parser_t parser;
+    memset(&parser, 0, sizeof(parser));
+    parser.max_errors = max_errors;
+    if (!init_parser_buffer(&parser, name, data, length))
+        return false;
+    unit->program = parse_program(&parser);
+    if (!unit->program) {
+        /* out of memory */
+        source_release_file(parser.file);
+        release_parser(&parser);
+        return false;
+    }
+    unit->file = parser.file;
+    parser_take_syntree(&parser, &unit->syntree);
+    /* the diagnostics move to the unit as well */
+    unit->diag = parser.diag;
+    memset(&parser.diag, 0, sizeof(parser.diag));
+    release_parser(&parser);
+    return true;
+}
+
+void fly_release_unit(fly_unit_t* unit) {
+    release_syntree(&unit->syntree);
+    diag_release(&unit->diag);
+    if (unit->file != INVALID_FILE_ID)
+        source_release_file(unit->file);
+    memset(unit, 0, sizeof(*unit));
+    unit->file = INVALID_FILE_ID;
+}
+
+void fly_shutdown(void) {
+    release_sources();
+    release_interner();
+}
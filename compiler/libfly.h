@@ -0,0 +1,126 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "fly.h"
+#include "parser.h"
+#include "source.h"
+#include "diag.h"
+
+/* Entry point of libfly, the parser as a library (libfly.a, libfly.so)
+ * for tools that parse in process: test runners, code generators,
+ * editor plugins.
+ *
+ * A fly_unit_t owns everything one parse produced. Units are
+ * independent, any number of them may be parsed on different threads at
+ * the same time. Symbols in the tree stay valid until fly_shutdown.
+ *
+ * Nothing in the library ends the process. Running out of memory makes
+ * the call that ran into it fail, and leaves nothing behind that would
+ * have to be released. */
+
+typedef struct {
+    syntree_t syntree;
+    /* the AST_PROGRAM entry of syntree */
+    ast_id program;
+    /* locations in syntree refer to this file, a copy of the source */
+    file_id_t file;
+    diag_buffer_t diag;
+} fly_unit_t;
+
+/* Parses length bytes at data; name is the file name in diagnostics and
+ * need not exist. Syntax errors are reported in unit->diag and do not
+ * make the call fail. It fails if memory runs out or there is no file id
+ * left. Stops after max_errors errors, 0 for no limit. */
+bool fly_parse_buffer(const char* name, const char* data, size_t length,
+                      u32 max_errors, fly_unit_t* unit);
+
+/* Frees the tree, the diagnostics and the copy of the source */
+void fly_release_unit(fly_unit_t* unit);
+
+/* A file that is open in an editor and changes a little at a time. An
+ * edit lexes and parses only the top-level declarations it touches and
+ * splices them into the tree; the entries of all others keep their ids.
+ *
+ * The file is kept in segments, the slices lexer_split would cut it into
+ * without a minimum size: each one ends behind the ';' of a top-level
+ * declaration, the whitespace and comments after it belong to the next.
+ * Segments are lexed and parsed on their own, like the slices of
+ * parse_program_parallel, so the tree is the one fly_parse_buffer would
+ * build from the edited text. */
+typedef struct {
+    u32 begin; /* it ends where the next one begins */
+    /* its top-level entries, items[first_item, first_item + num_items) */
+    u32 first_item;
+    u32 num_items;
+    /* its own diagnostics, see fly_document_diag */
+    diag_buffer_t diag;
+} fly_segment_t;
+
+typedef struct {
+    /* parser.syntree is the tree */
+    parser_t parser;
+    /* the AST_PROGRAM entry, which keeps its id across edits */
+    ast_id program;
+    file_id_t file;
+    /* the children of program */
+    ast_id* items;
+    u32 num_items;
+    u32 item_capacity;
+    fly_segment_t* segments;
+    u32 num_segments;
+    u32 segment_capacity;
+    /* Replaced declarations stay in the tree. Once it has grown to twice
+     * its size after the last full parse, an edit parses the whole file
+     * again. */
+    u32 base_entries;
+    u32 base_children;
+} fly_document_t;
+
+/* removed bytes at offset are replaced by length bytes at inserted */
+typedef struct {
+    u32 offset;
+    u32 removed;
+    const char* inserted;
+    u32 length;
+} fly_edit_t;
+
+/* What an edit changed: items[first, first + inserted) are new, they
+ * took the place of removed entries */
+typedef struct {
+    u32 first;
+    u32 removed;
+    u32 inserted;
+    /* the whole file was parsed again and every id changed */
+    bool full;
+} fly_edit_result_t;
+
+/* Parses a copy of the length bytes at data, like fly_parse_buffer.
+ * Fails if memory runs out or there is no file id; doc needs no
+ * fly_close_document then. */
+bool fly_open_document(const char* name, const char* data, size_t length,
+                       fly_document_t* doc);
+
+/* Applies edit to the text and updates the tree. result may be NULL.
+ * Returns false if the edit lies outside of the text or the edited text
+ * cannot be allocated; the document is unchanged then. It also returns
+ * false if memory runs out while parsing: the text has the edit, but
+ * the tree, the items and the diagnostics may not until an edit
+ * succeeds, which parses the whole text again. parser.syntree.
+ * out_of_memory is set in between. */
+bool fly_edit_document(fly_document_t* doc, const fly_edit_t* edit,
+                       fly_edit_result_t* result);
+
+/* Collects the diagnostics of all segments in file order into diag,
+ * which is overwritten; at most max_errors errors, 0 for no limit.
+ * fly_parse_buffer has the same messages, but lists all of the lexer's
+ * before the parser's. */
+void fly_document_diag(fly_document_t* doc, u32 max_errors,
+                       diag_buffer_t* diag);
+
+/* Frees the tree, the diagnostics and the text */
+void fly_close_document(fly_document_t* doc);
+
+/* Frees the source table and the interned symbols. No unit may be left. */
+void fly_shutdown(void);
@@ -0,0 +1,469 @@
+#include "literal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+
+/* value of a character as a digit, XX if it is none */
+#define XX 0xff
+global_variable const u8 digit_value[256] = {
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, XX, XX, XX, XX, XX, XX,
+    XX, 10, 11, 12, 13, 14, 15, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, 10, 11, 12, 13, 14, 15, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+};
+#undef XX
+
+/* in literal_table.c */
+extern const u64 power_of_five_128[][2];
+
+#define SMALLEST_POWER_OF_FIVE (-342)
+#define LARGEST_POWER_OF_FIVE 308
+
+typedef struct {
+    u64 low;
+    u64 high;
+} u128_t;
+
+typedef struct {
+    int mantissa_bits; /* explicitly stored bits */
+    int minimum_exponent;
+    int infinite_power;
+    int smallest_power_of_ten;
+    int largest_power_of_ten;
+    int min_exponent_round_to_even;
+    int max_exponent_round_to_even;
+    /* exact conversion with a single float operation, see parse_float64 */
+    int max_exponent_fast_path;
+    u64 max_mantissa_fast_path;
+} float_format_t;
+
+global_variable const float_format_t binary64 = {
+    52, -1023, 0x7ff, -342, 308, -4, 23, 22, (u64)1 << 53,
+};
+
+global_variable const float_format_t binary32 = {
+    23, -127, 0xff, -65, 38, -17, 10, 10, (u64)1 << 24,
+};
+
+global_variable const f64 powers_of_ten_f64[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+global_variable const f32 powers_of_ten_f32[] = {
+    1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f,
+};
+
+/* The fast paths rely on float operations being done in the precision of
+ * their type. That is not the case with x87 code. */
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+#define EXACT_FLOAT_OPERATIONS 1
+#else
+#define EXACT_FLOAT_OPERATIONS 0
+#endif
+
+/* Accumulates the digits in [begin, end). Returns false on overflow. */
+internal bool accumulate(const char* begin, const char* end, u32 base, u64* value) {
+    u64 v = 0;
+    u64 limit = UINT64_MAX / base;
+    for (const char* p = begin; p < end; p++) {
+        u32 digit = digit_value[(u8)*p];
+        if (v > limit || v * base > UINT64_MAX - digit)
+            return false;
+        v = v * base + digit;
+    }
+    *value = v;
+    return true;
+}
+
+internal u128_t multiply_64(u64 a, u64 b) {
+    u128_t r;
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 product = (unsigned __int128)a * b;
+    r.low = (u64)product;
+    r.high = (u64)(product >> 64);
+#else
+    u64 a_lo = (u32)a, a_hi = a >> 32;
+    u64 b_lo = (u32)b, b_hi = b >> 32;
+    u64 p0 = a_lo * b_lo;
+    u64 p1 = a_lo * b_hi;
+    u64 p2 = a_hi * b_lo;
+    u64 p3 = a_hi * b_hi;
+    u64 mid = (p0 >> 32) + (u32)p1 + (u32)p2;
+    r.low = (mid << 32) | (u32)p0;
+    r.high = p3 + (p1 >> 32) + (p2 >> 32) + (mid >> 32);
+#endif
+    return r;
+}
+
+internal int leading_zeroes(u64 x) {
+#if defined(__GNUC__)
+    return __builtin_clzll(x);
+#else
+    int n = 0;
+    while (!(x & 0x8000000000000000ull)) {
+        x <<= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/* A decimal number w * 10^q. truncated is set if nonzero digits beyond
+ * the 19 that fit into w were dropped. */
+typedef struct {
+    u64 w;
+    i64 q;
+    bool truncated;
+} decimal_t;
+
+internal decimal_t read_decimal(const char* int_digits, size_t int_length,
+                                const char* frac_digits, size_t frac_length) {
+    decimal_t d = { 0, 0, false };
+    int digits = 0;
+    for (size_t i = 0; i < int_length; i++) {
+        u32 digit = (u32)(int_digits[i] - '0');
+        if (digits < 19) {
+            if (d.w != 0 || digit != 0) {
+                d.w = d.w * 10 + digit;
+                digits++;
+            }
+        } else {
+            d.q++;
+            d.truncated |= (digit != 0);
+        }
+    }
+    for (size_t i = 0; i < frac_length; i++) {
+        u32 digit = (u32)(frac_digits[i] - '0');
+        if (digits < 19) {
+            if (d.w != 0 || digit != 0) {
+                d.w = d.w * 10 + digit;
+                digits++;
+            }
+            d.q--;
+        } else {
+            d.truncated |= (digit != 0);
+        }
+    }
+    return d;
+}
+
+typedef struct {
+    u64 mantissa;
+    i32 power2; /* biased exponent */
+} adjusted_mantissa_t;
+
+/* Eisel-Lemire: computes the correctly rounded binary float closest to
+ * w * 10^q from a 128 bit approximation of 5^q. The truncated product is
+ * always accurate enough for a 64 bit w (Mushtak & Lemire, "Fast number
+ * parsing without fallback"). */
+internal adjusted_mantissa_t compute_float(const float_format_t* format, i64 q, u64 w) {
+    adjusted_mantissa_t answer;
+    if (w == 0 || q < format->smallest_power_of_ten) {
+        answer.mantissa = 0;
+        answer.power2 = 0;
+        return answer;
+    }
+    if (q > format->largest_power_of_ten) {
+        answer.mantissa = 0;
+        answer.power2 = format->infinite_power;
+        return answer;
+    }
+
+    int lz = leading_zeroes(w);
+    w <<= lz;
+
+    /* we need the implicit bit, a rounding bit and one bit we might lose
+     * if the product is too small */
+    int precision = format->mantissa_bits + 3;
+    u64 precision_mask = 0xffffffffffffffffull >> precision;
+    const u64* power = power_of_five_128[q - SMALLEST_POWER_OF_FIVE];
+    u128_t product = multiply_64(w, power[0]);
+    if ((product.high & precision_mask) == precision_mask) {
+        /* the lower bits might carry into the ones we need */
+        u128_t second = multiply_64(w, power[1]);
+        product.low += second.high;
+        if (second.high > product.low)
+            product.high++;
+    }
+
+    int upperbit = (int)(product.high >> 63);
+    int shift = upperbit + 64 - precision;
+    answer.mantissa = product.high >> shift;
+    /* floor(log2(10^q)) + 63 */
+    i32 power2 = (i32)((((152170 + 65536) * (i32)q) >> 16) + 63);
+    answer.power2 = power2 + upperbit - lz - format->minimum_exponent;
+
+    if (answer.power2 <= 0) {
+        /* subnormal */
+        if (-answer.power2 + 1 >= 64) {
+            answer.mantissa = 0;
+            answer.power2 = 0;
+            return answer;
+        }
+        answer.mantissa >>= -answer.power2 + 1;
+        answer.mantissa += (answer.mantissa & 1);
+        answer.mantissa >>= 1;
+        /* rounding can push us back into the normal range */
+        answer.power2 = (answer.mantissa < ((u64)1 << format->mantissa_bits)) ? 0 : 1;
+        return answer;
+    }
+
+    /* exactly halfway between two floats: round to even. This can only
+     * happen when 5^q fits into 64 bits. */
+    if (product.low <= 1 &&
+            q >= format->min_exponent_round_to_even &&
+            q <= format->max_exponent_round_to_even &&
+            (answer.mantissa & 3) == 1) {
+        if ((answer.mantissa << shift) == product.high)
+            answer.mantissa &= ~(u64)1;
+    }
+
+    answer.mantissa += (answer.mantissa & 1);
+    answer.mantissa >>= 1;
+    if (answer.mantissa >= ((u64)2 << format->mantissa_bits)) {
+        answer.mantissa = (u64)1 << format->mantissa_bits;
+        answer.power2++;
+    }
+    answer.mantissa &= ~((u64)1 << format->mantissa_bits);
+    if (answer.power2 >= format->infinite_power) {
+        answer.mantissa = 0;
+        answer.power2 = format->infinite_power;
+    }
+    return answer;
+}
+
+/* Writes the digits as "0.<digits>e<exponent>" to buffer, which has
+ * room for size bytes, size > 32. Leading zeros are left out; of the
+ * rest, as many as fit are kept and a '1' stands for any nonzero
+ * digits that do not. */
+internal void write_short_form(char* buffer, size_t size,
+                               const char* int_digits, size_t int_length,
+                               const char* frac_digits, size_t frac_length) {
+    long long exponent = (long long)int_length;
+    size_t total = int_length + frac_length, i = 0;
+    for (; i < total; i++, exponent--) {
+        char c = (i < int_length) ? int_digits[i] : frac_digits[i - int_length];
+        if (c != '0')
+            break;
+    }
+    size_t max_digits = size - 32, used = 0;
+    buffer[used++] = '0';
+    buffer[used++] = '.';
+    for (; i < total && used - 2 < max_digits; i++)
+        buffer[used++] = (i < int_length) ? int_digits[i]
+                                          : frac_digits[i - int_length];
+    for (; i < total; i++) {
+        char c = (i < int_length) ? int_digits[i] : frac_digits[i - int_length];
+        if (c != '0') {
+            buffer[used++] = '1';
+            break;
+        }
+    }
+    snprintf(buffer + used, size - used, "e%lld", exponent);
+}
+
+/* Converts with the C library. Only used if more than 19 significant
+ * digits leave the result ambiguous. */
+internal f64 slow_parse(const char* int_digits, size_t int_length,
+                        const char* frac_digits, size_t frac_length,
+                        bool single) {
+    char local[128];
+    size_t size = int_length + frac_length + 3;
+    char* buffer = local;
+    if (size > sizeof(local))
+        buffer = malloc(size);
+    if (!buffer) {
+        /* out of memory: the dropped digits only matter for a number
+         * that close to halfway between two floats */
+        write_short_form(local, sizeof(local), int_digits, int_length,
+                         frac_digits, frac_length);
+        return single ? (f64)strtof(local, NULL) : strtod(local, NULL);
+    }
+    memcpy(buffer, int_digits, int_length);
+    buffer[int_length] = '.';
+    memcpy(buffer + int_length + 1, frac_digits, frac_length);
+    buffer[int_length + 1 + frac_length] = '\0';
+    f64 result = single ? (f64)strtof(buffer, NULL) : strtod(buffer, NULL);
+    if (buffer != local)
+        free(buffer);
+    return result;
+}
+
+f64 parse_float64(const char* int_digits, size_t int_length,
+                  const char* frac_digits, size_t frac_length) {
+    decimal_t d = read_decimal(int_digits, int_length, frac_digits, frac_length);
+#if EXACT_FLOAT_OPERATIONS
+    /* Clinger: w and 10^|q| are exact doubles, so a single correctly
+     * rounded operation gives the right answer */
+    if (!d.truncated && d.w <= binary64.max_mantissa_fast_path &&
+            d.q >= -binary64.max_exponent_fast_path &&
+            d.q <= binary64.max_exponent_fast_path) {
+        f64 value = (f64)d.w;
+        if (d.q < 0)
+            return value / powers_of_ten_f64[-d.q];
+        return value * powers_of_ten_f64[d.q];
+    }
+#endif
+    adjusted_mantissa_t am = compute_float(&binary64, d.q, d.w);
+    if (d.truncated) {
+        adjusted_mantissa_t upper = compute_float(&binary64, d.q, d.w + 1);
+        if (am.mantissa != upper.mantissa || am.power2 != upper.power2)
+            return slow_parse(int_digits, int_length, frac_digits, frac_length, false);
+    }
+    u64 bits = am.mantissa | ((u64)am.power2 << binary64.mantissa_bits);
+    f64 value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+f32 parse_float32(const char* int_digits, size_t int_length,
+                  const char* frac_digits, size_t frac_length) {
+    decimal_t d = read_decimal(int_digits, int_length, frac_digits, frac_length);
+#if EXACT_FLOAT_OPERATIONS
+    if (!d.truncated && d.w <= binary32.max_mantissa_fast_path &&
+            d.q >= -binary32.max_exponent_fast_path &&
+            d.q <= binary32.max_exponent_fast_path) {
+        f32 value = (f32)d.w;
+        if (d.q < 0)
+            return value / powers_of_ten_f32[-d.q];
+        return value * powers_of_ten_f32[d.q];
+    }
+#endif
+    adjusted_mantissa_t am = compute_float(&binary32, d.q, d.w);
+    if (d.truncated) {
+        adjusted_mantissa_t upper = compute_float(&binary32, d.q, d.w + 1);
+        if (am.mantissa != upper.mantissa || am.power2 != upper.power2)
+            return (f32)slow_parse(int_digits, int_length, frac_digits, frac_length, true);
+    }
+    u32 bits = (u32)am.mantissa | ((u32)am.power2 << binary32.mantissa_bits);
+    f32 value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+internal const char* skip_digits(const char* p, u32 base) {
+    while (digit_value[(u8)*p] < base)
+        p++;
+    return p;
+}
+
+/* one of 'L' or 'u' */
+internal const char* scan_suffix(const char* p, bool* is_long, bool* is_unsigned) {
+    if (*p == 'L') {
+        *is_long = true;
+        p++;
+    } else if (*p == 'u') {
+        *is_unsigned = true;
+        p++;
+    }
+    return p;
+}
+
+const char* scan_number(const char* p, token_tag_t* tag, token_value_t* value,
+                        literal_error_t* error) {
+    bool is_unsigned = false;
+    bool is_long = false;
+    bool overflow;
+    u64 v = 0;
+
+    *error = LITERAL_OK;
+    *tag = TOKEN_T_INT;
+    value->unsigned_long = 0;
+
+    if (p[0] == '0' && p[1] == 'x') {
+        const char* digits = p + 2;
+        p = skip_digits(digits, 16);
+        overflow = !accumulate(digits, p, 16, &v);
+        is_unsigned = true;
+        p = scan_suffix(p, &is_long, &is_unsigned);
+    } else {
+        const char* digits = p;
+        p = skip_digits(p, 10);
+        const char* digits_end = p;
+
+        /* floats. "1..2" is a range, not a float */
+        if ((p[0] == '.' && p[1] != '.') || p[0] == 'f') {
+            const char* fraction = p;
+            if (*p == '.')
+                p = skip_digits(++fraction, 10);
+            size_t fraction_length = (size_t)(p - fraction);
+            if (*p == 'f') {
+                p++;
+                *tag = TOKEN_T_FLOAT32;
+                value->float32 = parse_float32(digits, (size_t)(digits_end - digits),
+                                               fraction, fraction_length);
+            } else {
+                *tag = TOKEN_T_FLOAT64;
+                value->float64 = parse_float64(digits, (size_t)(digits_end - digits),
+                                               fraction, fraction_length);
+            }
+            return p;
+        }
+
+        if (*p == 'b') {
+            for (const char* d = digits; d < digits_end; d++) {
+                if (*d > '1') {
+                    *error = LITERAL_BAD_BINARY_DIGIT;
+                    return p + 1;
+                }
+            }
+            overflow = !accumulate(digits, digits_end, 2, &v);
+            is_unsigned = true;
+            p++;
+        } else {
+            u32 base = 10;
+            if (digits[0] == '0') {
+                base = 8;
+                is_unsigned = true;
+                for (const char* d = digits; d < digits_end; d++) {
+                    if (*d > '7') {
+                        *error = LITERAL_BAD_OCTAL_DIGIT;
+                        return p;
+                    }
+                }
+            }
+            overflow = !accumulate(digits, digits_end, base, &v);
+            p = scan_suffix(p, &is_long, &is_unsigned);
+        }
+    }
+
+    if (!is_unsigned && v > INT64_MAX)
+        overflow = true;
+    if (overflow) {
+        *error = LITERAL_OVERFLOW;
+        return p;
+    }
+    if (is_unsigned) {
+        if (is_long || v > UINT32_MAX) {
+            *tag = TOKEN_T_UINTL;
+            value->unsigned_long = v;
+        } else {
+            *tag = TOKEN_T_UINT;
+            value->unsigned_int = (u32)v;
+        }
+    } else {
+        if (is_long || v > INT32_MAX) {
+            *tag = TOKEN_T_INTL;
+            value->signed_long = (i64)v;
+        } else {
+            *tag = TOKEN_T_INT;
+            value->signed_int = (i32)v;
+        }
+    }
+    return p;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "fly.h"
+#include "lexer.h"
+
+typedef enum {
+    LITERAL_OK = 0,
+    LITERAL_OVERFLOW,
+    LITERAL_BAD_OCTAL_DIGIT,
+    LITERAL_BAD_BINARY_DIGIT,
+} literal_error_t;
+
+/* Scans the number literal that starts at p, which must point at a digit.
+ * The text has to be terminated by a non-literal character (the lexer
+ * buffer ends in '\0'). Stores the tag and value of the literal and
+ * returns a pointer to the first character after it.
+ *
+ *   0x1F, 0x1FL   hexadecimal, unsigned
+ *   017, 017L     octal, unsigned
+ *   101b          binary, unsigned
+ *   42, 42L, 42u  decimal
+ *   1.5, 1.5f, 2f floating point
+ *
+ * Integers that do not fit into 32 bits are promoted to the 64 bit type,
+ * integers that do not fit into 64 bits are an error. */
+const char* scan_number(const char* p, token_tag_t* tag, token_value_t* value,
+                        literal_error_t* error);
+
+/* Correctly rounded conversion of the decimal number
+ * <integer digits>.<fraction digits> */
+f64 parse_float64(const char* int_digits, size_t int_length,
+                  const char* frac_digits, size_t frac_length);
+f32 parse_float32(const char* int_digits, size_t int_length,
+                  const char* frac_digits, size_t frac_length);
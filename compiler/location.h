@@ -5,12 +5,27 @@
 #ifndef MULTITHREADED_COMPILER_LOCATION_H
 #define MULTITHREADED_COMPILER_LOCATION_H
 
+#include "fly.h"
+
+/* Index into the source table (source.h) */
+typedef u16 file_id_t;
+
+#define INVALID_FILE_ID 0xffff
+
+/* Packed source location. Line and column are only computed when a
+ * diagnostic needs them (expand_location). */
 typedef struct {
-    char* file;
+    u32 offset;     /* byte offset of the first character */
+    file_id_t file;
+    u16 length;     /* in bytes, saturated at 0xffff */
+} location_t;
+
+typedef struct {
+    const char* file;
     int start_line;
     int end_line;
     int start_column;
     int end_column;
-} location_t;
+} expanded_location_t;
 
 #endif //MULTITHREADED_COMPILER_LOCATION_H
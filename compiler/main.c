@@ -1,20 +1,264 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "parser.h"
+#include "source.h"
+#include "driver.h"
+#include "trace.h"
+
+/* Response files nested deeper than this are most likely a cycle */
+#define MAX_RESPONSE_DEPTH 8
+
+typedef struct {
+    char** items;
+    u32 count;
+    u32 capacity;
+    /* contents of the response files, the items point into them */
+    char** buffers;
+    u32 num_buffers;
+    u32 buffer_capacity;
+} arg_list_t;
+
+internal void out_of_memory(void) {
+    fprintf(stderr, "Out of memory!\n");
+    exit(255);
+}
+
+internal void push(char*** array, u32* count, u32* capacity, char* item) {
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        *array = realloc(*array, *capacity * sizeof(char*));
+        if (!*array)
+            out_of_memory();
+    }
+    (*array)[(*count)++] = item;
+}
+
+internal bool add_args(arg_list_t* args, char** argv, u32 argc, u32 depth);
+
+/* Adds the arguments in a response file: separated by whitespace,
+ * quoted with "" or '' if they contain whitespace themselves. */
+internal bool add_response_file(arg_list_t* args, const char* path, u32 depth) {
+    if (depth == MAX_RESPONSE_DEPTH) {
+        printf("Response files nested too deep at %s.\n", path);
+        return false;
+    }
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        printf("Could not read response file %s.\n", path);
+        return false;
+    }
+    size_t capacity = 4096, length = 0;
+    char* text = malloc(capacity);
+    if (!text)
+        out_of_memory();
+    size_t read;
+    while ((read = fread(text + length, 1, capacity - length - 1, f)) > 0) {
+        length += read;
+        if (length + 1 == capacity) {
+            capacity *= 2;
+            text = realloc(text, capacity);
+            if (!text)
+                out_of_memory();
+        }
+    }
+    fclose(f);
+    text[length] = '\0';
+    push(&args->buffers, &args->num_buffers, &args->buffer_capacity, text);
+
+    /* split in place */
+    char** items = NULL;
+    u32 count = 0, items_capacity = 0;
+    char* p = text;
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+            p++;
+        if (*p == '\0')
+            break;
+        char* item = p;
+        char* to = p;
+        char quote = 0;
+        while (*p != '\0' &&
+                (quote || (*p != ' ' && *p != '\t' && *p != '\r' && *p != '\n'))) {
+            if (quote && *p == quote) {
+                quote = 0;
+            } else if (!quote && (*p == '"' || *p == '\'')) {
+                quote = *p;
+            } else {
+                *to++ = *p;
+            }
+            p++;
+        }
+        if (*p != '\0')
+            p++;
+        *to = '\0';
+        push(&items, &count, &items_capacity, item);
+    }
+    bool ok = add_args(args, items, count, depth + 1);
+    free(items);
+    return ok;
+}
+
+internal bool add_args(arg_list_t* args, char** argv, u32 argc, u32 depth) {
+    for (u32 i = 0; i < argc; i++) {
+        if (argv[i][0] == '@') {
+            if (!add_response_file(args, argv[i] + 1, depth))
+                return false;
+        } else {
+            push(&args->items, &args->count, &args->capacity, argv[i]);
+        }
+    }
+    return true;
+}
+
+internal void print_usage(void) {
+    printf("usage: flyc [options] file.fly... [@response-file]\n"
+           "  -j N                parse on N threads\n"
+           "  --dump-ast          print the syntax tree of every file\n"
+           "  --lazy-bodies       skip function bodies\n"
+           "  -I dir              add dir to the module search path\n"
+           "  --cache-dir dir     keep the syntax trees in dir\n"
+           "  --max-errors N      stop a file after N errors, 0 for no limit\n"
+           "  --stats[=json]      report times and counts on stderr\n"
+           "  --stats-file file   report them to file instead\n"
+           "  --trace file.json   write a Chrome trace\n"
+           "  --help              print this and exit\n");
+}
+
+internal void release_args(arg_list_t* args) {
+    for (u32 i = 0; i < args->num_buffers; i++)
+        free(args->buffers[i]);
+    free(args->buffers);
+    free(args->items);
+}
 
 int main(int argc, char** argv) {
-    if (argc < 2) {
-        printf("No input file specified.\n");
+    arg_list_t args = { 0 };
+    if (!add_args(&args, argv + 1, (u32)argc - 1, 0)) {
+        release_args(&args);
         return 1;
     }
-    parser_t parser;
-    if (!init_parser(&parser, argv[1])) {
-        return 2;
+
+    driver_options_t options = { 0 };
+    options.max_errors = 20;
+    char** inputs = NULL;
+    u32 num_inputs = 0, input_capacity = 0;
+    u32 search_capacity = 0;
+    bool stats = false;
+    const char* stats_path = NULL;
+    const char* trace_path = NULL;
+    int result = 0;
+    for (u32 i = 0; i < args.count; i++) {
+        char* arg = args.items[i];
+        if (strcmp(arg, "--help") == 0) {
+            print_usage();
+            goto out;
+        } else if (strcmp(arg, "--dump-ast") == 0) {
+            options.dump_ast = true;
+        } else if (strcmp(arg, "--stats") == 0 ||
+                strcmp(arg, "--stats=text") == 0) {
+            stats = true;
+            options.stats_format = STATS_FORMAT_TEXT;
+        } else if (strcmp(arg, "--stats=json") == 0) {
+            stats = true;
+            options.stats_format = STATS_FORMAT_JSON;
+        } else if (strcmp(arg, "--stats-file") == 0) {
+            if (i + 1 == args.count) {
+                printf("--stats-file expects a file name.\n");
+                result = 1;
+                goto out;
+            }
+            stats = true;
+            stats_path = args.items[++i];
+        } else if (strcmp(arg, "--trace") == 0) {
+            if (i + 1 == args.count) {
+                printf("--trace expects a file name.\n");
+                result = 1;
+                goto out;
+            }
+            trace_path = args.items[++i];
+        } else if (strcmp(arg, "--max-errors") == 0) {
+            if (i + 1 == args.count || atoi(args.items[i + 1]) < 0) {
+                printf("--max-errors expects a number.\n");
+                result = 1;
+                goto out;
+            }
+            options.max_errors = (u32)atoi(args.items[++i]);
+        } else if (strcmp(arg, "--cache-dir") == 0) {
+            if (i + 1 == args.count) {
+                printf("--cache-dir expects a directory.\n");
+                result = 1;
+                goto out;
+            }
+            options.cache_dir = args.items[++i];
+        } else if (strcmp(arg, "--lazy-bodies") == 0) {
+            options.lazy_bodies = true;
+        } else if (strncmp(arg, "-j", 2) == 0) {
+            /* -j N or -jN */
+            const char* count = arg[2] ? arg + 2 :
+                                (i + 1 < args.count) ? args.items[++i] : NULL;
+            if (!count || atoi(count) < 1) {
+                printf("-j expects a thread count.\n");
+                result = 1;
+                goto out;
+            }
+            options.num_threads = (u32)atoi(count);
+        } else if (strncmp(arg, "-I", 2) == 0) {
+            /* -I dir or -Idir */
+            char* dir = arg[2] ? arg + 2 :
+                        (i + 1 < args.count) ? args.items[++i] : NULL;
+            if (!dir) {
+                printf("-I expects a directory.\n");
+                result = 1;
+                goto out;
+            }
+            push(&options.search_paths, &options.num_search_paths,
+                 &search_capacity, dir);
+        } else if (arg[0] == '-') {
+            printf("Unknown option %s.\n", arg);
+            print_usage();
+            result = 1;
+            goto out;
+        } else {
+            push(&inputs, &num_inputs, &input_capacity, arg);
+        }
+    }
+    if (num_inputs == 0) {
+        printf("No input file specified.\n");
+        result = 1;
+        goto out;
     }
 
-    parse_program(&parser);
+    if (stats) {
+        options.stats_out = stats_path ? fopen(stats_path, "w") : stderr;
+        if (!options.stats_out) {
+            printf("Could not open %s.\n", stats_path);
+            result = 1;
+            goto out;
+        }
+    }
+
+    if (trace_path)
+        trace_init();
+    u32 failed = driver_parse_files(inputs, num_inputs, &options,
+                                    stdout, stderr);
+    if (trace_path && !trace_write(trace_path)) {
+        printf("Could not write %s.\n", trace_path);
+        result = 1;
+    }
     printf("Done parsing\n");
+    if (failed > 0)
+        result = 1;
 
-    release_parser(&parser);
-    return 0;
+out:
+    if (options.stats_out && options.stats_out != stderr)
+        fclose(options.stats_out);
+    free(inputs);
+    free(options.search_paths);
+    release_args(&args);
+    release_trace();
+    release_sources();
+    release_interner();
+    return result;
 }
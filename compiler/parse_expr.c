@@ -7,519 +7,257 @@
 
 /* In parser.c */
 extern void syntax_error(parser_t* parser, const char* expected);
-extern void print_indent(parser_t* parser);
 extern void next_token(parser_t* parser);
+extern token_tag_t peek(parser_t* parser, u32 k);
 
-typedef enum {
-    LEFT,
-    RIGHT,
-    NONE
-} op_assoc_t;
-
-internal op_assoc_t get_operator_associativity(token_tag_t op) {
-    switch (op) {
-        case TOKEN_T_NOT:
-        case TOKEN_T_DEC:
-        case TOKEN_T_INC:
-            return NONE;
-        case TOKEN_T_ASSIGN:
-            return RIGHT;
-        default:
-            /* we assume that only operators get passed in here */
-            return LEFT;
-    }
-}
+#define OPERATOR_INFO(tag, spelling, kinds, precedence, assoc) \
+    [tag] = { kinds, precedence, assoc },
 
-internal int get_operator_precedence(token_tag_t op) {
-    switch (op) {
-        case TOKEN_T_ADD:
-        case TOKEN_T_SUB:
-            return 10;
-        case TOKEN_T_MUL:
-        case TOKEN_T_DIV:
-        case TOKEN_T_MOD:
-            return 11;
-        case TOKEN_T_SHIFT_LEFT:
-        case TOKEN_T_SHIFT_RIGHT:
-            return 9;
-        case TOKEN_T_BITWISE_AND:
-            return 5;
-        case TOKEN_T_BITWISE_OR:
-            return 4;
-        case TOKEN_T_BITWISE_XOR:
-            return 3;
-        case TOKEN_T_BITWISE_NOT:
-            return 12;
-        case TOKEN_T_AND:
-            return 2;
-        case TOKEN_T_OR:
-            return 1;
-        case TOKEN_T_NOT:
-        case TOKEN_T_INC:
-        case TOKEN_T_DEC:
-            return 12;
-        case TOKEN_T_ASSIGN:
-        case TOKEN_T_ADD_ASSIGN:
-        case TOKEN_T_SUB_ASSIGN:
-        case TOKEN_T_MUL_ASSIGN:
-        case TOKEN_T_DIV_ASSIGN:
-        case TOKEN_T_MOD_ASSIGN:
-        case TOKEN_T_BITWISE_AND_ASSIGN:
-        case TOKEN_T_BITWISE_OR_ASSIGN:
-        case TOKEN_T_BITWISE_XOR_ASSIGN:
-        case TOKEN_T_SHIFT_LEFT_ASSIGN:
-        case TOKEN_T_SHIFT_RIGHT_ASSIGN:
-            return 0;
-        case TOKEN_T_EQUAL:
-            return 6;
-        case TOKEN_T_NOT_EQUAL:
-            return 7;
-        case TOKEN_T_LESS_EQUAL:
-        case TOKEN_T_GREATER_EQUAL:
-        case TOKEN_T_LANGLE:
-        case TOKEN_T_RANGLE:
-            return 8;
-        default:
-            return -1;
-    }
-}
+const operator_info_t operator_info[TOKEN_T_COUNT] = {
+    FLY_OPERATORS(OPERATOR_INFO)
+};
+
+#undef OPERATOR_INFO
 
-typedef struct {
-    ast_id ast;
-    op_assoc_t assoc;
-    int prec;
-} operator_t;
-
-typedef enum {
-    UNKNOWN = 0,
-    INT,
-    UINT,
-    INTL,
-    UINTL,
-    CHAR,
-    BOOL,
-    STRING,
-    FLOAT32,
-    FLOAT64
-} native_type_t;
-
-typedef struct {
-    ast_id ast;
-    native_type_t type;
-} operand_t;
-
-/* ******* Operator stack ********* */
-typedef struct {
-    operator_t* stack;
-    int capacity;
-    int top;
-} operator_stack_t;
-
-operator_stack_t operator_stack_init() {
-    operator_stack_t stack = {
-            .stack = NULL,
-            .capacity = 0,
-            .top = -1
-    };
-    return stack;
+internal inline bool is_op(token_tag_t tag, u8 kind) {
+    return (operator_info[tag].kinds & kind) != 0;
 }
 
-bool operator_stack_push(operator_stack_t* stack, operator_t op) {
-    assert(stack);
-    stack->top++;
-    if (stack->top == stack->capacity) {
-        stack->capacity += 10;
-        operator_t* tmp = realloc(stack->stack, stack->capacity * sizeof(operator_t));
+/* ******* Expression stacks ********* */
+/* The operator and operand stacks live in the parser and are shared by
+ * all expressions. A nested expression (in braces, a call argument, ...)
+ * works above the heights it found on entry and leaves them as they were,
+ * so once the stacks have grown, parsing an expression allocates nothing. */
+
+/* The pushes return false and set syntree.out_of_memory if the stack
+ * cannot grow. */
+internal bool push_operator(parser_t* parser, token_tag_t op) {
+    expr_stacks_t* stacks = &parser->expr;
+    if (stacks->num_operators == stacks->operator_capacity) {
+        u32 capacity = stacks->operator_capacity ?
+            stacks->operator_capacity * 2 : 32;
+        u16* tmp = realloc(stacks->operators, capacity * sizeof(u16));
         if (!tmp) {
-            stack->top--;
-            stack->capacity -= 10;
+            parser->syntree.out_of_memory = true;
             return false;
         }
-        stack->stack = tmp;
+        stacks->operators = tmp;
+        stacks->operator_capacity = capacity;
     }
-    stack->stack[stack->top] = op;
+    stacks->operators[stacks->num_operators++] = (u16)op;
     return true;
 }
 
-operator_t operator_stack_pop(operator_stack_t* stack) {
-    assert(stack);
-    assert(stack->top > -1);
-    return stack->stack[stack->top--];
-}
-
-void operator_stack_release(operator_stack_t* stack) {
-    assert(stack);
-    free(stack->stack);
-    stack->capacity = 0;
-    stack->top = 0;
-}
-
-/* ********** Operand Stack *********** */
-typedef struct {
-    operand_t* stack;
-    int capacity;
-    int top;
-} operand_stack_t;
-
-operand_stack_t operand_stack_init() {
-    operand_stack_t stack = {
-            .stack = NULL,
-            .capacity = 0,
-            .top = -1
-    };
-    return stack;
-}
-
-bool operand_stack_push(operand_stack_t* stack, operand_t op) {
-    assert(stack);
-    stack->top++;
-    if (stack->top == stack->capacity) {
-        stack->capacity += 10;
-        operand_t* tmp = realloc(stack->stack, stack->capacity * sizeof(operand_t));
+internal bool push_operand(parser_t* parser, ast_id operand) {
+    expr_stacks_t* stacks = &parser->expr;
+    if (stacks->num_operands == stacks->operand_capacity) {
+        u32 capacity = stacks->operand_capacity ?
+            stacks->operand_capacity * 2 : 32;
+        ast_id* tmp = realloc(stacks->operands, capacity * sizeof(ast_id));
         if (!tmp) {
-            stack->top--;
-            stack->capacity -= 10;
+            parser->syntree.out_of_memory = true;
             return false;
         }
-        stack->stack = tmp;
+        stacks->operands = tmp;
+        stacks->operand_capacity = capacity;
     }
-    stack->stack[stack->top] = op;
+    stacks->operands[stacks->num_operands++] = operand;
     return true;
 }
 
-operand_t operand_stack_pop(operand_stack_t* stack) {
-    assert(stack);
-    assert(stack->top > -1);
-    return stack->stack[stack->top--];
-}
-
-void operand_stack_release(operand_stack_t* stack) {
-    assert(stack);
-    free(stack->stack);
-    stack->capacity = 0;
-    stack->top = 0;
+/* Replaces the top operator and its two operands by an infix expression */
+internal void reduce(parser_t* parser) {
+    expr_stacks_t* stacks = &parser->expr;
+    assert(stacks->num_operators > 0 && stacks->num_operands >= 2);
+    token_tag_t op = (token_tag_t)stacks->operators[--stacks->num_operators];
+    ast_id right = stacks->operands[--stacks->num_operands];
+    ast_id left = stacks->operands[stacks->num_operands - 1];
+    ast_id op_id = syntree_add_operator(&parser->syntree, op);
+    stacks->operands[stacks->num_operands - 1] =
+        syntree_add_list(&parser->syntree, AST_INFIX_EXPR, 3,
+                         left, op_id, right);
 }
 
 /* Expressions */
 
-internal int is_next_infix_op(parser_t* parser) {
-    switch (parser->next.tag) {
-        case TOKEN_T_ADD:
-        case TOKEN_T_SUB:
-        case TOKEN_T_MUL:
-        case TOKEN_T_DIV:
-        case TOKEN_T_MOD:
-        case TOKEN_T_BITWISE_AND:
-        case TOKEN_T_BITWISE_OR:
-        case TOKEN_T_BITWISE_XOR:
-        case TOKEN_T_SHIFT_LEFT:
-        case TOKEN_T_SHIFT_RIGHT:
-        case TOKEN_T_AND:
-        case TOKEN_T_OR:
-        case TOKEN_T_EQUAL:
-        case TOKEN_T_NOT_EQUAL:
-        case TOKEN_T_LESS_EQUAL:
-        case TOKEN_T_GREATER_EQUAL:
-        case TOKEN_T_LANGLE:
-        case TOKEN_T_RANGLE:
-            return 1;
-        default:
-            return 0;
-    }
-}
-
-internal ast_id parse_infix_operator(parser_t* parser) {
-    switch (parser->next.tag) {
-        case TOKEN_T_ADD:
-        case TOKEN_T_SUB:
-        case TOKEN_T_MUL:
-        case TOKEN_T_DIV:
-        case TOKEN_T_MOD:
-        case TOKEN_T_BITWISE_AND:
-        case TOKEN_T_BITWISE_OR:
-        case TOKEN_T_BITWISE_XOR:
-        case TOKEN_T_SHIFT_LEFT:
-        case TOKEN_T_SHIFT_RIGHT:
-        case TOKEN_T_AND:
-        case TOKEN_T_OR:
-        /* case TOKEN_T_ASSIGN:
-        case TOKEN_T_ADD_ASSIGN:
-        case TOKEN_T_SUB_ASSIGN:
-        case TOKEN_T_MUL_ASSIGN:
-        case TOKEN_T_DIV_ASSIGN:
-        case TOKEN_T_MOD_ASSIGN:
-        case TOKEN_T_BITWISE_AND_ASSIGN:
-        case TOKEN_T_BITWISE_OR_ASSIGN:
-        case TOKEN_T_BITWISE_XOR_ASSIGN:
-        case TOKEN_T_SHIFT_LEFT_ASSIGN:
-        case TOKEN_T_SHIFT_RIGHT_ASSIGN: */
-        case TOKEN_T_EQUAL:
-        case TOKEN_T_NOT_EQUAL:
-        case TOKEN_T_LESS_EQUAL:
-        case TOKEN_T_GREATER_EQUAL:
-        case TOKEN_T_LANGLE:
-        case TOKEN_T_RANGLE:
-            next_token(parser);
-            return 1; // we need to differentiate between success and failure.
-        default:
-            syntax_error(parser, "infix operator");
-            break;
-    }
-    return AST_INVALID_ID;
-}
-
-
 internal ast_id parse_const_simple_operand(parser_t* parser);
 
 internal ast_id parse_simple_operand(parser_t* parser) {
     /* simple operands are either constants or identifier (which are ids or .) */
     if (parser->next.tag == TOKEN_T_ID) {
-        parse_id(parser);
-        while (parser->next.tag == '.') {
-            next_token(parser);
-            print_indent(parser);
-            printf(".\n");
-            parse_id(parser);
-        }
-        return 1;
+        /* field accesses are handled with the postfix operators */
+        return parse_id(parser);
     } else
         return parse_const_simple_operand(parser);
 
 }
 
-internal ast_id parse_prefix_expr(parser_t* parser) {
-    if (parser->next.tag != TOKEN_T_NOT &&
-            parser->next.tag != TOKEN_T_INC &&
-            parser->next.tag != TOKEN_T_DEC &&
-            parser->next.tag != '~') {
-        return AST_INVALID_ID;
-    }
-    next_token(parser);
-    print_indent(parser);
-    printf("prefix_exp\n");
-    parser->debug_indent += 4;
-    parse_expr(parser);
-    parser->debug_indent -= 4;
-    return 1;
-}
-
-#define UNUSED(x)((void)x)
-
-internal ast_id parse_call_operator(parser_t* parser) {
+/* callee, arguments... */
+internal ast_id parse_call_operator(parser_t* parser, ast_id callee) {
     assert(parser->next.tag == '(');
     next_token(parser);
-    
-    print_indent(parser);
-    printf("call\n");
-    parser->debug_indent += 4;
 
+    u32 call = syntree_list_begin(&parser->syntree);
+    syntree_list_push(&parser->syntree, callee);
     while (parser->next.tag != ')') {
-        parse_expr(parser);
+        syntree_list_push(&parser->syntree, parse_expr(parser));
         if (parser->next.tag != ',' && parser->next.tag != ')') {
             syntax_error(parser, "',' or ')'");
+            syntree_list_discard(&parser->syntree, call);
             return AST_INVALID_ID;
         }
         if (parser->next.tag == ',')
             next_token(parser);
     }
     next_token(parser);
-    parser->debug_indent -= 4;
-    
-    return 1;
+
+    return syntree_list_commit(&parser->syntree, AST_CALL, call);
 }
 
-internal ast_id parse_infix_expr(parser_t* parser) {
-    operand_stack_t operand_stack = operand_stack_init();
-    operator_stack_t operator_stack = operator_stack_init();
-
-    { /* parse first operand */
-        ast_id first_operand;
-        if (parser->next.tag == '!' ||
-                parser->next.tag == TOKEN_T_INC ||
-                parser->next.tag == TOKEN_T_DEC ||
-                parser->next.tag == '~') {
-            first_operand = parse_prefix_expr(parser);
-        } else {
-            first_operand = parse_simple_operand(parser);
-        }
-        if (parser->next.tag == '(') {
-            /* call operator */
-            parse_call_operator(parser);
-        }
-        if (parser->next.tag == '[') {
-            /* array access operator */
+/* Call, array access, field access and postfix operators following an
+ * operand. Constant expressions only allow postfix operators. */
+internal ast_id parse_postfix_ops(parser_t* parser, ast_id operand,
+                                  bool constant) {
+    while (operand) {
+        if (!constant && parser->next.tag == '(') {
+            operand = parse_call_operator(parser, operand);
+        } else if (!constant && parser->next.tag == '[') {
             next_token(parser);
-            parser->debug_indent += 4;
-            parse_expr(parser);
-            parser->debug_indent -= 4;
+            ast_id index = parse_expr(parser);
             if (parser->next.tag != ']') {
                 syntax_error(parser, "]");
                 return AST_INVALID_ID;
             }
             next_token(parser);
-        }
-        if (parser->next.tag == TOKEN_T_INC ||
-                parser->next.tag == TOKEN_T_DEC) {
-            /* we have a postfix operator */
+            operand = syntree_add_pair(&parser->syntree, AST_ARRAY_ACCESS,
+                                       operand, index);
+        } else if (!constant && parser->next.tag == '.') {
             next_token(parser);
-        }
-
-        operand_t op = { .ast = first_operand };
-        operand_stack_push(&operand_stack, op);
-    }
-    if (!is_next_infix_op(parser)) {
-        /* done. */
-        return 1;
-    }
-
-    while (true) {
-        // Looking from the last operand, we expect to see an infix operator
-        // and an operand, which is either an expression in braces,
-        // a normal operand or a prefix expression.
-        // This is optionally followed by a postfix operator.
-        if (!is_next_infix_op(parser))
-            break; // done
-
-        token_tag_t infix_tag = parser->next.tag;
-        ast_id infix_op = parse_infix_operator(parser);
-
-        ast_id operand = AST_INVALID_ID;
-        if (parser->next.tag == '(') {
+            ast_id field = parse_id(parser);
+            if (!field)
+                return AST_INVALID_ID;
+            operand = syntree_add_pair(&parser->syntree, AST_FIELD_ACCESS,
+                                       operand, field);
+        } else if (is_op(parser->next.tag, OP_POSTFIX)) {
+            ast_id op = syntree_add_operator(&parser->syntree,
+                                             parser->next.tag);
             next_token(parser);
-            parser->debug_indent += 4;
-            operand = parse_expr(parser);
-            parser->debug_indent -= 4;
-        } else if (parser->next.tag == '!' ||
-                parser->next.tag == '~' ||
-                parser->next.tag == TOKEN_T_INC ||
-                parser->next.tag == TOKEN_T_DEC) {
-            operand = parse_prefix_expr(parser);
+            operand = syntree_add_pair(&parser->syntree, AST_POSTFIX_EXPR,
+                                       operand, op);
         } else {
-            operand = parse_simple_operand(parser);
+            break;
         }
+    }
+    return operand;
+}
 
-        if (!operand) {
-            operand_stack_release(&operand_stack);
-            operator_stack_release(&operator_stack);
-            printf("!");
-            syntax_error(parser, "operand");
+/* An operand is an expression in braces, a prefix operator applied to an
+ * operand or a simple operand, followed by any postfix operators. */
+internal ast_id parse_operand(parser_t* parser, bool constant) {
+    ast_id operand;
+    if (parser->next.tag == '(') {
+        next_token(parser);
+        operand = constant ? parse_const_expr(parser) : parse_expr(parser);
+        if (!operand)
+            return AST_INVALID_ID;
+        if (parser->next.tag != ')') {
+            syntax_error(parser, ")");
             return AST_INVALID_ID;
         }
+        next_token(parser);
+    } else if (is_op(parser->next.tag, OP_PREFIX)) {
+        ast_id op = syntree_add_operator(&parser->syntree, parser->next.tag);
+        next_token(parser);
+        ast_id inner = parse_operand(parser, constant);
+        if (!inner)
+            return AST_INVALID_ID;
+        /* prefix operators bind tighter than any infix operator, but
+         * postfix operators were already applied to inner */
+        return syntree_add_pair(&parser->syntree, AST_PREFIX_EXPR, op, inner);
+    } else {
+        operand = constant ? parse_const_simple_operand(parser)
+                           : parse_simple_operand(parser);
+    }
+    return parse_postfix_ops(parser, operand, constant);
+}
 
-		if (parser->next.tag == '(') {
-			/* call operator */
-			parse_call_operator(parser);
-		}
-		if (parser->next.tag == '[') {
-			/* array access operator */
-			next_token(parser);
-			parser->debug_indent += 4;
-			parse_expr(parser);
-			parser->debug_indent -= 4;
-			if (parser->next.tag != ']') {
-				syntax_error(parser, "]");
-				return AST_INVALID_ID;
-			}
-			next_token(parser);
-		}
-        if (parser->next.tag == TOKEN_T_INC ||
-                parser->next.tag == TOKEN_T_DEC) {
-            /* postfix op */
-            next_token(parser);
-        }
+/* Shunting-yard over the parser's expression stacks */
+internal ast_id parse_operator_expr(parser_t* parser, bool constant) {
+    expr_stacks_t* stacks = &parser->expr;
+    u32 operator_base = stacks->num_operators;
+    u32 operand_base = stacks->num_operands;
+
+    ast_id operand = parse_operand(parser, constant);
+    if (!operand || !push_operand(parser, operand))
+        return AST_INVALID_ID;
 
-        int top_prec, new_prec;
-        top_prec = (operator_stack.top > -1) ?
-            operator_stack.stack[operator_stack.top].prec : -1;
-        new_prec = get_operator_precedence(infix_tag);
-        op_assoc_t assoc = get_operator_associativity(infix_tag);
-        while (new_prec <= top_prec) {
-            if ((new_prec == top_prec) && (assoc == RIGHT)) {
+    while (is_op(parser->next.tag, OP_INFIX)) {
+        token_tag_t infix_tag = parser->next.tag;
+        next_token(parser);
+
+        operator_info_t info = operator_info[infix_tag];
+        while (stacks->num_operators > operator_base) {
+            u16 top = stacks->operators[stacks->num_operators - 1];
+            u8 top_prec = operator_info[top].precedence;
+            if (top_prec < info.precedence ||
+                    ((info.precedence == top_prec) &&
+                     (info.assoc == OP_RIGHT))) {
                 // evaluate from right to left, which is done below or in
                 // a later iteration
                 break;
             }
-            operator_t top_op = operator_stack_pop(&operator_stack);
-            assert(operand_stack.top >= 1);
-            operand_t right = operand_stack_pop(&operand_stack);
-            operand_t left = operand_stack_pop(&operand_stack);
-            UNUSED(top_op);
-            UNUSED(right);
-            UNUSED(left);
-
-            /* create a new syntree entry */
-            operand_t result = { .ast = 42, .type = 0 };
-            operand_stack_push(&operand_stack, result);
-
-            top_prec = (operator_stack.top > -1) ?
-                operator_stack.stack[operator_stack.top].prec : -1;
+            reduce(parser);
         }
-        operator_t new_op = {
-            .ast = infix_op,
-            .assoc = assoc,
-            .prec = new_prec
-        };
-        operand_t new_operand = { operand, 0 };
-        operator_stack_push(&operator_stack, new_op);
-        operand_stack_push(&operand_stack, new_operand);
-    }
 
-    while (operator_stack.top > -1) {
-        operator_t top_operator = operator_stack_pop(&operator_stack);
-        assert(operand_stack.top >= 1);
-
-        // NOTE(Kevin): Verify that these are in the right order
-        operand_t left = operand_stack_pop(&operand_stack);
-        operand_t right = operand_stack_pop(&operand_stack);
-
-        UNUSED(top_operator);
-        UNUSED(left);
-        UNUSED(right);
-
-        /* TODO: create new operand */
-        operand_t new_operand = { 42, 0 };
-        operand_stack_push(&operand_stack, new_operand);
-    }
-    assert(operand_stack.top == 0);
-    ast_id expr = operand_stack_pop(&operand_stack).ast;
-
-    print_indent(parser);
-    printf("expr\n");
-
-    if (parser->next.tag == '(') {
-        /* call operator */
-        next_token(parser);
-    }
-    if (parser->next.tag == '[') {
-        /* array access operator */
-        next_token(parser);
-        parser->debug_indent += 4;
-        parse_expr(parser);
-        parser->debug_indent -= 4;
-        if (parser->next.tag != ']') {
-            syntax_error(parser, "]");
+        operand = parse_operand(parser, constant);
+        if (!operand) {
+            stacks->num_operators = operator_base;
+            stacks->num_operands = operand_base;
+            syntax_error(parser, "operand");
+            return AST_INVALID_ID;
+        }
+        if (!push_operator(parser, infix_tag) ||
+                !push_operand(parser, operand)) {
+            stacks->num_operators = operator_base;
+            stacks->num_operands = operand_base;
             return AST_INVALID_ID;
         }
-        next_token(parser);
-    }
-
-    if (parser->next.tag == TOKEN_T_INC ||
-            parser->next.tag == TOKEN_T_DEC) {
-        /* we have a postfix operator */
-        next_token(parser);
     }
 
+    while (stacks->num_operators > operator_base)
+        reduce(parser);
+    assert(stacks->num_operands == operand_base + 1);
+    return stacks->operands[--stacks->num_operands];
+}
 
+internal ast_id parse_infix_expr(parser_t* parser) {
+    return parse_operator_expr(parser, false);
+}
 
-    operator_stack_release(&operator_stack);
-    operand_stack_release(&operand_stack);
-    return expr;
+/* '(' starts a function instead of a braced expression if it is followed
+ * by a parameter list or by ')' and an arrow. */
+internal bool is_function_start(parser_t* parser) {
+    if (parser->next.tag != '(')
+        return false;
+    switch (peek(parser, 1)) {
+        case TOKEN_T_ID:
+            return peek(parser, 2) == ':';
+        case TOKEN_T_ELLIPSIS:
+            return true;
+        case ')':
+            return peek(parser, 2) == TOKEN_T_ARROW ||
+                   peek(parser, 2) == TOKEN_T_BIG_ARROW;
+        default:
+            return false;
+    }
 }
 
 ast_id parse_expr(parser_t* parser) {
-    /* This could be a cast or an arithmetic expression. */
+    /* This could be a cast, a function or an arithmetic expression. */
     if (parser->next.tag == TOKEN_T_KW_CAST)
         return parse_cast(parser);
+    else if (is_function_start(parser))
+        return parse_function(parser);
     else
         return parse_infix_expr(parser);
 }
@@ -528,17 +266,13 @@ ast_id parse_cast(parser_t* parser) {
     assert(parser->next.tag == TOKEN_T_KW_CAST);
     next_token(parser);
 
-    print_indent(parser);
-    printf("cast\n");
-
-    parser->debug_indent += 4;
     if (parser->next.tag != '<') {
         syntax_error(parser, "<");
         return AST_INVALID_ID;
     }
     next_token(parser);
 
-    parse_type(parser);
+    ast_id type = parse_type(parser);
     if (parser->next.tag != '>') {
         syntax_error(parser, ">");
         return AST_INVALID_ID;
@@ -551,7 +285,7 @@ ast_id parse_cast(parser_t* parser) {
     }
     next_token(parser);
 
-    parse_expr(parser);
+    ast_id expr = parse_expr(parser);
 
     if (parser->next.tag != ')') {
         syntax_error(parser, ")");
@@ -559,37 +293,63 @@ ast_id parse_cast(parser_t* parser) {
     }
     next_token(parser);
 
-    parser->debug_indent -= 4;
-    return 1;
+    return syntree_add_pair(&parser->syntree, AST_CAST, type, expr);
 }
 
+/* targets..., operator, value */
 ast_id parse_assign(parser_t* parser) {
+    u32 assign = syntree_list_begin(&parser->syntree);
     ast_id expr = parse_expr(parser);
+    syntree_list_push(&parser->syntree, expr);
+    bool multiple = false;
     while (parser->next.tag == ',' ) {
-        parse_expr(parser);
+        next_token(parser);
+        syntree_list_push(&parser->syntree, parse_expr(parser));
+        multiple = true;
     }
-    if (parser->next.tag != TOKEN_T_ASSIGN &&
-            parser->next.tag != TOKEN_T_ADD_ASSIGN &&
-            parser->next.tag != TOKEN_T_SUB_ASSIGN &&
-            parser->next.tag != TOKEN_T_MUL_ASSIGN &&
-            parser->next.tag != TOKEN_T_DIV_ASSIGN &&
-            parser->next.tag != TOKEN_T_MOD_ASSIGN &&
-            parser->next.tag != TOKEN_T_BITWISE_AND_ASSIGN &&
-            parser->next.tag != TOKEN_T_BITWISE_OR_ASSIGN &&
-            parser->next.tag != TOKEN_T_BITWISE_XOR_ASSIGN &&
-            parser->next.tag != TOKEN_T_SHIFT_LEFT_ASSIGN &&
-            parser->next.tag != TOKEN_T_SHIFT_RIGHT_ASSIGN) {
+    if (!is_op(parser->next.tag, OP_ASSIGN)) {
+        syntree_list_discard(&parser->syntree, assign);
+        if (multiple) {
+            syntax_error(parser, "assignment");
+            return AST_INVALID_ID;
+        }
         return expr;
     }
-    print_indent(parser);
-    printf("assign\n");
+    syntree_list_push(&parser->syntree,
+            syntree_add_operator(&parser->syntree, parser->next.tag));
     next_token(parser);
-    parse_assign(parser);
-    return 1;
+    syntree_list_push(&parser->syntree, parse_assign(parser));
+    return syntree_list_commit(&parser->syntree, AST_ASSIGN, assign);
 }
 
 /* Const expressions */
 
+internal ast_id add_constant(syntree_t* tree, const token_t* token) {
+    switch (token->tag) {
+        case TOKEN_T_INT:
+            return syntree_add_int(tree, token->value.signed_int);
+        case TOKEN_T_UINT:
+            return syntree_add_uint(tree, token->value.unsigned_int);
+        case TOKEN_T_INTL:
+            return syntree_add_long(tree, token->value.signed_long);
+        case TOKEN_T_UINTL:
+            return syntree_add_ulong(tree, token->value.unsigned_long);
+        case TOKEN_T_FLOAT32:
+            return syntree_add_f32(tree, token->value.float32);
+        case TOKEN_T_FLOAT64:
+            return syntree_add_f64(tree, token->value.float64);
+        case TOKEN_T_CHAR:
+            return syntree_add_char(tree, token->value.character);
+        case TOKEN_T_BOOL:
+            return syntree_add_bool(tree, token->value.boolean);
+        case TOKEN_T_STRING:
+            return syntree_add_string(tree, token->value.symbol);
+        default:
+            assert(!"Not a constant");
+            return AST_INVALID_ID;
+    }
+}
+
 internal ast_id parse_const_simple_operand(parser_t* parser) {
     if (parser->next.tag == TOKEN_T_INT ||
             parser->next.tag == TOKEN_T_UINT ||
@@ -600,161 +360,17 @@ internal ast_id parse_const_simple_operand(parser_t* parser) {
             parser->next.tag == TOKEN_T_CHAR ||
             parser->next.tag == TOKEN_T_BOOL ||
             parser->next.tag == TOKEN_T_STRING) {
+        ast_id constant = add_constant(&parser->syntree, &parser->next);
         next_token(parser);
-        return 1;
+        return constant;
     } else {
         syntax_error(parser, "constant");
         return AST_INVALID_ID;
     }
 }
 
-internal ast_id parse_const_prefix_expr(parser_t* parser) {
-    if (parser->next.tag != TOKEN_T_NOT &&
-            parser->next.tag != TOKEN_T_INC &&
-            parser->next.tag != TOKEN_T_DEC &&
-            parser->next.tag != '~') {
-        return AST_INVALID_ID;
-    }
-    next_token(parser);
-    print_indent(parser);
-    printf("const prefix_exp\n");
-    parser->debug_indent += 4;
-    print_indent(parser);
-    parse_const_expr(parser);
-    parser->debug_indent -= 4;
-    return 1;
-}
-
 internal ast_id parse_const_infix_expr(parser_t* parser) {
-    operand_stack_t operand_stack = operand_stack_init();
-    operator_stack_t operator_stack = operator_stack_init();
-
-    { /* parse first operand */
-        ast_id first_operand;
-        if (parser->next.tag == '!' ||
-                parser->next.tag == TOKEN_T_INC ||
-                parser->next.tag == TOKEN_T_DEC ||
-                parser->next.tag == '~') {
-            first_operand = parse_const_prefix_expr(parser);
-        } else {
-            first_operand = parse_const_simple_operand(parser);
-        }
-
-        if (parser->next.tag == TOKEN_T_INC ||
-                parser->next.tag == TOKEN_T_DEC) {
-            /* we have a postfix operator */
-            next_token(parser);
-        }
-
-        operand_t op = { .ast = first_operand };
-        operand_stack_push(&operand_stack, op);
-    }
-    if (!is_next_infix_op(parser)) {
-        /* done */
-        return 1;
-    }
-
-    while (true) {
-        // Looking from the last operand, we expect to see an infix operator
-        // and an operand, which is either an expression in braces,
-        // a normal operand or a prefix expression.
-        // This is optionally followed by a postfix operator.
-        if (!is_next_infix_op(parser))
-            break; // done
-
-        token_tag_t infix_tag = parser->next.tag;
-        ast_id infix_op = parse_infix_operator(parser);
-
-        ast_id operand = AST_INVALID_ID;
-        if (parser->next.tag == '(') {
-            next_token(parser);
-            parser->debug_indent += 4;
-            operand = parse_const_expr(parser);
-            parser->debug_indent -= 4;
-        } else if (parser->next.tag == '!' ||
-                parser->next.tag == '~' ||
-                parser->next.tag == TOKEN_T_INC ||
-                parser->next.tag == TOKEN_T_DEC) {
-            operand = parse_const_prefix_expr(parser);
-        } else {
-            operand = parse_const_simple_operand(parser);
-        }
-
-        if (!operand) {
-            operand_stack_release(&operand_stack);
-            operator_stack_release(&operator_stack);
-            syntax_error(parser, "operand");
-            return AST_INVALID_ID;
-        }
-
-        if (parser->next.tag == TOKEN_T_INC ||
-                parser->next.tag == TOKEN_T_DEC) {
-            /* postfix op */
-            next_token(parser);
-        }
-
-        int top_prec, new_prec;
-        top_prec = (operator_stack.top > -1) ?
-            operator_stack.stack[operator_stack.top].prec : -1;
-        new_prec = get_operator_precedence(infix_tag);
-        op_assoc_t assoc = get_operator_associativity(infix_tag);
-        while (new_prec <= top_prec) {
-            if ((new_prec == top_prec) && (assoc == RIGHT)) {
-                // evaluate from right to left, which is done below or in
-                // a later iteration
-                break;
-            }
-            operator_t top_op = operator_stack_pop(&operator_stack);
-            assert(operand_stack.top >= 1);
-            operand_t right = operand_stack_pop(&operand_stack);
-            operand_t left = operand_stack_pop(&operand_stack);
-            UNUSED(top_op);
-            UNUSED(right);
-            UNUSED(left);
-
-            /* We would evaluate the expression... */
-            operand_t result = { .ast = 42, .type = 0 };
-            operand_stack_push(&operand_stack, result);
-
-            top_prec = (operator_stack.top > -1) ?
-                operator_stack.stack[operator_stack.top].prec : -1;
-        }
-        operator_t new_op = {
-            .ast = infix_op,
-            .assoc = assoc,
-            .prec = new_prec
-        };
-        operand_t new_operand = { operand, 0 };
-        operator_stack_push(&operator_stack, new_op);
-        operand_stack_push(&operand_stack, new_operand);
-    }
-
-    while (operator_stack.top > -1) {
-        operator_t top_operator = operator_stack_pop(&operator_stack);
-        assert(operand_stack.top >= 1);
-
-        // NOTE(Kevin): Verify that these are in the right order
-        operand_t left = operand_stack_pop(&operand_stack);
-        operand_t right = operand_stack_pop(&operand_stack);
-
-        UNUSED(top_operator);
-        UNUSED(left);
-        UNUSED(right);
-
-        /* TODO: create new operand */
-        operand_t new_operand = { 42, 0 };
-        operand_stack_push(&operand_stack, new_operand);
-    }
-    assert(operand_stack.top == 0);
-    ast_id expr = operand_stack_pop(&operand_stack).ast;
-
-    print_indent(parser);
-    printf("const expr\n");
-
-    operator_stack_release(&operator_stack);
-    operand_stack_release(&operand_stack);
-    return expr;
-
+    return parse_operator_expr(parser, true);
 }
 
 ast_id parse_const_expr(parser_t* parser) {
@@ -768,17 +384,13 @@ ast_id parse_const_cast(parser_t* parser) {
     assert(parser->next.tag == TOKEN_T_KW_CAST);
     next_token(parser);
 
-    print_indent(parser);
-    printf("cast\n");
-
-    parser->debug_indent += 4;
     if (parser->next.tag != '<') {
         syntax_error(parser, "<");
         return AST_INVALID_ID;
     }
     next_token(parser);
 
-    parse_type(parser);
+    ast_id type = parse_type(parser);
     if (parser->next.tag != '>') {
         syntax_error(parser, ">");
         return AST_INVALID_ID;
@@ -791,7 +403,7 @@ ast_id parse_const_cast(parser_t* parser) {
     }
     next_token(parser);
 
-    parse_const_expr(parser);
+    ast_id expr = parse_const_expr(parser);
 
     if (parser->next.tag != ')') {
         syntax_error(parser, ")");
@@ -799,7 +411,6 @@ ast_id parse_const_cast(parser_t* parser) {
     }
     next_token(parser);
 
-    parser->debug_indent -= 4;
-    return AST_INVALID_ID;
+    return syntree_add_pair(&parser->syntree, AST_CAST, type, expr);
 
 }
@@ -0,0 +1,204 @@
+#include "parser.h"
+#include "lexer.h"
+#include "source.h"
+#include "thread.h"
+#include "scan.h"
+#include "stats.h"
+#include "trace.h"
+#include "fly.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* In parser.c */
+extern int init_parser_lexer(parser_t* parser, lexer_t* lexer);
+
+/* Slices smaller than this are not worth a hand-off */
+#define MIN_SLICE_SIZE (16 * 1024)
+/* Slices per thread, so that a thread that got the cheap slices can help
+ * with the rest */
+#define SLICES_PER_THREAD 8
+
+typedef struct {
+    u32 begin;
+    u32 end;
+    parser_t parser;
+    /* top-level entries, in the slice's own tree */
+    ast_id* items;
+    u32 num_items;
+    u32 item_capacity;
+    bool ok;
+    /* added to the file's statistics after the join */
+    stats_t stats;
+} slice_t;
+
+typedef struct {
+    file_id_t file;
+    slice_t* slices;
+    u32 num_slices;
+    u32 next_slice;
+    /* statistics of the file, NULL if there are none */
+    stats_t* stats;
+    mutex_t lock;
+} work_t;
+
+/* Sets the slice's syntree.out_of_memory if there is no room */
+internal bool add_item(slice_t* slice, ast_id item) {
+    if (slice->num_items == slice->item_capacity) {
+        u32 capacity = slice->item_capacity ? slice->item_capacity * 2 : 64;
+        ast_id* items = realloc(slice->items, capacity * sizeof(ast_id));
+        if (!items) {
+            slice->parser.syntree.out_of_memory = true;
+            return false;
+        }
+        slice->items = items;
+        slice->item_capacity = capacity;
+    }
+    slice->items[slice->num_items++] = item;
+    return true;
+}
+
+internal void parse_slice(file_id_t file, slice_t* slice) {
+    trace_begin("slice", SYMBOL_INVALID);
+    lexer_t lexer;
+    lexer_init_slice(&lexer, file, slice->begin, slice->end);
+    slice->ok = init_parser_lexer(&slice->parser, &lexer);
+    lexer_release(&lexer);
+    if (!slice->ok) {
+        trace_end();
+        return;
+    }
+
+    /* the same loop as parse_program, without the AST_PROGRAM entry */
+    stats_phase_t phase = stats_begin(STATS_PARSE);
+    parser_t* parser = &slice->parser;
+    while (parser->next.tag != TOKEN_T_EOF && !parser->diag.muted) {
+        ast_id item = parse_top_level(parser);
+        if (item && !add_item(slice, item))
+            break;
+    }
+    stats_end(phase);
+    trace_end();
+}
+
+internal int worker(void* arg) {
+    work_t* work = arg;
+    for (;;) {
+        mutex_lock(&work->lock);
+        u32 i = work->next_slice++;
+        mutex_unlock(&work->lock);
+        if (i >= work->num_slices)
+            break;
+        slice_t* slice = &work->slices[i];
+        stats_t* previous = work->stats ? stats_attach(&slice->stats) : NULL;
+        parse_slice(work->file, slice);
+        if (work->stats)
+            stats_attach(previous);
+    }
+    return 0;
+}
+
+ast_id parse_program_parallel(parser_t* parser, char* file, u32 num_threads) {
+    bool lazy_bodies = parser->lazy_bodies;
+    u32 max_errors = parser->max_errors;
+    memset(parser, 0, sizeof(*parser));
+    parser->lazy_bodies = lazy_bodies;
+    parser->max_errors = max_errors;
+    parser->diag.max_errors = max_errors;
+    file_id_t id = source_load_file(file);
+    if (id == INVALID_FILE_ID)
+        return AST_INVALID_ID;
+    parser->file = id;
+    if (num_threads == 0)
+        num_threads = 1;
+
+    /* slices do not depend on anything but the thread count, and the
+     * merge below does not depend on them at all */
+    u32 size = (u32)source_get_file(id)->size;
+    u32 min_size = size / (num_threads * SLICES_PER_THREAD);
+    if (min_size < MIN_SLICE_SIZE)
+        min_size = MIN_SLICE_SIZE;
+    u32 max_slices = num_threads * SLICES_PER_THREAD;
+    u32* ends = malloc(max_slices * sizeof(u32));
+    slice_t* slices = calloc(max_slices, sizeof(slice_t));
+    if (!ends || !slices) {
+        free(ends);
+        free(slices);
+        parser->syntree.out_of_memory = true;
+        return AST_INVALID_ID;
+    }
+    u32 num_slices = lexer_split(id, min_size, ends, max_slices);
+    for (u32 i = 0; i < num_slices; i++) {
+        slices[i].begin = (i > 0) ? ends[i - 1] : 0;
+        slices[i].end = ends[i];
+        slices[i].parser.lazy_bodies = lazy_bodies;
+        slices[i].parser.max_errors = max_errors;
+    }
+    free(ends);
+
+    work_t work = {
+        .file = id,
+        .slices = slices,
+        .num_slices = num_slices,
+        .next_slice = 0,
+        .stats = stats_target(),
+    };
+    mutex_init(&work.lock);
+
+    if (num_threads > num_slices)
+        num_threads = num_slices;
+    scan_init();
+    /* the calling thread is one of the workers */
+    thread_t* threads = calloc(num_threads, sizeof(thread_t));
+    /* without room for the handles, the calling thread does it all */
+    u32 started = 0;
+    for (u32 i = 1; threads && i < num_threads; i++) {
+        if (!thread_create(&threads[i], worker, &work))
+            break;
+        started++;
+    }
+    worker(&work);
+    for (u32 i = 1; i <= started; i++)
+        thread_join(&threads[i]);
+    free(threads);
+    mutex_destroy(&work.lock);
+
+    /* merge in file order. The slice trees hold their entries in the
+     * order parse_program would have added them, so appending them one
+     * after the other gives the same ids. */
+    stats_phase_t phase = stats_begin(STATS_MERGE);
+    trace_begin("merge", SYMBOL_INVALID);
+    size_t hint = 0;
+    for (u32 i = 0; i < num_slices; i++)
+        hint += slices[i].parser.syntree.num_entries;
+    bool ok = init_syntree(&parser->syntree, hint + 1);
+    u32 program = syntree_list_begin(&parser->syntree);
+    for (u32 i = 0; i < num_slices; i++) {
+        slice_t* slice = &slices[i];
+        if (slice->parser.syntree.out_of_memory)
+            parser->syntree.out_of_memory = true;
+        if (ok && slice->ok && !parser->syntree.out_of_memory) {
+            ast_id base = syntree_merge(&parser->syntree,
+                                        &slice->parser.syntree);
+            for (u32 j = 0; j < slice->num_items; j++)
+                syntree_list_push(&parser->syntree, slice->items[j] + base);
+            diag_append(&parser->diag, &slice->parser.diag);
+        } else {
+            ok = false;
+        }
+        if (work.stats)
+            stats_merge(work.stats, &slice->stats);
+        if (slice->ok)
+            release_parser(&slice->parser);
+        free(slice->items);
+    }
+    free(slices);
+    if (parser->syntree.out_of_memory)
+        ok = false;
+    ast_id result = ok ? syntree_list_commit(&parser->syntree, AST_PROGRAM,
+                                             program)
+                       : AST_INVALID_ID;
+    trace_end();
+    stats_end(phase);
+    return result;
+}
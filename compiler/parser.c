@@ -1,6 +1,11 @@
 #include "parser.h"
 #include "fly.h"
+#include "source.h"
+#include "stats.h"
+#include "trace.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 /* NOTE(Kevin): Some functions do something like
@@ -20,84 +25,268 @@
  * an assertion
  */
 
-internal void print_line_marker(const char* file,
-        int line, int start_column, int end_column) {
-    FILE* f = fopen(file, "r");
-    if (!f)
+void syntax_error(parser_t* parser, const char* expected) {
+    /* whatever goes wrong until we synchronize is most likely a
+     * consequence of this error */
+    if (parser->panic)
         return;
-    for (int i = 1; i < line; i++) {
-        while (fgetc(f) != '\n') {} // skip to next line
-    }
-    char c;
-    while ((c = (char)fgetc(f)) != '\n') {
-        printf("%c", c);
+    parser->panic = true;
+    /* the input did not end, memory did */
+    if (parser->syntree.out_of_memory)
+        return;
+    expanded_location_t loc = expand_location(parser->next.loc);
+    diag_error(&parser->diag, "Syntax error. Expected %s at: %s %d:%d\n",
+            expected,
+            loc.file,
+            loc.start_line,
+            loc.start_column
+          );
+    diag_source_marker(&parser->diag, parser->next.loc);
+}
+
+/* Makes sure that the token at index is lexed, if there is one. Lexes
+ * no further: whatever is lexed after the start of a skipped function
+ * body is wasted. */
+internal void fill_tokens(parser_t* parser, u32 index) {
+    token_buffer_t* tokens = &parser->tokens;
+    while (index >= tokens->num_tokens &&
+            tokens->tags[tokens->num_tokens - 1] != TOKEN_T_EOF) {
+        if (!lexer_tokenize_some(&parser->lexer, tokens,
+                                 index + 1 - tokens->num_tokens)) {
+            parser->syntree.out_of_memory = true;
+            return;
+        }
     }
-    printf("\n");
-    for (int i = 1; i < start_column; i++)
-        printf(" ");
-    for (int i = start_column; i < end_column; i++)
-        printf("^");
-    fclose(f);
-    printf("\n");
 }
 
-void syntax_error(parser_t* parser, const char* expected) {
-    printf("Syntax error. Expected %s at: %s %d:%d\n",
-            expected,
-            parser->next.loc.file,
-            parser->next.loc.start_line,
-            parser->next.loc.start_column
-          );
+/* Once memory has run out, every token is TOKEN_T_EOF, so that the
+ * parser winds down the way it does at the end of the file. */
+void next_token(parser_t* parser) {
+    parser->position++;
+    if (parser->streaming && parser->position >= parser->tokens.num_tokens)
+        fill_tokens(parser, parser->position);
+    parser->next = token_buffer_get(&parser->tokens, parser->position);
+    if (parser->syntree.out_of_memory)
+        parser->next.tag = TOKEN_T_EOF;
+}
+
+/* Tag of the token k positions after parser->next.
+ * peek(parser, 0) == parser->next.tag */
+token_tag_t peek(parser_t* parser, u32 k) {
+    if (parser->streaming && parser->position + k >= parser->tokens.num_tokens)
+        fill_tokens(parser, parser->position + k);
+    if (parser->syntree.out_of_memory)
+        return TOKEN_T_EOF;
+    return token_buffer_tag(&parser->tokens, parser->position + k);
+}
 
-    if ((parser->next.loc.start_line == parser->next.loc.end_line) &&
-            (parser->next.loc.start_column <= parser->next.loc.end_column)) {
+/* Sets the parser up to read the tokens of lexer: all of them right away,
+ * or on demand if function bodies are skipped. The file is loaded
+ * already, so this fails only if memory runs out. */
+internal int begin_tokens(parser_t* parser, lexer_t* lexer) {
+    parser->file = lexer->file;
+    lexer->diag = &parser->diag;
+    parser->streaming = parser->lazy_bodies;
+    if (parser->streaming) {
+        parser->lexer = *lexer;
+        memset(&parser->tokens, 0, sizeof(parser->tokens));
+        if (!lexer_tokenize_some(&parser->lexer, &parser->tokens, 1)) {
+            token_buffer_release(&parser->tokens);
+            parser->syntree.out_of_memory = true;
+            return 0;
+        }
+    } else if (!lexer_tokenize(lexer, &parser->tokens)) {
+        parser->syntree.out_of_memory = true;
+        return 0;
     }
+    parser->position = 0;
+    parser->next = token_buffer_get(&parser->tokens, 0);
+    return 1;
 }
 
-void print_indent(parser_t* parser) {
-    for (int i = 0; i < parser->debug_indent; i++)
-        printf(" ");
+/* Parses what the lexer has left. Used by parse_parallel.c for the
+ * slices of a file. */
+int init_parser_lexer(parser_t* parser, lexer_t* lexer) {
+    size_t bytes = (size_t)(lexer->limit - lexer->cursor);
+    memset(&parser->diag, 0, sizeof(parser->diag));
+    parser->diag.max_errors = parser->max_errors;
+    parser->panic = false;
+    memset(&parser->expr, 0, sizeof(parser->expr));
+    /* about one syntax tree entry for every three tokens, and a token
+     * every six bytes. The tree is set up first, so that it tells
+     * whether lexing ran out of memory. */
+    if (!init_syntree(&parser->syntree, bytes / 18))
+        return 0;
+    if (!begin_tokens(parser, lexer)) {
+        release_syntree(&parser->syntree);
+        parser->syntree.out_of_memory = true;
+        diag_release(&parser->diag);
+        return 0;
+    }
+    return 1;
 }
 
-void next_token(parser_t* parser) {
-    parser->next = lexer_get_next(&parser->lexer);
+/* Parses what the lexer has left into the tree the parser already has,
+ * instead of the tokens it had. Used by document.c to parse single
+ * declarations of an edited file. */
+int continue_parser_lexer(parser_t* parser, lexer_t* lexer) {
+    token_buffer_release(&parser->tokens);
+    parser->panic = false;
+    return begin_tokens(parser, lexer);
 }
 
 int init_parser(parser_t* parser, char* file) {
-    if (!lexer_init(&parser->lexer, file))
+    /* if the file cannot be read, out_of_memory stays false */
+    memset(&parser->syntree, 0, sizeof(parser->syntree));
+    lexer_t lexer;
+    if (!lexer_init(&lexer, file))
         return 0;
-    if (!init_syntree(&parser->syntree))
+    int ok = init_parser_lexer(parser, &lexer);
+    lexer_release(&lexer);
+    return ok;
+}
+
+int init_parser_buffer(parser_t* parser, const char* name, const char* data,
+                       size_t length) {
+    file_id_t id = source_add_buffer(name, data, length);
+    if (id == INVALID_FILE_ID)
         return 0;
-    next_token(parser);
-    parser->debug_indent = 0;
-    return 1;
+    lexer_t lexer;
+    lexer_init_slice(&lexer, id, 0, (u32)length);
+    int ok = init_parser_lexer(parser, &lexer);
+    lexer_release(&lexer);
+    if (!ok)
+        source_release_file(id);
+    return ok;
+}
+
+void parser_take_syntree(parser_t* parser, syntree_t* tree) {
+    *tree = parser->syntree;
+    memset(&parser->syntree, 0, sizeof(parser->syntree));
 }
 
 void release_parser(parser_t* parser) {
-    lexer_release(&parser->lexer);
+    token_buffer_release(&parser->tokens);
     release_syntree(&parser->syntree);
+    free(parser->expr.operators);
+    free(parser->expr.operands);
+    diag_release(&parser->diag);
 }
 
-ast_id parse_program(parser_t* parser) {
-    ast_id program = syntree_add_list(&parser->syntree, AST_PROGRAM, 0);
-    do {
-        parser->debug_indent = 4;
-        ast_id elem = 0;
-        if (parser->next.tag == TOKEN_T_KW_LET ||
-                parser->next.tag == TOKEN_T_KW_TYPE ||
-                parser->next.tag == TOKEN_T_KW_FUNC ||
-                parser->next.tag == TOKEN_T_KW_EXTERN)
-            elem = parse_declaration(parser);
-        else if (parser->next.tag == '#')
-            parse_meta_instruction(parser);
-        else
-            syntax_error(parser, "Declaration or meta instruction");
+/* True once more errors than max_errors were reported */
+internal bool too_many_errors(parser_t* parser) {
+    return parser->diag.muted;
+}
 
+internal bool starts_declaration(token_tag_t tag) {
+    return tag == TOKEN_T_KW_LET || tag == TOKEN_T_KW_TYPE ||
+           tag == TOKEN_T_KW_FUNC || tag == TOKEN_T_KW_EXTERN;
+}
+
+/* Panic mode recovery: skips tokens to a point at which parsing can go
+ * on after a syntax error. Braces are matched on the way, so a block
+ * with errors is skipped as a whole.
+ * At file scope that is the next declaration or meta instruction, in a
+ * block the token after the next ';' (which may be the one just
+ * consumed) or after a nested block, the next declaration, or the '}'
+ * that closes the block. start is the position
+ * at which the failed construct began; if nothing was consumed since, at
+ * least one token is, so the parser cannot get stuck. */
+internal void synchronize(parser_t* parser, u32 start, bool in_block) {
+    if (parser->position == start) {
+        if (parser->next.tag != TOKEN_T_EOF &&
+                !(in_block && parser->next.tag == '}'))
+            next_token(parser);
+    } else if (in_block &&
+               token_buffer_tag(&parser->tokens, parser->position - 1) == ';') {
+        /* the statement ended in spite of the error */
+        parser->panic = false;
+        return;
+    }
+    u32 depth = 0;
+    for (;;) {
+        token_tag_t tag = parser->next.tag;
+        if (tag == TOKEN_T_EOF)
+            break;
+        if (depth == 0) {
+            if (starts_declaration(tag))
+                break;
+            if (!in_block && tag == '#')
+                break;
+            if (in_block && tag == '}')
+                break;
+        }
+        next_token(parser);
+        if (tag == '{') {
+            depth++;
+        } else if (tag == '}') {
+            /* a '}' without a '{' at file scope is simply skipped */
+            if (depth > 0 && --depth == 0 && in_block)
+                break;
+        } else if (tag == ';' && depth == 0 && in_block) {
+            break;
+        }
+    }
+    parser->panic = false;
+}
+
+/* Begins the trace span of the top-level entry at parser->next, named
+ * after its keyword and identifier */
+internal void trace_top_level(parser_t* parser) {
+    const char* kind = "?";
+    u32 k = 1;
+    switch (parser->next.tag) {
+        case TOKEN_T_KW_LET: kind = "let"; break;
+        case TOKEN_T_KW_TYPE: kind = "type"; break;
+        case TOKEN_T_KW_FUNC: kind = "fn"; break;
+        case TOKEN_T_KW_EXTERN: kind = "extern fn"; k = 2; break;
+        case '#': kind = "#load"; k = 2; break;
+        default: break;
+    }
+    symbol_t name = SYMBOL_INVALID;
+    if (peek(parser, k) == TOKEN_T_ID)
+        name = token_buffer_get(&parser->tokens,
+                                parser->position + k).value.symbol;
+    trace_begin(kind, name);
+}
+
+/* A declaration or meta instruction at file scope */
+ast_id parse_top_level(parser_t* parser) {
+    if (trace_enabled)
+        trace_top_level(parser);
+    u32 start = parser->position;
+    ast_id result = AST_INVALID_ID;
+    if (starts_declaration(parser->next.tag))
+        result = parse_declaration(parser);
+    else if (parser->next.tag == '#')
+        result = parse_meta_instruction(parser);
+    else
+        syntax_error(parser, "Declaration or meta instruction");
+    if (parser->panic) {
+        result = AST_INVALID_ID;
+        synchronize(parser, start, false);
+    }
+    trace_end();
+    return result;
+}
+
+ast_id parse_program(parser_t* parser) {
+    stats_phase_t phase = stats_begin(STATS_PARSE);
+    trace_begin("parse", SYMBOL_INVALID);
+    u32 program = syntree_list_begin(&parser->syntree);
+    while (parser->next.tag != TOKEN_T_EOF && !too_many_errors(parser)) {
+        ast_id elem = parse_top_level(parser);
         if (elem)
-            syntree_append_list(&parser->syntree, program, elem);
-    } while (parser->next.tag != TOKEN_T_EOF);
+            syntree_list_push(&parser->syntree, elem);
+    }
 
-    return program;
+    ast_id result = syntree_list_commit(&parser->syntree, AST_PROGRAM,
+                                        program);
+    if (parser->syntree.out_of_memory)
+        result = AST_INVALID_ID;
+    trace_end();
+    stats_end(phase);
+    return result;
 }
 
 
@@ -106,9 +295,7 @@ ast_id parse_id(parser_t* parser) {
         syntax_error(parser, "identifier");
         return AST_INVALID_ID;
     }
-    print_indent(parser);
-    printf("%s\n", parser->next.value.string);
-    ast_id id = syntree_add_id(&parser->syntree, parser->next.value.string);
+    ast_id id = syntree_add_id(&parser->syntree, parser->next.value.symbol);
     next_token(parser);
 
     return id; 
@@ -118,16 +305,16 @@ ast_id parse_meta_instruction(parser_t* parser) {
     assert(parser->next.tag == '#');
     next_token(parser);
 
-    print_indent(parser);
-    printf("meta\n");
-
-    parser->debug_indent += 4;
-    parse_id(parser);
-
-    parse_id(parser);
-    parser->debug_indent -= 4;
+    /* #load is the only meta instruction so far */
+    if (parser->next.tag != TOKEN_T_ID ||
+            strcmp(symbol_string(parser->next.value.symbol), "load") != 0) {
+        syntax_error(parser, "'load'");
+        return AST_INVALID_ID;
+    }
+    next_token(parser);
 
-    return 1; 
+    ast_id module = parse_id(parser);
+    return syntree_add_tag(&parser->syntree, AST_META_LOAD, module);
 }
 
 ast_id parse_declaration(parser_t* parser) {
@@ -161,10 +348,6 @@ ast_id parse_func_declaration(parser_t* parser) {
     assert(parser->next.tag == TOKEN_T_KW_FUNC);
     next_token(parser);
 
-    print_indent(parser);
-    printf("fn\n");
-
-    parser->debug_indent += 4;
     ast_id id = parse_id(parser);
 
     if (parser->next.tag != TOKEN_T_FUNC_DECL) {
@@ -175,9 +358,6 @@ ast_id parse_func_declaration(parser_t* parser) {
 
     ast_id fnc = parse_function(parser);
 
-    parser->debug_indent -= 4;
-
-
     return syntree_add_pair(&parser->syntree, AST_FUNC_DECL, id, fnc);
 }
 
@@ -191,18 +371,22 @@ ast_id parse_extern_func_declaration(parser_t* parser) {
     }
     next_token(parser);
 
-    print_indent(parser);
-    printf("extern fn\n");
-
-    parser->debug_indent += 4;
     ast_id id = parse_id(parser);
+    if (!id)
+        return AST_INVALID_ID;
 
+    if (parser->next.tag != TOKEN_T_FUNC_DECL) {
+        syntax_error(parser, "'::'");
+        return AST_INVALID_ID;
+    }
     next_token(parser);
 
+    if (parser->next.tag != '(') {
+        syntax_error(parser, "'('");
+        return AST_INVALID_ID;
+    }
     ast_id fn = parse_func_type(parser);
 
-    parser->debug_indent -= 4;
-
     return syntree_add_pair(&parser->syntree, AST_EXT_FUNC_DECL, id, fn);
 }
 
@@ -210,20 +394,15 @@ ast_id parse_variable_declaration(parser_t* parser) {
     assert(parser->next.tag == TOKEN_T_KW_LET);
     next_token(parser);
 
-    print_indent(parser);
-    printf("let\n");
-
-    parser->debug_indent += 4;
     ast_id id = parse_id(parser);
-    ast_id type, value;
+    ast_id type = AST_INVALID_ID, value = AST_INVALID_ID;
 
     switch (parser->next.tag) {
         case ':':
             next_token(parser);
             if (parser->next.tag == TOKEN_T_KW_AUTO) {
-                print_indent(parser);
-                printf("auto\n");
-                type = AST_INVALID_ID;
+                type = syntree_add_auto(&parser->syntree);
+                next_token(parser);
             }
             else {
                 type = parse_type(parser);
@@ -235,7 +414,6 @@ ast_id parse_variable_declaration(parser_t* parser) {
             break;
         case TOKEN_T_DECL_ASSIGN:
             next_token(parser);
-            type = AST_INVALID_ID;
             value = parse_expr(parser);
             break;
         default:
@@ -243,7 +421,6 @@ ast_id parse_variable_declaration(parser_t* parser) {
             return AST_INVALID_ID;
     }
 
-    parser->debug_indent -= 4;
     return syntree_add_list(&parser->syntree, AST_VAR_DECL,
                             3, id, type, value );
 }
@@ -252,10 +429,6 @@ ast_id parse_type_declaration(parser_t* parser) {
     assert(parser->next.tag == TOKEN_T_KW_TYPE);
     next_token(parser);
 
-    print_indent(parser);
-    printf("type\n");
-
-    parser->debug_indent += 4;
     ast_id id = parse_id(parser);
 
     if (parser->next.tag != '=') {
@@ -264,13 +437,68 @@ ast_id parse_type_declaration(parser_t* parser) {
     }
     next_token(parser);
 
+    ast_id annotation = AST_INVALID_ID;
     if (parser->next.tag == '#') {
-        parse_annotation(parser);
+        annotation = parse_annotation(parser);
     }
     ast_id type = parse_type(parser);
 
-    parser->debug_indent -= 4;
-    return syntree_add_pair(&parser->syntree, AST_TYPE_DECL, id, type);
+    return syntree_add_list(&parser->syntree, AST_TYPE_DECL,
+                            3, id, annotation, type);
+}
+
+/* Skips a block without parsing it and returns an AST_LAZY_BLOCK with
+ * its byte range. Only braces are matched, everything else is left to
+ * parse_lazy_body. */
+internal ast_id skip_block(parser_t* parser) {
+    if (parser->next.tag != '[' &&
+            parser->next.tag != '{') {
+        syntax_error(parser, "'[' or '{'");
+        return AST_INVALID_ID;
+    }
+    u32 begin = parser->next.loc.offset;
+    if (parser->next.tag == '[') {
+        /* the capture list holds nothing but identifiers */
+        while (parser->next.tag != ']' && parser->next.tag != TOKEN_T_EOF)
+            next_token(parser);
+        next_token(parser);
+    }
+    if (parser->next.tag != '{') {
+        syntax_error(parser, "{");
+        return AST_INVALID_ID;
+    }
+
+    u32 end;
+    bool closed;
+    if (parser->streaming) {
+        /* drop the tokens lexed after the '{' and let the lexer jump */
+        closed = lexer_skip_block(&parser->lexer, parser->next.loc.offset,
+                                  &end);
+        parser->tokens.num_tokens = parser->position;
+        fill_tokens(parser, parser->position);
+        parser->next = token_buffer_get(&parser->tokens, parser->position);
+    } else {
+        const u16* tags = parser->tokens.tags;
+        u32 i = parser->position;
+        u32 depth = 0;
+        for (; tags[i] != TOKEN_T_EOF; i++) {
+            if (tags[i] == '{')
+                depth++;
+            else if (tags[i] == '}' && --depth == 0)
+                break;
+        }
+        parser->position = i;
+        parser->next = token_buffer_get(&parser->tokens, i);
+        closed = parser->next.tag == '}';
+        end = parser->next.loc.offset + parser->next.loc.length;
+        if (closed)
+            next_token(parser);
+    }
+    if (!closed) {
+        syntax_error(parser, "'}'");
+        return AST_INVALID_ID;
+    }
+    return syntree_add_lazy_block(&parser->syntree, begin, end);
 }
 
 ast_id parse_function(parser_t* parser) {
@@ -280,30 +508,30 @@ ast_id parse_function(parser_t* parser) {
     }
     next_token(parser);
 
-    print_indent(parser);
-    printf("function\n");
-
-    parser->debug_indent += 4;
-
     ast_id params = AST_INVALID_ID;
     if (parser->next.tag == TOKEN_T_ID ||
             parser->next.tag == TOKEN_T_ELLIPSIS) {
         params = parse_func_params(parser);
+    } else if (parser->next.tag == ')') {
+        next_token(parser);
     }
 
     ast_id ret_type, body;
     switch (parser->next.tag) {
         case TOKEN_T_ARROW:
             next_token(parser);
-            ret_type = syntree_add_list(&parser->syntree, AST_RET_TYPE,
-                    1, parse_type(parser));
+            u32 ret_types = syntree_list_begin(&parser->syntree);
+            syntree_list_push(&parser->syntree, parse_type(parser));
             while (parser->next.tag == ',') {
                 next_token(parser);
                 ast_id tmp = parse_type(parser);
                 if (tmp)
-                    syntree_append_list(&parser->syntree, ret_type, tmp);
+                    syntree_list_push(&parser->syntree, tmp);
             }
-            body = parse_block(parser);
+            ret_type = syntree_list_commit(&parser->syntree, AST_RET_TYPE,
+                                           ret_types);
+            body = parser->lazy_bodies ? skip_block(parser)
+                                       : parse_block(parser);
             break;
         case TOKEN_T_BIG_ARROW:
             ret_type = AST_INVALID_ID;
@@ -320,19 +548,17 @@ ast_id parse_function(parser_t* parser) {
 
 ast_id parse_func_params(parser_t* parser) {
     /* ID ':' TYPE ( ',' ID ':' TYPE )* ['...']
-     * | '...'
+     * | '...'
      */
     assert(parser->next.tag == TOKEN_T_ID ||
             parser->next.tag == TOKEN_T_ELLIPSIS);
-    print_indent(parser);
-    printf("func params\n");
-    parser->debug_indent += 4;
-    ast_id params = syntree_add_list(&parser->syntree, AST_FUNC_PARAMS, 0);
-                                    
+    u32 params = syntree_list_begin(&parser->syntree);
+
     while (parser->next.tag == TOKEN_T_ID) {
         ast_id id = parse_id(parser);
         if (parser->next.tag != ':') {
             syntax_error(parser, ":");
+            syntree_list_discard(&parser->syntree, params);
             return AST_INVALID_ID;
         }
         next_token(parser);
@@ -340,32 +566,33 @@ ast_id parse_func_params(parser_t* parser) {
         if (parser->next.tag != ',' &&
                 parser->next.tag != ')') {
             syntax_error(parser, "',', ')' or '...'");
+            syntree_list_discard(&parser->syntree, params);
             return AST_INVALID_ID;
         }
         ast_id param = syntree_add_pair(&parser->syntree, AST_FUNC_PARAM,
                                         id, type);
-        syntree_append_list(&parser->syntree, params, param);
+        syntree_list_push(&parser->syntree, param);
         next_token(parser);
     }
     if (parser->next.tag == TOKEN_T_ELLIPSIS) {
-        print_indent(parser);
-        printf("...\n");
         ast_id elp = syntree_add_ellipsis(&parser->syntree);
-        syntree_append_list(&parser->syntree, params, elp); 
+        syntree_list_push(&parser->syntree, elp);
+        next_token(parser);
+        if (parser->next.tag != ')') {
+            syntax_error(parser, ")");
+            syntree_list_discard(&parser->syntree, params);
+            return AST_INVALID_ID;
+        }
+        next_token(parser);
     }
-    parser->debug_indent -= 4;
 
-    return params;
+    return syntree_list_commit(&parser->syntree, AST_FUNC_PARAMS, params);
 }
 
 ast_id parse_annotation(parser_t* parser) {
     assert(parser->next.tag == '#');
     next_token(parser);
-    print_indent(parser);
-    printf("annotation\n");
-    parser->debug_indent += 4;
     ast_id tag = parse_id(parser);
-    parser->debug_indent -= 4;
     return syntree_add_tag(&parser->syntree, AST_ANNOTATION, tag);
 }
 
@@ -376,177 +603,231 @@ ast_id parse_block(parser_t* parser) {
         return AST_INVALID_ID;
     }
 
-    print_indent(parser);
-    printf("block\n");
-
-    parser->debug_indent += 4;
-
+    /* the capture list, if any, is the first child */
+    u32 block = syntree_list_begin(&parser->syntree);
     if (parser->next.tag == '[')
-        parse_capture(parser);
+        syntree_list_push(&parser->syntree, parse_capture(parser));
 
     if (parser->next.tag != '{') {
         syntax_error(parser, "{");
+        syntree_list_discard(&parser->syntree, block);
         return AST_INVALID_ID;
     }
     next_token(parser);
 
     while (parser->next.tag != '}') {
-        if (parser->next.tag == TOKEN_T_KW_LET ||
-                parser->next.tag == TOKEN_T_KW_FUNC ||
-                parser->next.tag == TOKEN_T_KW_EXTERN ||
-                parser->next.tag == TOKEN_T_KW_TYPE) {
-            parse_declaration(parser);
+        if (parser->next.tag == TOKEN_T_EOF || too_many_errors(parser)) {
+            syntax_error(parser, "'}'");
+            syntree_list_discard(&parser->syntree, block);
+            return AST_INVALID_ID;
+        }
+        u32 start = parser->position;
+        ast_id elem;
+        if (starts_declaration(parser->next.tag)) {
+            elem = parse_declaration(parser);
         } 
         else {
-            parse_statement(parser);
+            elem = parse_statement(parser);
         }
+        if (parser->panic)
+            synchronize(parser, start, true);
+        else if (elem)
+            syntree_list_push(&parser->syntree, elem);
     }
 
-    parser->debug_indent -= 4;
     next_token(parser);
 
-    return 1;
+    return syntree_list_commit(&parser->syntree, AST_BLOCK, block);
+}
+
+ast_id parse_lazy_body(parser_t* parser, ast_id body) {
+    synentry_t entry = syntree_get_entry(&parser->syntree, body);
+    if (entry.tag != AST_LAZY_BLOCK)
+        return body;
+    u32 begin = (u32)entry.value.unsigned_long;
+    u32 end = (u32)(entry.value.unsigned_long >> 32);
+    stats_phase_t phase = stats_begin(STATS_PARSE);
+
+    /* lex just the block, and parse it with the rest of the parser state
+     * (tree, expression stacks) as it is */
+    token_buffer_t tokens = parser->tokens;
+    u32 position = parser->position;
+    token_t next = parser->next;
+    bool streaming = parser->streaming;
+    lexer_t outer = parser->lexer;
+
+    lexer_t lexer;
+    lexer_init_slice(&lexer, parser->file, begin, end);
+    int ok = begin_tokens(parser, &lexer);
+    lexer_release(&lexer);
+    ast_id block = AST_INVALID_ID;
+    if (ok) {
+        block = parse_block(parser);
+        if (block && parser->next.tag != TOKEN_T_EOF) {
+            syntax_error(parser, "end of block");
+            block = AST_INVALID_ID;
+        }
+        token_buffer_release(&parser->tokens);
+    }
+    /* a block cut short by the memory is not put in */
+    if (parser->syntree.out_of_memory)
+        block = AST_INVALID_ID;
+
+    parser->tokens = tokens;
+    parser->position = position;
+    parser->next = next;
+    parser->streaming = streaming;
+    parser->lexer = outer;
+    /* the bodies are independent of each other */
+    parser->panic = false;
+    if (block)
+        syntree_replace(&parser->syntree, body, block);
+    stats_end(phase);
+    return block ? body : AST_INVALID_ID;
+}
+
+bool parse_all_lazy_bodies(parser_t* parser) {
+    /* parse nested function bodies right away, so one pass is enough */
+    bool lazy_bodies = parser->lazy_bodies;
+    parser->lazy_bodies = false;
+    trace_begin("lazy bodies", SYMBOL_INVALID);
+    u32 count;
+    const ast_id* lazy = syntree_get_tagged(&parser->syntree,
+                                            AST_LAZY_BLOCK, &count);
+    /* the index stays valid until the next syntree_get_tagged */
+    u32 errors = parser->diag.num_errors;
+    for (u32 i = 0; i < count && !too_many_errors(parser) &&
+            !parser->syntree.out_of_memory; i++)
+        parse_lazy_body(parser, lazy[i]);
+    trace_end();
+    parser->lazy_bodies = lazy_bodies;
+    return parser->diag.num_errors == errors &&
+           !parser->syntree.out_of_memory;
 }
 
 ast_id parse_capture(parser_t* parser) {
     assert(parser->next.tag == '[');
     next_token(parser);
 
-    print_indent(parser);
-    printf("capture");
-
-    parser->debug_indent += 4;
-
+    u32 capture = syntree_list_begin(&parser->syntree);
     while (parser->next.tag != ']') {
-        parse_id(parser);
+        syntree_list_push(&parser->syntree, parse_id(parser));
         if (parser->next.tag != ',' && parser->next.tag != ']') {
             syntax_error(parser, "',' or ']'");
+            syntree_list_discard(&parser->syntree, capture);
             return AST_INVALID_ID;
         }
+        if (parser->next.tag == ',')
+            next_token(parser);
     }
+    next_token(parser);
 
-    parser->debug_indent -= 4;
-
-    return 1;
+    return syntree_list_commit(&parser->syntree, AST_CAPTURE, capture);
 }
 
 ast_id parse_statement(parser_t* parser) {
-    parser->debug_indent += 4;
     switch (parser->next.tag) {
         case TOKEN_T_KW_IF:
-            parse_if_stmt(parser);
-            break;
+            return parse_if_stmt(parser);
         case TOKEN_T_KW_FOR:
-            parse_for_stmt(parser);
-            break;
+            return parse_for_stmt(parser);
         case TOKEN_T_KW_WHILE:
-            parse_while_stmt(parser);
-            break;
+            return parse_while_stmt(parser);
         case TOKEN_T_KW_DO:
-            parse_do_while_stmt(parser);
-            break;
-        case TOKEN_T_KW_DEFER:
+            return parse_do_while_stmt(parser);
+        case TOKEN_T_KW_DEFER: {
             next_token(parser);
-            printf("defer\n");
-            parse_statement(parser);
-            break;
+            ast_id stmt = parse_statement(parser);
+            return syntree_add_tag(&parser->syntree, AST_DEFER, stmt);
+        }
         case TOKEN_T_KW_SWITCH:
-            parse_switch_stmt(parser);
-            break;
-        case TOKEN_T_KW_RETURN:
+            return parse_switch_stmt(parser);
+        case TOKEN_T_KW_RETURN: {
             next_token(parser);
-            print_indent(parser);
-            printf("return\n");
-            parser->debug_indent += 4;
-            parse_expr(parser);
-            parser->debug_indent -= 4;
+            ast_id expr = parse_expr(parser);
             if (parser->next.tag != ';') {
                 syntax_error(parser, ";");
                 return AST_INVALID_ID;
             }
             next_token(parser);
-            break;
-        case ';':
-            printf("Warning: Stray ';' at %s %d:%d\n",
-                    parser->next.loc.file,
-                    parser->next.loc.start_line,
-                    parser->next.loc.start_column);
-            if (parser->next.loc.start_line == parser->next.loc.end_line) {
-                print_line_marker(parser->next.loc.file,
-                        parser->next.loc.start_line,
-                        parser->next.loc.start_column,
-                        parser->next.loc.end_column);
-            }
+            return syntree_add_tag(&parser->syntree, AST_RETURN, expr);
+        }
+        case ';': {
+            expanded_location_t loc = expand_location(parser->next.loc);
+            diag_warning(&parser->diag, "Warning: Stray ';' at %s %d:%d\n",
+                    loc.file,
+                    loc.start_line,
+                    loc.start_column);
+            diag_source_marker(&parser->diag, parser->next.loc);
             next_token(parser);
-            break;
-        default:
-            parse_assign(parser);
+            return AST_INVALID_ID;
+        }
+        default: {
+            ast_id stmt = parse_assign(parser);
             if (parser->next.tag != ';') {
                 syntax_error(parser, ";");
                 return AST_INVALID_ID;
             }
             next_token(parser);
-            break;
+            return stmt;
+        }
     }
-    parser->debug_indent -= 4;
-    return 1;
 }
 
 ast_id parse_if_stmt(parser_t* parser) {
+    /* cond, block, else if pairs..., else */
     assert(parser->next.tag == TOKEN_T_KW_IF);
     next_token(parser);
-    print_indent(parser);
-    printf("if\n");
-    parser->debug_indent += 4;
 
-    parse_expr(parser);
-    parse_block(parser);
+    u32 stmt = syntree_list_begin(&parser->syntree);
+    syntree_list_push(&parser->syntree, parse_expr(parser));
+    syntree_list_push(&parser->syntree, parse_block(parser));
 
     while (parser->next.tag == TOKEN_T_KW_ELSE) {
         next_token(parser);
         if (parser->next.tag == TOKEN_T_KW_IF) {
             next_token(parser);
-            parse_expr(parser);
-            parse_block(parser);
+            ast_id cond = parse_expr(parser);
+            ast_id block = parse_block(parser);
+            syntree_list_push(&parser->syntree,
+                    syntree_add_pair(&parser->syntree, AST_ELSE_IF,
+                                     cond, block));
         }
         else if (parser->next.tag == '{' ||
                 parser->next.tag == '[') {
-            parse_block(parser);
+            ast_id block = parse_block(parser);
+            syntree_list_push(&parser->syntree,
+                    syntree_add_tag(&parser->syntree, AST_ELSE, block));
             break; /* we are done. any else that follows is
                       either a syntax error, or an else beloging
                       to an outer if statement */
         }
     }
 
-    parser->debug_indent -= 4;
-    return 1;
+    return syntree_list_commit(&parser->syntree, AST_IF, stmt);
 }
 
 ast_id parse_for_stmt(parser_t* parser) {
-    /* (1) for ASSIGN ';' EXPR ';' EXPR BLOCK
+    /* (1) for ASSIGN ';' EXPR ';' EXPR BLOCK
      * (2) for VAR_DECL ';' EXPR ';' EXPR BLOCK
      * (3) for ASSIGN BLOCK
      * (4) for VAR_DECL BLOCK
      *
-     * (3) and (4) are the iterator versions
+     * (3) and (4) are the iterator versions, without cond and step
      */
     assert(parser->next.tag == TOKEN_T_KW_FOR);
     next_token(parser);
 
-    print_indent(parser);
-    printf("for\n");
-
-    parser->debug_indent += 4;
-
     ast_id init = (parser->next.tag == TOKEN_T_KW_LET) ?
         parse_variable_declaration(parser)
         : parse_assign(parser);
     if (!init)
         return AST_INVALID_ID;
 
+    ast_id cond = AST_INVALID_ID, step = AST_INVALID_ID;
     if (parser->next.tag == ';') {
         next_token(parser);
-        ast_id cond = parse_expr(parser);
+        cond = parse_expr(parser);
         if (!cond)
             return AST_INVALID_ID;
         if (parser->next.tag != ';') {
@@ -554,43 +835,30 @@ ast_id parse_for_stmt(parser_t* parser) {
             return AST_INVALID_ID;
         }
         next_token(parser);
-        parse_expr(parser);
+        step = parse_expr(parser);
     }
 
-    parse_block(parser);
-
-    parser->debug_indent -= 4;
+    ast_id body = parse_block(parser);
 
-    return 1;
+    return syntree_add_list(&parser->syntree, AST_FOR,
+            4, init, cond, step, body);
 }
 
 ast_id parse_while_stmt(parser_t* parser) {
     assert(parser->next.tag == TOKEN_T_KW_WHILE);
     next_token(parser);
 
-    print_indent(parser);
-    printf("while\n");
+    ast_id cond = parse_expr(parser);
+    ast_id body = parse_block(parser);
 
-    parser->debug_indent += 4;
-
-    parse_expr(parser);
-    parse_block(parser);
-
-    parser->debug_indent -= 4;
-
-    return 1;
+    return syntree_add_pair(&parser->syntree, AST_WHILE, cond, body);
 }
 
 ast_id parse_do_while_stmt(parser_t* parser) {
     assert(parser->next.tag == TOKEN_T_KW_DO);
     next_token(parser);
 
-    print_indent(parser);
-    printf("do\n");
-
-    parser->debug_indent += 4;
-
-    parse_block(parser);
+    ast_id body = parse_block(parser);
 
     if (parser->next.tag != TOKEN_T_KW_WHILE) {
         syntax_error(parser, "while");
@@ -598,7 +866,7 @@ ast_id parse_do_while_stmt(parser_t* parser) {
     }
     next_token(parser);
 
-    parse_expr(parser);
+    ast_id cond = parse_expr(parser);
 
     if (parser->next.tag != ';') {
         syntax_error(parser, ";");
@@ -606,66 +874,59 @@ ast_id parse_do_while_stmt(parser_t* parser) {
     }
     next_token(parser);
 
-    parser->debug_indent -= 4;
-
-    return 1;
+    return syntree_add_pair(&parser->syntree, AST_DO_WHILE, body, cond);
 }
 
 ast_id parse_switch_stmt(parser_t* parser) {
+    /* expr, cases..., default */
     assert(parser->next.tag == TOKEN_T_KW_SWITCH);
     next_token(parser);
 
-    print_indent(parser);
-    printf("switch\n");
-
-    parser->debug_indent += 4;
-
-    parse_expr(parser);
+    u32 stmt = syntree_list_begin(&parser->syntree);
+    syntree_list_push(&parser->syntree, parse_expr(parser));
     if (parser->next.tag != '{') {
         syntax_error(parser, "{");
+        syntree_list_discard(&parser->syntree, stmt);
         return AST_INVALID_ID;
     }
     next_token(parser);
 
     while (parser->next.tag == TOKEN_T_KW_CASE) {
         next_token(parser);
-        print_indent(parser);
-        printf("case\n");
-        parser->debug_indent += 4;
 
-        parse_const_expr(parser);
+        ast_id value = parse_const_expr(parser);
         if (parser->next.tag != ':') {
             syntax_error(parser, ":");
+            syntree_list_discard(&parser->syntree, stmt);
             return AST_INVALID_ID;
         }
         next_token(parser);
-        parse_block(parser);
-
-        parser->debug_indent -= 4;
+        ast_id block = parse_block(parser);
+        syntree_list_push(&parser->syntree,
+                syntree_add_pair(&parser->syntree, AST_CASE, value, block));
     }
 
     if (parser->next.tag == TOKEN_T_KW_DEFAULT) {
         next_token(parser);
-        print_indent(parser);
-        printf("default\n");
         if (parser->next.tag != ':') {
             syntax_error(parser, ":");
+            syntree_list_discard(&parser->syntree, stmt);
             return AST_INVALID_ID;
         }
         next_token(parser);
-        parser->debug_indent += 4;
-        parse_block(parser);
-        parser->debug_indent -= 4;
+        ast_id block = parse_block(parser);
+        syntree_list_push(&parser->syntree,
+                syntree_add_tag(&parser->syntree, AST_DEFAULT, block));
     }
 
     if (parser->next.tag != '}') {
         syntax_error(parser, "}");
+        syntree_list_discard(&parser->syntree, stmt);
         return AST_INVALID_ID;
     }
     next_token(parser);
 
-    parser->debug_indent -= 4;
-    return 1;
+    return syntree_list_commit(&parser->syntree, AST_SWITCH, stmt);
 }
 
 ast_id parse_type(parser_t* parser) {
@@ -683,10 +944,8 @@ ast_id parse_type(parser_t* parser) {
         case '(':
             return parse_func_type(parser);
         case TOKEN_T_ID:
-            print_indent(parser);
-            printf("some type\n");
-            next_token(parser);
-            return 1;
+            /* named type */
+            return parse_id(parser);
         default:
             syntax_error(parser, "type");
             return AST_INVALID_ID;
@@ -696,130 +955,104 @@ ast_id parse_type(parser_t* parser) {
 
 ast_id parse_native_type(parser_t* parser);
 
-ast_id parse_struct_type(parser_t* parser) {
-    assert(parser->next.tag == TOKEN_T_KW_STRUCT);
-    next_token(parser);
-
-    print_indent(parser);
-    printf("struct\n");
-
+/* Fields of a struct or union: '{' ( ID ':' type ',' )* '}' */
+internal ast_id parse_fields(parser_t* parser, synentry_tag_t tag) {
     if (parser->next.tag != '{') {
         syntax_error(parser, "{");
         return AST_INVALID_ID;
     }
+    next_token(parser);
 
-    parser->debug_indent += 4;
-
+    u32 fields = syntree_list_begin(&parser->syntree);
     while (parser->next.tag != '}') {
-        /* Struct fields */
-        /* ID ':' type ',' */
-        parse_id(parser);
+        ast_id id = parse_id(parser);
         if (parser->next.tag != ':') {
             syntax_error(parser, ":");
+            syntree_list_discard(&parser->syntree, fields);
             return AST_INVALID_ID;
         }
-        parse_type(parser);
+        next_token(parser);
+        ast_id type = parse_type(parser);
 
         if (parser->next.tag != ',') {
             syntax_error(parser, ",");
+            syntree_list_discard(&parser->syntree, fields);
             return AST_INVALID_ID;
         }
         next_token(parser);
+        syntree_list_push(&parser->syntree,
+                syntree_add_pair(&parser->syntree, AST_FIELD, id, type));
     }
+    next_token(parser);
 
-    parser->debug_indent -= 4;
-    return 1;
+    return syntree_list_commit(&parser->syntree, tag, fields);
 }
 
-ast_id parse_union_type(parser_t* parser) {
-    assert(parser->next.tag == TOKEN_T_KW_UNION);
+ast_id parse_struct_type(parser_t* parser) {
+    assert(parser->next.tag == TOKEN_T_KW_STRUCT);
     next_token(parser);
 
-    print_indent(parser);
-    printf("union\n");
-
-    if (parser->next.tag != '{') {
-        syntax_error(parser, "{");
-        return AST_INVALID_ID;
-    }
-
-    parser->debug_indent += 4;
-
-    while (parser->next.tag != '}') {
-        /* Union fields */
-        /* ID ':' type ',' */
-        parse_id(parser);
-        if (parser->next.tag != ':') {
-            syntax_error(parser, ":");
-            return AST_INVALID_ID;
-        }
-        parse_type(parser);
+    return parse_fields(parser, AST_STRUCT);
+}
 
-        if (parser->next.tag != ',') {
-            syntax_error(parser, ",");
-            return AST_INVALID_ID;
-        }
-        next_token(parser);
-    }
+ast_id parse_union_type(parser_t* parser) {
+    assert(parser->next.tag == TOKEN_T_KW_UNION);
+    next_token(parser);
 
-    parser->debug_indent -= 4;
-    return 1;
+    return parse_fields(parser, AST_UNION);
 }
 
 ast_id parse_enum_type(parser_t* parser) {
     assert(parser->next.tag == TOKEN_T_KW_ENUM);
     next_token(parser);
 
-    print_indent(parser);
-    printf("enum\n");
-
     if (parser->next.tag != '{') {
         syntax_error(parser, "{");
+        return AST_INVALID_ID;
     }
+    next_token(parser);
 
-    parser->debug_indent += 4;
-
+    u32 values = syntree_list_begin(&parser->syntree);
     while (parser->next.tag != '}') {
         /* enum fields */
         /* ID ',' */
-        parse_id(parser);
+        syntree_list_push(&parser->syntree, parse_id(parser));
         if (parser->next.tag != ',') {
             syntax_error(parser, ",");
+            syntree_list_discard(&parser->syntree, values);
             return AST_INVALID_ID;
         }
         next_token(parser);
     }
+    next_token(parser);
 
-    parser->debug_indent -= 4;
-    return 1;
+    return syntree_list_commit(&parser->syntree, AST_ENUM, values);
 }
 
 ast_id parse_func_type(parser_t* parser) {
     assert(parser->next.tag == '(');
     next_token(parser);
 
-    print_indent(parser);
-    printf("func type\n");
-
-    parser->debug_indent += 4;
-
     /* param types
-     * [ TYPE ( ',' TYPE )* ] [ ... ] */
+     * [ TYPE ( ',' TYPE )* ] [ ... ] */
+    u32 params = syntree_list_begin(&parser->syntree);
     while (parser->next.tag != ')') {
         if (parser->next.tag == TOKEN_T_ELLIPSIS) {
-            print_indent(parser);
-            printf("ellipsis\n");
+            syntree_list_push(&parser->syntree,
+                              syntree_add_ellipsis(&parser->syntree));
             next_token(parser);
             if (parser->next.tag != ')') {
                 syntax_error(parser, ")");
+                syntree_list_discard(&parser->syntree, params);
                 return AST_INVALID_ID;
             }
         } 
         else {
-            parse_type(parser);
+            syntree_list_push(&parser->syntree, parse_type(parser));
             if (parser->next.tag != ',' &&
                     parser->next.tag != ')') {
                 syntax_error(parser, "',' or ')'");
+                syntree_list_discard(&parser->syntree, params);
                 return AST_INVALID_ID;
             }
             if (parser->next.tag == ',')
@@ -827,19 +1060,27 @@ ast_id parse_func_type(parser_t* parser) {
         }
     }
     next_token(parser);
+    ast_id param_types = syntree_list_commit(&parser->syntree,
+                                             AST_FUNC_PARAMS, params);
 
     if (parser->next.tag != TOKEN_T_ARROW) {
         syntax_error(parser, "->");
         return AST_INVALID_ID;
     }
+    next_token(parser);
 
     /* Return types */
-    parse_type(parser);
-    while (parser->next.tag == ',')
-        parse_type(parser);
+    u32 ret_types = syntree_list_begin(&parser->syntree);
+    syntree_list_push(&parser->syntree, parse_type(parser));
+    while (parser->next.tag == ',') {
+        next_token(parser);
+        syntree_list_push(&parser->syntree, parse_type(parser));
+    }
+    ast_id ret_type = syntree_list_commit(&parser->syntree, AST_RET_TYPE,
+                                          ret_types);
 
-    parser->debug_indent -= 4;
-    return 1;
+    return syntree_add_pair(&parser->syntree, AST_FUNC_TYPE,
+                            param_types, ret_type);
 }
 
 ast_id parse_array_type(parser_t* parser) {
@@ -853,28 +1094,14 @@ ast_id parse_array_type(parser_t* parser) {
 
     next_token(parser);
 
-    print_indent(parser);
-    printf("array\n");
-
-    parser->debug_indent += 4;
-
-    parse_type(parser);
-
-    parser->debug_indent -= 4;
-    return 1;
+    ast_id type = parse_type(parser);
+    return syntree_add_tag(&parser->syntree, AST_ARRAY, type);
 }
 
 ast_id parse_pointer_type(parser_t* parser) {
     assert(parser->next.tag == '*');
     next_token(parser);
 
-    print_indent(parser);
-    printf("pointer\n");
-
-    parser->debug_indent += 4;
-
-    parse_type(parser);
-
-    parser->debug_indent -= 4;
-    return 1;
+    ast_id type = parse_type(parser);
+    return syntree_add_tag(&parser->syntree, AST_POINTER, type);
 }
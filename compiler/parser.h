@@ -2,10 +2,73 @@
 
 #include "fly.h"
 #include "lexer.h"
+#include "intern.h"
 #include "location.h"
+#include "diag.h"
 
 #define AST_INVALID_ID 0
-typedef u64 ast_id;
+typedef u32 ast_id;
+
+/* Operators, in the form X(tag, spelling, kinds, precedence, associativity).
+ * kinds is a combination of the OP_* flags below. Prefix operators bind
+ * tighter than every infix operator, so their precedence is only
+ * informative. The parser's lookup table (operator_info in parse_expr.c)
+ * is generated from this list. */
+#define FLY_OPERATORS(X) \
+    X(TOKEN_T_OR,                 "||",  OP_INFIX,               1,  OP_LEFT) \
+    X(TOKEN_T_AND,                "&&",  OP_INFIX,               2,  OP_LEFT) \
+    X(TOKEN_T_BITWISE_XOR,        "^",   OP_INFIX,               3,  OP_LEFT) \
+    X(TOKEN_T_BITWISE_OR,         "|",   OP_INFIX,               4,  OP_LEFT) \
+    X(TOKEN_T_BITWISE_AND,        "&",   OP_INFIX,               5,  OP_LEFT) \
+    X(TOKEN_T_EQUAL,              "==",  OP_INFIX,               6,  OP_LEFT) \
+    X(TOKEN_T_NOT_EQUAL,          "!=",  OP_INFIX,               6,  OP_LEFT) \
+    X(TOKEN_T_LESS_EQUAL,         "<=",  OP_INFIX,               8,  OP_LEFT) \
+    X(TOKEN_T_GREATER_EQUAL,      ">=",  OP_INFIX,               8,  OP_LEFT) \
+    X(TOKEN_T_LANGLE,             "<",   OP_INFIX,               8,  OP_LEFT) \
+    X(TOKEN_T_RANGLE,             ">",   OP_INFIX,               8,  OP_LEFT) \
+    X(TOKEN_T_SHIFT_LEFT,         "<<",  OP_INFIX,               9,  OP_LEFT) \
+    X(TOKEN_T_SHIFT_RIGHT,        ">>",  OP_INFIX,               9,  OP_LEFT) \
+    X(TOKEN_T_ADD,                "+",   OP_INFIX,               10, OP_LEFT) \
+    X(TOKEN_T_SUB,                "-",   OP_INFIX,               10, OP_LEFT) \
+    X(TOKEN_T_MUL,                "*",   OP_INFIX,               11, OP_LEFT) \
+    X(TOKEN_T_DIV,                "/",   OP_INFIX,               11, OP_LEFT) \
+    X(TOKEN_T_MOD,                "%",   OP_INFIX,               11, OP_LEFT) \
+    X(TOKEN_T_NOT,                "!",   OP_PREFIX,              12, OP_NONE) \
+    X(TOKEN_T_BITWISE_NOT,        "~",   OP_PREFIX,              12, OP_NONE) \
+    X(TOKEN_T_INC,                "++",  OP_PREFIX | OP_POSTFIX, 12, OP_NONE) \
+    X(TOKEN_T_DEC,                "--",  OP_PREFIX | OP_POSTFIX, 12, OP_NONE) \
+    X(TOKEN_T_ASSIGN,             "=",   OP_ASSIGN,              0,  OP_RIGHT) \
+    X(TOKEN_T_ADD_ASSIGN,         "+=",  OP_ASSIGN,              0,  OP_RIGHT) \
+    X(TOKEN_T_SUB_ASSIGN,         "-=",  OP_ASSIGN,              0,  OP_RIGHT) \
+    X(TOKEN_T_MUL_ASSIGN,         "*=",  OP_ASSIGN,              0,  OP_RIGHT) \
+    X(TOKEN_T_DIV_ASSIGN,         "/=",  OP_ASSIGN,              0,  OP_RIGHT) \
+    X(TOKEN_T_MOD_ASSIGN,         "%=",  OP_ASSIGN,              0,  OP_RIGHT) \
+    X(TOKEN_T_BITWISE_AND_ASSIGN, "&=",  OP_ASSIGN,              0,  OP_RIGHT) \
+    X(TOKEN_T_BITWISE_OR_ASSIGN,  "|=",  OP_ASSIGN,              0,  OP_RIGHT) \
+    X(TOKEN_T_BITWISE_XOR_ASSIGN, "^=",  OP_ASSIGN,              0,  OP_RIGHT) \
+    X(TOKEN_T_SHIFT_LEFT_ASSIGN,  "<<=", OP_ASSIGN,              0,  OP_RIGHT) \
+    X(TOKEN_T_SHIFT_RIGHT_ASSIGN, ">>=", OP_ASSIGN,              0,  OP_RIGHT)
+
+#define OP_INFIX   0x1
+#define OP_PREFIX  0x2
+#define OP_POSTFIX 0x4
+#define OP_ASSIGN  0x8
+
+typedef enum {
+    OP_LEFT,
+    OP_RIGHT,
+    OP_NONE
+} op_assoc_t;
+
+/* Everything the expression parser needs to know about a token.
+ * All zero for tokens that are not operators. */
+typedef struct {
+    u8 kinds;
+    u8 precedence;
+    u8 assoc;
+} operator_info_t;
+
+extern const operator_info_t operator_info[TOKEN_T_COUNT];
 
 typedef enum {
     /* constants */
@@ -26,8 +89,10 @@ typedef enum {
     AST_STRUCT,
     AST_UNION,
     AST_ENUM,
+    AST_FIELD,
     AST_ARRAY,
     AST_POINTER,
+    AST_FUNC_TYPE,
     AST_AUTO,
     /* statements */
     AST_IF,
@@ -46,6 +111,8 @@ typedef enum {
     AST_PREFIX_EXPR,
     AST_POSTFIX_EXPR,
     AST_OPERATOR,
+    AST_ASSIGN,
+    AST_CAST,
     /* special operators */
     AST_CALL,
     AST_CALL_PARAM,
@@ -62,6 +129,7 @@ typedef enum {
     /* blocks */
     AST_BLOCK,
     AST_CAPTURE,
+    AST_LAZY_BLOCK,
     /* functions */
     AST_FUNCTION,
     AST_FUNC_PARAMS,
@@ -70,12 +138,15 @@ typedef enum {
     AST_ELLIPSIS,
     
     AST_PROGRAM,
+
+    AST_TAG_COUNT,
 } synentry_tag_t;
 
+/* Decoded view of one entry, see syntree_get_entry */
 typedef struct {
     union {
         /* "constants" */
-        char* string;
+        symbol_t symbol; /* identifiers and string literals */
         i32 integer;
         i64 long_int;
         u32 unsigned_int;
@@ -89,32 +160,130 @@ typedef struct {
         /* tree nodes */
         ast_id tag;
         struct {
-            ast_id first; 
+            ast_id first;
             ast_id second;
         } pair;
 
+        /* slice of the tree's child pool */
         struct {
-            ast_id* list;
-            size_t length;
+            u32 offset;
+            u32 length;
         } list;
     } value;
     synentry_tag_t tag;
     u8 type; /* internal use */
 } synentry_t;
 
+#define SYNTREE_MAX_CHUNKS 32
+
+/* Per-entry arrays of one chunk. Every entry has a tag, a shape (leaf,
+ * tag, pair or list) and one 32 bit payload word:
+ *   leaf: the value, or an index into wide for 64 bit constants
+ *   tag:  the contained id
+ *   pair: an index into pairs
+ *   list: an index into lists */
+typedef struct {
+    u32* payloads;
+    u8* tags;
+    u8* types;
+} syntree_chunk_t;
+
 typedef struct {
-    synentry_t* entries;
-    u64 num_entries;
+    ast_id first;
+    ast_id second;
+} syntree_pair_t;
+
+typedef struct {
+    u32 offset;
+    u32 length;
+} syntree_list_t;
+
+/* Entries live in chunks that double in size, so adding one never moves
+ * the existing ones. Chunk k holds (1 << first_chunk_shift) << k entries.
+ * Passes that only need tags touch one byte per entry. */
+typedef struct {
+    syntree_chunk_t chunks[SYNTREE_MAX_CHUNKS];
+    u32 num_chunks;
+    u32 first_chunk_shift;
+    u32 num_entries;
+
+    /* payloads by shape */
+    syntree_pair_t* pairs;
+    u32 num_pairs;
+    u32 pair_capacity;
+    syntree_list_t* lists;
+    u32 num_lists;
+    u32 list_capacity;
+    u64* wide;
+    u32 num_wide;
+    u32 wide_capacity;
+
+    /* children of all list entries, one contiguous slice per list */
+    ast_id* children;
+    u32 num_children;
+    u32 children_capacity;
+
+    /* stack of the lists that are currently being built */
+    ast_id* scratch;
+    u32 scratch_top;
+    u32 scratch_capacity;
+
+    /* ids grouped by tag, built on demand by syntree_get_tagged.
+     * tag_index[tag_offsets[t] .. tag_offsets[t + 1]] are the entries
+     * with tag t, in the order they were added. */
+    ast_id* tag_index;
+    u32 tag_offsets[AST_TAG_COUNT + 1];
+    u32 indexed_entries;
+
+    /* Set if the entries, payloads and children live in a file mapped by
+     * the AST cache (ast_cache.h) instead of growable arrays. Such a tree
+     * cannot grow; release_syntree unmaps it. */
+    void* mapping;
+    size_t mapping_size;
+
+    /* An allocation failed. Whatever was being added or looked up is
+     * missing, and every entry added from then on is AST_INVALID_ID. */
+    bool out_of_memory;
 } syntree_t;
 
-int init_syntree(syntree_t* tree);
+/* capacity_hint is the number of entries we expect, 0 if unknown */
+int init_syntree(syntree_t* tree, size_t capacity_hint);
 void release_syntree(syntree_t* tree);
 
-/* Return 0: Don't visit children, 1: Visit children */
-typedef int (*syntree_traverse_fnc)(synentry_t*);
-void syntree_traverse(syntree_t* tree, ast_id root, syntree_traverse_fnc fnc);
+/* Bytes used by the entries, their payloads and the child pool */
+size_t syntree_memory_used(const syntree_t* tree);
 
-synentry_t* syntree_get_entry(syntree_t* tree, ast_id id);
+typedef enum {
+    SYNTREE_PRE_ORDER,
+    SYNTREE_POST_ORDER,
+} syntree_order_t;
+
+/* Return 0: Don't visit children, 1: Visit children.
+ * The return value only matters for pre-order traversal. */
+typedef int (*syntree_traverse_fnc)(syntree_t* tree, ast_id id,
+                                    const synentry_t* entry, void* ctx);
+
+/* Walks the tree below root with an explicit stack, so deep trees do not
+ * overflow the C stack. Invalid (0) children are skipped. The callback
+ * may add entries. Returns false if there was no memory for the stack,
+ * the walk stopped then. */
+bool syntree_traverse(syntree_t* tree, ast_id root, syntree_order_t order,
+                      syntree_traverse_fnc fnc, void* ctx);
+
+/* Calls fnc for every entry with the given tag, in the order they were
+ * added, without walking the tree. */
+void syntree_visit_tag(syntree_t* tree, synentry_tag_t tag,
+                       syntree_traverse_fnc fnc, void* ctx);
+
+/* All ids with the given tag. The index is (re)built on the first call
+ * after entries were added; the pointer is valid until then. If there
+ * is no memory for the index, *count is 0 and the tree is marked
+ * out_of_memory. */
+const ast_id* syntree_get_tagged(syntree_t* tree, synentry_tag_t tag,
+                                 u32* count);
+
+synentry_t syntree_get_entry(syntree_t* tree, ast_id id);
+synentry_tag_t syntree_get_tag(syntree_t* tree, ast_id id);
 
 ast_id syntree_add_int(syntree_t* tree, i32 i);
 ast_id syntree_add_uint(syntree_t* tree, u32 u);
@@ -124,35 +293,144 @@ ast_id syntree_add_f32(syntree_t* tree, f32 f);
 ast_id syntree_add_f64(syntree_t* tree, f64 f);
 ast_id syntree_add_bool(syntree_t* tree, bool b);
 ast_id syntree_add_char(syntree_t* tree, char c);
-ast_id syntree_add_string(syntree_t* tree, const char* s);
-ast_id syntree_add_id(syntree_t* tree, const char* id);
+ast_id syntree_add_string(syntree_t* tree, symbol_t s);
+ast_id syntree_add_id(syntree_t* tree, symbol_t id);
 ast_id syntree_add_operator(syntree_t* tree, token_tag_t op);
 ast_id syntree_add_ellipsis(syntree_t* tree);
+ast_id syntree_add_auto(syntree_t* tree);
+/* Placeholder for a block that was skipped, the bytes [begin, end) of
+ * the file. Stored like a 64 bit constant: begin | end << 32. */
+ast_id syntree_add_lazy_block(syntree_t* tree, u32 begin, u32 end);
 
 ast_id syntree_add_tag(syntree_t* tree, synentry_tag_t tag, ast_id contained);
 ast_id syntree_add_pair(syntree_t* tree, synentry_tag_t tag,
         ast_id first, ast_id second);
 ast_id syntree_add_list(syntree_t* tree, synentry_tag_t tag,
         size_t length, ...);
+/* Appending moves the list to the end of the child pool unless it is
+ * already there. Prefer the list builder below. */
 ast_id syntree_append_list(syntree_t* tree, ast_id list, ast_id element);
-ast_id syntree_prepend_list(syntree_t* tree, ast_id list, ast_id element);
+
+/* Makes id an alias of with: id gets with's tag and payload, so
+ * everything that refers to id now sees with's contents. with stays in
+ * the tree but is no longer reachable unless something else refers to
+ * it. */
+void syntree_replace(syntree_t* tree, ast_id id, ast_id with);
+
+/* List builder. Children are pushed onto a scratch stack while their list
+ * is parsed and copied into the child pool in one go by commit. Builders
+ * nest: commit takes everything pushed since its mark. */
+u32 syntree_list_begin(syntree_t* tree);
+void syntree_list_push(syntree_t* tree, ast_id child);
+ast_id syntree_list_commit(syntree_t* tree, synentry_tag_t tag, u32 mark);
+/* Drops everything pushed since mark, for error paths */
+void syntree_list_discard(syntree_t* tree, u32 mark);
+
+/* Number of children syntree_traverse visits below entry */
+u32 syntree_count_children(syntree_t* tree, const synentry_t* entry);
+
+/* Appends all entries of src to tree, keeping their order: entry i of
+ * src becomes entry base + i. Returns base. Lists that src is still
+ * building are not copied. Check tree->out_of_memory afterwards. */
+ast_id syntree_merge(syntree_t* tree, const syntree_t* src);
+
+/* For trees that were not built here, such as those in the AST cache:
+ * true if every tag and type is known, every payload is in range and
+ * every entry refers only to entries added before it, so that a walk
+ * ends. A tree that only the parser added to passes; syntree_replace
+ * can make one that does not. */
+bool syntree_check(const syntree_t* tree);
+
+/* Children of a list entry. The pointer is valid until the next list is
+ * added. */
+const ast_id* syntree_get_children(syntree_t* tree, ast_id list, u32* length);
+/* Overwrites one child of a list in place */
+void syntree_set_child(syntree_t* tree, ast_id list, u32 index,
+                       ast_id child);
 
 typedef struct {
     location_t location;
 } ast_node_t;
 
+/* Scratch stacks of the expression parser, see parse_expr.c */
+typedef struct {
+    u16* operators; /* token tags */
+    u32 num_operators;
+    u32 operator_capacity;
+    ast_id* operands;
+    u32 num_operands;
+    u32 operand_capacity;
+} expr_stacks_t;
+
 typedef struct {
-    int debug_indent;
     token_t next;
-    lexer_t lexer;
+    u32 position; /* index of next in tokens */
+    token_buffer_t tokens;
     syntree_t syntree;
+    expr_stacks_t expr;
+    file_id_t file;
+
+    /* Set before parsing: function bodies are neither lexed nor parsed
+     * but skipped and recorded as AST_LAZY_BLOCK entries, see
+     * parse_lazy_body. The tokens are then lexed on demand (streaming)
+     * by lexer, so the lexer can jump over the bodies. */
+    bool lazy_bodies;
+    bool streaming;
+    lexer_t lexer;
+
+    /* Set before parsing: stop after this many errors, 0 for no limit */
+    u32 max_errors;
+    /* An error was reported and the parser has not found a place to go on
+     * from yet (see synchronize), further errors are not reported. */
+    bool panic;
+
+    /* syntax errors, and the lexer's errors. The lexer points here, so
+     * the parser must not move while it parses. */
+    diag_buffer_t diag;
 } parser_t;
 
+/* A parser_t owns all of its state; parsers on different threads share
+ * nothing but the source table and the interner, which are thread safe.
+ * If memory runs out, the parser stops as if the file ended there and
+ * sets syntree.out_of_memory; nothing ends the process.
+ *
+ * After a syntax error the parser skips to the end of the statement or
+ * declaration and goes on, so that one run reports every error that is
+ * not a consequence of an earlier one. The construct with the error is
+ * left out of the tree. Parsing stops early once the diagnostics hold
+ * more than max_errors errors. */
+
+/* Returns 0 if file cannot be read, or with syntree.out_of_memory set if
+ * memory ran out. */
 int init_parser(parser_t* parser, char* file);
+/* Parses length bytes at data instead of a file. They are copied into
+ * the source table under name (source_add_buffer), which is what
+ * diagnostics call the file. The copy stays until
+ * source_release_file(parser->file). */
+int init_parser_buffer(parser_t* parser, const char* name, const char* data,
+                       size_t length);
 void release_parser(parser_t* parser);
 
+/* Moves the syntax tree out of the parser. The caller owns *tree and
+ * frees it with release_syntree; release_parser leaves it alone. */
+void parser_take_syntree(parser_t* parser, syntree_t* tree);
+
+/* Returns the AST_PROGRAM entry, or AST_INVALID_ID if memory ran out */
 ast_id parse_program(parser_t* parser);
 
+/* Parses file on num_threads threads and returns the AST_PROGRAM entry.
+ * The file is split at top-level declarations (lexer_split); every slice
+ * is lexed and parsed into its own syntax tree, and the trees are merged
+ * in file order. The result has the same ids as init_parser followed by
+ * parse_program, whatever the number of threads, unless there are more
+ * errors than max_errors: slices stop at the limit on their own, the
+ * merged diagnostics are cut at it. The parser holds the
+ * merged tree but no tokens. lazy_bodies has to be set before the call
+ * and is kept. Returns AST_INVALID_ID if the file cannot be read or
+ * memory ran out (syntree.out_of_memory). */
+ast_id parse_program_parallel(parser_t* parser, char* file, u32 num_threads);
+ast_id parse_top_level(parser_t* parser);
+
 ast_id parse_id(parser_t* parser);
 
 ast_id parse_meta_instruction(parser_t* parser);
@@ -169,6 +447,14 @@ ast_id parse_func_params(parser_t* parser);
 ast_id parse_annotation(parser_t* parser);
 
 ast_id parse_block(parser_t* parser);
+/* Parses the block behind an AST_LAZY_BLOCK entry and replaces the entry
+ * with it (syntree_replace), so the id stays valid and everything that
+ * refers to it sees the real block. Returns body, or AST_INVALID_ID on a
+ * syntax error. Ids of anything else are left alone. */
+ast_id parse_lazy_body(parser_t* parser, ast_id body);
+/* Expands every AST_LAZY_BLOCK; bodies nested in them are parsed right
+ * away. Returns false if any of them had a syntax error. */
+bool parse_all_lazy_bodies(parser_t* parser);
 ast_id parse_capture(parser_t* parser);
 
 ast_id parse_statement(parser_t* parser);
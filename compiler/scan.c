@@ -0,0 +1,358 @@
+#include "scan.h"
+
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86 1
+#define SCAN_HAVE_AVX2 1
+#include <immintrin.h>
+/* The whole blocks the vector kernels read reach past the ends of a
+ * malloc'd buffer, within the same page, which AddressSanitizer would
+ * report */
+#define TARGET_SSE2 __attribute__((target("sse2"), no_sanitize_address))
+#define TARGET_AVX2 __attribute__((target("avx2,popcnt"), no_sanitize_address))
+#elif defined(_MSC_VER) && defined(_M_X64)
+/* SSE2 is part of x64. No AVX2 kernels here yet, MSVC has no
+ * equivalent of __builtin_cpu_supports and we would need cpuid. */
+#define SCAN_X86 1
+#include <intrin.h>
+#include <emmintrin.h>
+#define TARGET_SSE2
+#endif
+
+internal inline u32 first_set(u32 mask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (u32)index;
+#else
+    return (u32)__builtin_ctz(mask);
+#endif
+}
+
+internal inline u32 popcount(u32 x) {
+#if defined(__GNUC__)
+    return (u32)__builtin_popcount(x);
+#else
+    x = x - ((x >> 1) & 0x55555555u);
+    x = (x & 0x33333333u) + ((x >> 2) & 0x33333333u);
+    x = (x + (x >> 4)) & 0x0f0f0f0fu;
+    return (x * 0x01010101u) >> 24;
+#endif
+}
+
+/* scalar */
+
+internal const char* skip_whitespace_scalar(const char* p) {
+    while (*p == ' ' || *p == '\t' || *p == '\n')
+        p++;
+    return p;
+}
+
+internal const char* find_scalar(const char* p, char a, char b) {
+    while (*p != a && *p != b && *p != '\0')
+        p++;
+    return p;
+}
+
+internal const char* find_block_delimiter_scalar(const char* p) {
+    for (;;) {
+        char c = *p;
+        if (c == '{' || c == '}' || c == '/' || c == '"' || c == '\'' ||
+                c == '\0')
+            return p;
+        p++;
+    }
+}
+
+internal u32 count_newlines_scalar(const char* begin, const char* end) {
+    u32 count = 0;
+    for (const char* p = begin; p < end; p++)
+        count += (*p == '\n');
+    return count;
+}
+
+#ifdef SCAN_X86
+
+/* SSE2. The loads are aligned, bytes in front of p are masked out. */
+
+TARGET_SSE2
+internal const char* skip_whitespace_sse2(const char* p) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    u32 offset = (u32)((uintptr_t)p & 15);
+    const __m128i* block = (const __m128i*)(p - offset);
+    u32 mask = (0xffffu << offset) & 0xffffu;
+    for (;;) {
+        __m128i chunk = _mm_load_si128(block);
+        __m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, space),
+                                               _mm_cmpeq_epi8(chunk, tab)),
+                                  _mm_cmpeq_epi8(chunk, newline));
+        u32 other = ~(u32)_mm_movemask_epi8(ws) & mask;
+        if (other)
+            return (const char*)block + first_set(other);
+        block++;
+        mask = 0xffffu;
+    }
+}
+
+TARGET_SSE2
+internal const char* find_sse2(const char* p, char a, char b) {
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    const __m128i zero = _mm_setzero_si128();
+    u32 offset = (u32)((uintptr_t)p & 15);
+    const __m128i* block = (const __m128i*)(p - offset);
+    u32 mask = (0xffffu << offset) & 0xffffu;
+    for (;;) {
+        __m128i chunk = _mm_load_si128(block);
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, va),
+                                                _mm_cmpeq_epi8(chunk, vb)),
+                                   _mm_cmpeq_epi8(chunk, zero));
+        u32 found = (u32)_mm_movemask_epi8(hit) & mask;
+        if (found)
+            return (const char*)block + first_set(found);
+        block++;
+        mask = 0xffffu;
+    }
+}
+
+TARGET_SSE2
+internal const char* find_block_delimiter_sse2(const char* p) {
+    const __m128i lcurl = _mm_set1_epi8('{');
+    const __m128i rcurl = _mm_set1_epi8('}');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i tick = _mm_set1_epi8('\'');
+    const __m128i zero = _mm_setzero_si128();
+    u32 offset = (u32)((uintptr_t)p & 15);
+    const __m128i* block = (const __m128i*)(p - offset);
+    u32 mask = (0xffffu << offset) & 0xffffu;
+    for (;;) {
+        __m128i chunk = _mm_load_si128(block);
+        __m128i braces = _mm_or_si128(_mm_cmpeq_epi8(chunk, lcurl),
+                                      _mm_cmpeq_epi8(chunk, rcurl));
+        __m128i other = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, slash),
+                                                  _mm_cmpeq_epi8(chunk, quote)),
+                                     _mm_or_si128(_mm_cmpeq_epi8(chunk, tick),
+                                                  _mm_cmpeq_epi8(chunk, zero)));
+        u32 found = (u32)_mm_movemask_epi8(_mm_or_si128(braces, other)) & mask;
+        if (found)
+            return (const char*)block + first_set(found);
+        block++;
+        mask = 0xffffu;
+    }
+}
+
+TARGET_SSE2
+internal u32 count_newlines_sse2(const char* begin, const char* end) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    u32 count = 0;
+    const char* p = begin;
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        count += popcount((u32)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)));
+    }
+    return count + count_newlines_scalar(p, end);
+}
+
+#endif
+
+#ifdef SCAN_HAVE_AVX2
+
+TARGET_AVX2
+internal const char* skip_whitespace_avx2(const char* p) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    u32 offset = (u32)((uintptr_t)p & 31);
+    const __m256i* block = (const __m256i*)(p - offset);
+    u32 mask = 0xffffffffu << offset;
+    for (;;) {
+        __m256i chunk = _mm256_load_si256(block);
+        __m256i ws = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, space),
+                                                     _mm256_cmpeq_epi8(chunk, tab)),
+                                     _mm256_cmpeq_epi8(chunk, newline));
+        u32 other = ~(u32)_mm256_movemask_epi8(ws) & mask;
+        if (other)
+            return (const char*)block + first_set(other);
+        block++;
+        mask = 0xffffffffu;
+    }
+}
+
+TARGET_AVX2
+internal const char* find_avx2(const char* p, char a, char b) {
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    const __m256i zero = _mm256_setzero_si256();
+    u32 offset = (u32)((uintptr_t)p & 31);
+    const __m256i* block = (const __m256i*)(p - offset);
+    u32 mask = 0xffffffffu << offset;
+    for (;;) {
+        __m256i chunk = _mm256_load_si256(block);
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, va),
+                                                      _mm256_cmpeq_epi8(chunk, vb)),
+                                      _mm256_cmpeq_epi8(chunk, zero));
+        u32 found = (u32)_mm256_movemask_epi8(hit) & mask;
+        if (found)
+            return (const char*)block + first_set(found);
+        block++;
+        mask = 0xffffffffu;
+    }
+}
+
+TARGET_AVX2
+internal const char* find_block_delimiter_avx2(const char* p) {
+    const __m256i lcurl = _mm256_set1_epi8('{');
+    const __m256i rcurl = _mm256_set1_epi8('}');
+    const __m256i slash = _mm256_set1_epi8('/');
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i tick = _mm256_set1_epi8('\'');
+    const __m256i zero = _mm256_setzero_si256();
+    u32 offset = (u32)((uintptr_t)p & 31);
+    const __m256i* block = (const __m256i*)(p - offset);
+    u32 mask = 0xffffffffu << offset;
+    for (;;) {
+        __m256i chunk = _mm256_load_si256(block);
+        __m256i braces = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, lcurl),
+                                         _mm256_cmpeq_epi8(chunk, rcurl));
+        __m256i other = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, slash),
+                                                        _mm256_cmpeq_epi8(chunk, quote)),
+                                        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, tick),
+                                                        _mm256_cmpeq_epi8(chunk, zero)));
+        u32 found = (u32)_mm256_movemask_epi8(_mm256_or_si256(braces, other)) & mask;
+        if (found)
+            return (const char*)block + first_set(found);
+        block++;
+        mask = 0xffffffffu;
+    }
+}
+
+TARGET_AVX2
+internal u32 count_newlines_avx2(const char* begin, const char* end) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    u32 count = 0;
+    const char* p = begin;
+    for (; end - p >= 32; p += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)p);
+        count += (u32)_mm_popcnt_u32((u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline)));
+    }
+    return count + count_newlines_scalar(p, end);
+}
+
+#endif
+
+/* dispatch */
+
+global_variable scan_isa_t current_isa = SCAN_SCALAR;
+
+internal bool cpu_supports(scan_isa_t isa) {
+    switch (isa) {
+        case SCAN_SCALAR:
+            return true;
+        case SCAN_SSE2:
+#if defined(SCAN_X86) && defined(__GNUC__)
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse2");
+#elif defined(SCAN_X86)
+            return true;
+#else
+            return false;
+#endif
+        case SCAN_AVX2:
+#ifdef SCAN_HAVE_AVX2
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+#else
+            return false;
+#endif
+    }
+    return false;
+}
+
+bool scan_set_isa(scan_isa_t isa) {
+    if (!cpu_supports(isa))
+        return false;
+    switch (isa) {
+        case SCAN_SCALAR:
+            scan_kernels.skip_whitespace = skip_whitespace_scalar;
+            scan_kernels.find = find_scalar;
+            scan_kernels.count_newlines = count_newlines_scalar;
+            scan_kernels.find_block_delimiter = find_block_delimiter_scalar;
+            break;
+#ifdef SCAN_X86
+        case SCAN_SSE2:
+            scan_kernels.skip_whitespace = skip_whitespace_sse2;
+            scan_kernels.find = find_sse2;
+            scan_kernels.count_newlines = count_newlines_sse2;
+            scan_kernels.find_block_delimiter = find_block_delimiter_sse2;
+            break;
+#endif
+#ifdef SCAN_HAVE_AVX2
+        case SCAN_AVX2:
+            scan_kernels.skip_whitespace = skip_whitespace_avx2;
+            scan_kernels.find = find_avx2;
+            scan_kernels.count_newlines = count_newlines_avx2;
+            scan_kernels.find_block_delimiter = find_block_delimiter_avx2;
+            break;
+#endif
+        default:
+            return false;
+    }
+    current_isa = isa;
+    return true;
+}
+
+scan_isa_t scan_get_isa(void) {
+    return current_isa;
+}
+
+const char* scan_isa_name(scan_isa_t isa) {
+    switch (isa) {
+        case SCAN_SCALAR: return "scalar";
+        case SCAN_SSE2: return "sse2";
+        case SCAN_AVX2: return "avx2";
+    }
+    return "unknown";
+}
+
+/* The table starts out pointing at these, which pick the best kernels on
+ * the first call. That way nobody has to remember to initialize it. */
+internal void select_best_isa(void) {
+    if (!scan_set_isa(SCAN_AVX2) && !scan_set_isa(SCAN_SSE2))
+        scan_set_isa(SCAN_SCALAR);
+}
+
+internal const char* resolve_skip_whitespace(const char* p) {
+    select_best_isa();
+    return scan_kernels.skip_whitespace(p);
+}
+
+internal const char* resolve_find(const char* p, char a, char b) {
+    select_best_isa();
+    return scan_kernels.find(p, a, b);
+}
+
+internal u32 resolve_count_newlines(const char* begin, const char* end) {
+    select_best_isa();
+    return scan_kernels.count_newlines(begin, end);
+}
+
+internal const char* resolve_find_block_delimiter(const char* p) {
+    select_best_isa();
+    return scan_kernels.find_block_delimiter(p);
+}
+
+scan_kernels_t scan_kernels = {
+    resolve_skip_whitespace,
+    resolve_find,
+    resolve_count_newlines,
+    resolve_find_block_delimiter,
+};
+
+void scan_init(void) {
+    if (scan_kernels.find == resolve_find)
+        select_best_isa();
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "fly.h"
+
+/* Scanning kernels for the lexer. Each one has a scalar, an SSE2 and an
+ * AVX2 version; the best one the CPU supports is picked on first use.
+ *
+ * The find functions rely on the '\0' sentinel at the end of every source
+ * buffer: they always stop at a '\0'. The vector versions read whole
+ * aligned blocks, which never cross into the next page. */
+
+typedef enum {
+    SCAN_SCALAR,
+    SCAN_SSE2,
+    SCAN_AVX2,
+} scan_isa_t;
+
+typedef struct {
+    /* first character that is not ' ', '\t' or '\n' */
+    const char* (*skip_whitespace)(const char* p);
+    /* first a, b or '\0' */
+    const char* (*find)(const char* p, char a, char b);
+    /* number of '\n' in [begin, end) */
+    u32 (*count_newlines)(const char* begin, const char* end);
+    /* first '{', '}', '/', '"', '\'' or '\0' */
+    const char* (*find_block_delimiter)(const char* p);
+} scan_kernels_t;
+
+extern scan_kernels_t scan_kernels;
+
+/* Picks the best kernels for the CPU now, unless scan_set_isa already
+ * picked some. The first scan does this otherwise, which is not safe if
+ * several threads start scanning at once. */
+void scan_init(void);
+
+/* Returns false if the CPU does not support the instruction set */
+bool scan_set_isa(scan_isa_t isa);
+scan_isa_t scan_get_isa(void);
+const char* scan_isa_name(scan_isa_t isa);
+
+/* Most gaps between tokens are a single space, which is not worth a trip
+ * through the vector code. */
+static inline const char* scan_skip_whitespace(const char* p) {
+    if (*p == ' ')
+        p++;
+    if (*p != ' ' && *p != '\t' && *p != '\n')
+        return p;
+    return scan_kernels.skip_whitespace(p);
+}
+
+static inline const char* scan_find_newline(const char* p) {
+    return scan_kernels.find(p, '\n', '\n');
+}
+
+/* '*', '/' or '\0', the interesting characters inside a block comment */
+static inline const char* scan_find_comment_delimiter(const char* p) {
+    return scan_kernels.find(p, '*', '/');
+}
+
+static inline const char* scan_find_quote(const char* p) {
+    return scan_kernels.find(p, '"', '"');
+}
+
+/* The characters that matter when skipping over a block without lexing
+ * it: braces and the start of comments and literals */
+static inline const char* scan_find_block_delimiter(const char* p) {
+    return scan_kernels.find_block_delimiter(p);
+}
+
+static inline u32 scan_count_newlines(const char* begin, const char* end) {
+    return scan_kernels.count_newlines(begin, end);
+}
@@ -0,0 +1,469 @@
+#ifndef WIN32_BUILD
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "source.h"
+#include "scan.h"
+#include "thread.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#ifndef WIN32_BUILD
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/* The files are allocated one by one, so pointers returned by
+ * source_get_file stay valid while other threads load more files.
+ * Released files leave a NULL slot behind, whose id is handed out again
+ * before the table grows. */
+typedef struct {
+    source_file_t** files;
+    u32 num_files;
+    u32 capacity;
+    file_id_t* free_ids;
+    u32 num_free;
+    u32 free_capacity;
+} source_table_t;
+
+global_variable source_table_t sources;
+global_variable mutex_t sources_lock = MUTEX_INITIALIZER;
+
+/* Caller holds sources_lock */
+internal file_id_t find_file(const char* path) {
+    for (u32 i = 0; i < sources.num_files; i++) {
+        source_file_t* source = sources.files[i];
+        if (source && !source->buffer && strcmp(source->path, path) == 0)
+            return (file_id_t)i;
+    }
+    return INVALID_FILE_ID;
+}
+
+/* Caller holds sources_lock. Returns the id of the file, or
+ * INVALID_FILE_ID if there is none left. */
+internal file_id_t add_file(source_file_t* source) {
+    if (sources.num_free > 0) {
+        file_id_t id = sources.free_ids[--sources.num_free];
+        sources.files[id] = source;
+        return id;
+    }
+    if (sources.num_files == INVALID_FILE_ID) {
+        fprintf(stderr, "Too many source files.\n");
+        return INVALID_FILE_ID;
+    }
+    if (sources.num_files == sources.capacity) {
+        u32 capacity = sources.capacity ? sources.capacity * 2 : 16;
+        source_file_t** files = realloc(sources.files,
+                                        capacity * sizeof(source_file_t*));
+        if (!files)
+            return INVALID_FILE_ID;
+        sources.files = files;
+        sources.capacity = capacity;
+    }
+    sources.files[sources.num_files] = source;
+    return (file_id_t)sources.num_files++;
+}
+
+internal void unload(source_file_t* source) {
+#ifndef WIN32_BUILD
+    if (source->mapped)
+        munmap((void*)source->data, source->size);
+    else
+#endif
+        free((void*)source->data);
+    free(source->path);
+    free(source->lines);
+}
+
+/* Reads the whole file into a malloc'd buffer with a trailing '\0'. */
+internal bool read_file(source_file_t* source, const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f)
+        return false;
+    if (fseek(f, 0, SEEK_END) != 0) {
+        fclose(f);
+        return false;
+    }
+    long size = ftell(f);
+    if (size < 0) {
+        fclose(f);
+        return false;
+    }
+    rewind(f);
+    stats_count(STATS_ALLOCATIONS, 1);
+    stats_count(STATS_ALLOCATED_BYTES, (u64)size + 1);
+    char* buffer = malloc((size_t)size + 1);
+    if (!buffer) {
+        fclose(f);
+        return false;
+    }
+    size_t read = fread(buffer, 1, (size_t)size, f);
+    fclose(f);
+    buffer[read] = '\0';
+    source->data = buffer;
+    source->size = read;
+    source->mapped = false;
+    return true;
+}
+
+#ifndef WIN32_BUILD
+/* Maps the file into memory. We only do this if the size is not a
+ * multiple of the page size: the kernel zero-fills the rest of the last
+ * page, which gives us the '\0' sentinel for free. Otherwise (and if
+ * mapping fails for any reason) the caller falls back to read_file. */
+internal bool map_file(source_file_t* source, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (page_size <= 0 || (st.st_size % page_size) == 0) {
+        close(fd);
+        return false;
+    }
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+    source->data = data;
+    source->size = (size_t)st.st_size;
+    source->mapped = true;
+    return true;
+}
+#endif
+
+/* Reads the file without holding the lock and adds it to the table */
+internal file_id_t load_file(const char* path) {
+    source_file_t source;
+    bool loaded = false;
+#ifndef WIN32_BUILD
+    loaded = map_file(&source, path);
+#endif
+    if (!loaded)
+        loaded = read_file(&source, path);
+    if (!loaded)
+        return INVALID_FILE_ID;
+    stats_count(STATS_BYTES_READ, source.size);
+    source.path = NULL;
+    source.lines = NULL;
+    source.num_lines = 0;
+    source.buffer = false;
+    if (source.size > 0xffffffffu) {
+        fprintf(stderr, "%s: Files larger than 4 GiB are not supported.\n", path);
+        unload(&source);
+        return INVALID_FILE_ID;
+    }
+    source.path = malloc(strlen(path) + 1);
+    source_file_t* entry = malloc(sizeof(source_file_t));
+    if (!source.path || !entry) {
+        free(entry);
+        unload(&source);
+        return INVALID_FILE_ID;
+    }
+    strcpy(source.path, path);
+    *entry = source;
+
+    mutex_lock(&sources_lock);
+    /* somebody else may have loaded it in the meantime */
+    file_id_t id = find_file(path);
+    if (id == INVALID_FILE_ID) {
+        id = add_file(entry);
+        if (id != INVALID_FILE_ID)
+            entry = NULL;
+    }
+    mutex_unlock(&sources_lock);
+
+    if (entry) {
+        unload(entry);
+        free(entry);
+    }
+    return id;
+}
+
+file_id_t source_load_file(const char* path) {
+    mutex_lock(&sources_lock);
+    file_id_t id = find_file(path);
+    mutex_unlock(&sources_lock);
+    if (id != INVALID_FILE_ID)
+        return id;
+
+    stats_phase_t phase = stats_begin(STATS_READ);
+    trace_begin_string("read", path);
+    id = load_file(path);
+    trace_end();
+    stats_end(phase);
+    return id;
+}
+
+file_id_t source_add_buffer(const char* name, const char* data,
+                            size_t length) {
+    if (length > 0xffffffffu) {
+        fprintf(stderr, "%s: Files larger than 4 GiB are not supported.\n",
+                name);
+        return INVALID_FILE_ID;
+    }
+    source_file_t* entry = malloc(sizeof(source_file_t));
+    char* copy = malloc(length + 1);
+    char* path = malloc(strlen(name) + 1);
+    if (!entry || !copy || !path) {
+        free(entry);
+        free(copy);
+        free(path);
+        return INVALID_FILE_ID;
+    }
+    stats_count(STATS_ALLOCATIONS, 1);
+    stats_count(STATS_ALLOCATED_BYTES, (u64)length + 1);
+    memcpy(copy, data, length);
+    copy[length] = '\0';
+    strcpy(path, name);
+    entry->path = path;
+    entry->data = copy;
+    entry->size = length;
+    entry->mapped = false;
+    entry->buffer = true;
+    entry->lines = NULL;
+    entry->num_lines = 0;
+
+    mutex_lock(&sources_lock);
+    file_id_t id = add_file(entry);
+    mutex_unlock(&sources_lock);
+    if (id == INVALID_FILE_ID) {
+        unload(entry);
+        free(entry);
+    }
+    return id;
+}
+
+/* Index of the line that holds offset */
+internal u32 find_line(const u32* lines, u32 num_lines, u32 offset) {
+    u32 low = 0, high = num_lines;
+    while (high - low > 1) {
+        u32 mid = low + (high - low) / 2;
+        if (lines[mid] <= offset)
+            low = mid;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/* Caller holds sources_lock. Patches the line table for an edit
+ * instead of scanning the whole file again: the lines that began in the
+ * removed bytes go, those of the inserted bytes come in, and the ones
+ * behind move. Returns false if there is no memory. */
+internal bool update_line_table(source_file_t* source, u32 offset,
+                                u32 removed, const char* inserted,
+                                u32 length) {
+    u32 num_lines = source->num_lines;
+    u32* lines = source->lines;
+    u32 keep = find_line(lines, num_lines, offset) + 1;
+    u32 behind = find_line(lines, num_lines, offset + removed) + 1;
+    u32 added = 0;
+    for (u32 i = 0; i < length; i++) {
+        if (inserted[i] == '\n')
+            added++;
+    }
+    u32 count = keep + added + (num_lines - behind);
+    if (count > num_lines) {
+        lines = realloc(lines, count * sizeof(u32));
+        if (!lines)
+            return false;
+        source->lines = lines;
+    }
+    memmove(lines + keep + added, lines + behind,
+            (num_lines - behind) * sizeof(u32));
+    u32 delta = length - removed; /* modulo 2^32 */
+    for (u32 i = keep + added; i < count; i++)
+        lines[i] += delta;
+    u32 line = keep;
+    for (u32 i = 0; i < length; i++) {
+        if (inserted[i] == '\n')
+            lines[line++] = offset + i + 1;
+    }
+    source->num_lines = count;
+    return true;
+}
+
+bool source_edit_buffer(file_id_t file, u32 offset, u32 removed,
+                        const char* inserted, u32 length) {
+    source_file_t* source = source_get_file(file);
+    assert(source->buffer);
+    assert(offset <= source->size && removed <= source->size - offset);
+    size_t size = source->size - removed + length;
+    if (size > 0xffffffffu)
+        return false;
+    char* data = (char*)source->data;
+    if (length > removed) {
+        data = realloc(data, size + 1);
+        if (!data)
+            return false;
+    }
+    /* the tail with its '\0' sentinel */
+    memmove(data + offset + length, data + offset + removed,
+            source->size - offset - removed + 1);
+    if (length > 0)
+        memcpy(data + offset, inserted, length);
+
+    mutex_lock(&sources_lock);
+    source->data = data;
+    source->size = size;
+    if (source->lines && !update_line_table(source, offset, removed,
+                                            inserted, length)) {
+        free(source->lines);
+        source->lines = NULL;
+        source->num_lines = 0;
+    }
+    mutex_unlock(&sources_lock);
+    return true;
+}
+
+void source_release_file(file_id_t file) {
+    mutex_lock(&sources_lock);
+    assert(file < sources.num_files && sources.files[file]);
+    source_file_t* source = sources.files[file];
+    bool released = false;
+    if (sources.num_free == sources.free_capacity) {
+        u32 capacity = sources.free_capacity ? sources.free_capacity * 2 : 16;
+        file_id_t* ids = realloc(sources.free_ids,
+                                 capacity * sizeof(file_id_t));
+        if (ids) {
+            sources.free_ids = ids;
+            sources.free_capacity = capacity;
+        }
+    }
+    /* without room on the free list the file simply stays loaded */
+    if (sources.num_free < sources.free_capacity) {
+        sources.free_ids[sources.num_free++] = file;
+        sources.files[file] = NULL;
+        released = true;
+    }
+    mutex_unlock(&sources_lock);
+    if (released) {
+        unload(source);
+        free(source);
+    }
+}
+
+source_file_t* source_get_file(file_id_t file) {
+    mutex_lock(&sources_lock);
+    assert(file < sources.num_files && sources.files[file]);
+    source_file_t* source = sources.files[file];
+    mutex_unlock(&sources_lock);
+    return source;
+}
+
+/* Finds the start of every line with the newline scan kernels */
+internal u32* build_line_table(const source_file_t* source, u32* num_lines) {
+    const char* data = source->data;
+    const char* end = data + source->size;
+    u32 count = scan_count_newlines(data, end) + 1;
+    u32* lines = malloc(count * sizeof(u32));
+    if (!lines)
+        return NULL;
+    lines[0] = 0;
+    u32 n = 1;
+    for (const char* p = data; ; p++) {
+        p = scan_find_newline(p);
+        if (p >= end)
+            break;
+        /* the scan also stops at a '\0' inside the file */
+        if (*p == '\n')
+            lines[n++] = (u32)(p + 1 - data);
+    }
+    assert(n == count);
+    *num_lines = n;
+    return lines;
+}
+
+internal const u32* get_line_table(source_file_t* source, u32* num_lines) {
+    mutex_lock(&sources_lock);
+    u32* lines = source->lines;
+    *num_lines = source->num_lines;
+    mutex_unlock(&sources_lock);
+    if (lines)
+        return lines;
+
+    /* build it without holding the lock */
+    u32 count = 0;
+    u32* built = build_line_table(source, &count);
+    mutex_lock(&sources_lock);
+    if (!source->lines && built) {
+        source->lines = built;
+        source->num_lines = count;
+        built = NULL;
+    }
+    lines = source->lines;
+    *num_lines = source->num_lines;
+    mutex_unlock(&sources_lock);
+    free(built);
+    return lines;
+}
+
+void source_get_position(file_id_t file, u32 offset, int* line, int* column) {
+    source_file_t* source = source_get_file(file);
+    assert(offset <= source->size);
+    u32 num_lines;
+    const u32* lines = get_line_table(source, &num_lines);
+    if (!lines) {
+        /* out of memory, count from the top */
+        const char* at = source->data + offset;
+        const char* line_start = at;
+        while (line_start > source->data && line_start[-1] != '\n')
+            line_start--;
+        *line = (int)scan_count_newlines(source->data, line_start) + 1;
+        *column = (int)(at - line_start) + 1;
+        return;
+    }
+    u32 index = find_line(lines, num_lines, offset);
+    *line = (int)index + 1;
+    *column = (int)(offset - lines[index]) + 1;
+}
+
+const char* source_get_line(file_id_t file, int line, u32* length) {
+    source_file_t* source = source_get_file(file);
+    u32 num_lines;
+    const u32* lines = get_line_table(source, &num_lines);
+    if (!lines || line < 1 || (u32)line > num_lines)
+        return NULL;
+    u32 begin = lines[line - 1];
+    u32 end = ((u32)line < num_lines) ? lines[line] - 1 : (u32)source->size;
+    if (end > begin && source->data[end - 1] == '\r')
+        end--;
+    *length = end - begin;
+    return source->data + begin;
+}
+
+expanded_location_t expand_location(location_t loc) {
+    expanded_location_t expanded;
+    expanded.file = source_get_file(loc.file)->path;
+    source_get_position(loc.file, loc.offset,
+                        &expanded.start_line, &expanded.start_column);
+    source_get_position(loc.file, loc.offset + loc.length,
+                        &expanded.end_line, &expanded.end_column);
+    return expanded;
+}
+
+void release_sources(void) {
+    mutex_lock(&sources_lock);
+    for (u32 i = 0; i < sources.num_files; i++) {
+        if (!sources.files[i])
+            continue;
+        unload(sources.files[i]);
+        free(sources.files[i]);
+    }
+    free(sources.files);
+    free(sources.free_ids);
+    memset(&sources, 0, sizeof(sources));
+    mutex_unlock(&sources_lock);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "fly.h"
+#include "location.h"
+
+/* The source table owns the contents of every file that takes part in a
+ * compilation. Files are identified by a small file_id_t, which is what
+ * tokens and syntax tree locations store instead of the path. */
+typedef struct {
+    char* path;
+    const char* data; /* always followed by a '\0' sentinel */
+    size_t size;
+    bool mapped;
+    bool buffer; /* added by source_add_buffer, not looked up by path */
+    /* offset of the first byte of each line, built by the first
+     * diagnostic that needs it */
+    u32* lines;
+    u32 num_lines;
+} source_file_t;
+
+/* Loads the file, or returns the id it already has.
+ * Returns INVALID_FILE_ID if the file cannot be read. */
+file_id_t source_load_file(const char* path);
+
+/* Adds a copy of the length bytes at data as a file called name, for
+ * sources that are not on disk, such as an editor buffer. name need not
+ * be unique, every call adds a new file. Returns INVALID_FILE_ID if
+ * there is no memory or no free id. */
+file_id_t source_add_buffer(const char* name, const char* data,
+                            size_t length);
+
+/* Replaces the removed bytes at offset of a file added by
+ * source_add_buffer with length bytes at inserted. The file keeps its
+ * id; what was lexed from it before refers to the old text. Nothing may
+ * read the file while it changes. Returns false if there is no memory,
+ * the file is unchanged then. */
+bool source_edit_buffer(file_id_t file, u32 offset, u32 removed,
+                        const char* inserted, u32 length);
+
+/* Frees a file and lets its id be reused. Nothing may refer to the file
+ * any more: no lexer, token or syntax tree location. */
+void source_release_file(file_id_t file);
+
+source_file_t* source_get_file(file_id_t file);
+
+/* 1-based line and column of a byte offset, a binary search in the line
+ * table */
+void source_get_position(file_id_t file, u32 offset, int* line, int* column);
+
+/* Text of a 1-based line without the line break, NULL if there is no
+ * such line */
+const char* source_get_line(file_id_t file, int line, u32* length);
+expanded_location_t expand_location(location_t loc);
+
+void release_sources(void);
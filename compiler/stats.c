@@ -0,0 +1,275 @@
+#ifndef WIN32_BUILD
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "stats.h"
+#include "thread.h"
+
+#include <string.h>
+
+#ifdef WIN32_BUILD
+#define PSAPI_VERSION 2
+#include <psapi.h>
+#else
+#include <time.h>
+#include <sys/resource.h>
+#endif
+
+typedef struct {
+    stats_t* target;
+    stats_phase_t phase;
+    u64 since;
+} thread_stats_t;
+
+bool stats_enabled;
+
+global_variable THREAD_LOCAL thread_stats_t current;
+
+global_variable const char* phase_names[STATS_PHASE_COUNT] = {
+    [STATS_NONE] = "other",
+    [STATS_READ] = "read",
+    [STATS_LEX] = "lex",
+    [STATS_PARSE] = "parse",
+    [STATS_MERGE] = "merge",
+    [STATS_OUTPUT] = "output",
+};
+
+global_variable const char* counter_names[STATS_COUNTER_COUNT] = {
+    [STATS_BYTES_READ] = "bytes_read",
+    [STATS_TOKENS] = "tokens",
+    [STATS_NODES] = "nodes",
+    [STATS_ALLOCATIONS] = "allocations",
+    [STATS_ALLOCATED_BYTES] = "allocated_bytes",
+    [STATS_CACHE_HITS] = "cache_hits",
+    [STATS_CACHE_MISSES] = "cache_misses",
+};
+
+u64 stats_now(void) {
+#ifdef WIN32_BUILD
+    local_persist LARGE_INTEGER frequency;
+    if (frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (u64)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (u64)t.tv_sec * 1000000000u + (u64)t.tv_nsec;
+#endif
+}
+
+/* Charges the time since the last switch to the running phase */
+internal u64 charge(void) {
+    u64 now = stats_now();
+    if (current.target && current.phase != STATS_NONE)
+        current.target->phase_ns[current.phase] += now - current.since;
+    current.since = now;
+    return now;
+}
+
+stats_t* stats_attach(stats_t* stats) {
+    stats_t* previous = current.target;
+    if (stats_enabled)
+        charge();
+    current.target = stats;
+    return previous;
+}
+
+stats_t* stats_target(void) {
+    return current.target;
+}
+
+stats_phase_t stats_begin(stats_phase_t phase) {
+    if (!stats_enabled)
+        return STATS_NONE;
+    charge();
+    stats_phase_t previous = current.phase;
+    current.phase = phase;
+    return previous;
+}
+
+void stats_end(stats_phase_t previous) {
+    if (!stats_enabled)
+        return;
+    charge();
+    current.phase = previous;
+}
+
+void stats_count(stats_counter_t counter, u64 amount) {
+    if (stats_enabled && current.target)
+        current.target->counters[counter] += amount;
+}
+
+void stats_merge(stats_t* stats, const stats_t* from) {
+    for (u32 i = 0; i < STATS_PHASE_COUNT; i++)
+        stats->phase_ns[i] += from->phase_ns[i];
+    for (u32 i = 0; i < STATS_COUNTER_COUNT; i++)
+        stats->counters[i] += from->counters[i];
+    for (u32 i = 0; i < STATS_MAX_TAGS; i++)
+        stats->nodes[i] += from->nodes[i];
+}
+
+u64 stats_peak_rss(void) {
+#ifdef WIN32_BUILD
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+                              sizeof(counters)))
+        return 0;
+    return (u64)counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return (u64)usage.ru_maxrss;
+#else
+    return (u64)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+internal double ms(u64 ns) {
+    return (double)ns / 1e6;
+}
+
+internal u64 busy_ns(const stats_t* stats) {
+    u64 total = 0;
+    for (u32 i = STATS_NONE + 1; i < STATS_PHASE_COUNT; i++)
+        total += stats->phase_ns[i];
+    return total;
+}
+
+internal void print_json_string(FILE* out, const char* str) {
+    fputc('"', out);
+    for (const unsigned char* c = (const unsigned char*)str; *c; c++) {
+        if (*c == '"' || *c == '\\')
+            fprintf(out, "\\%c", *c);
+        else if (*c < 0x20)
+            fprintf(out, "\\u%04x", *c);
+        else
+            fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+internal void print_json_stats(FILE* out, const stats_t* stats,
+                               const char* const* tag_names, u32 num_tags,
+                               const char* indent) {
+    fprintf(out, "%s\"phases_ms\": {", indent);
+    for (u32 i = STATS_NONE + 1; i < STATS_PHASE_COUNT; i++)
+        fprintf(out, "%s\"%s\": %.3f", (i > STATS_NONE + 1) ? ", " : "",
+                phase_names[i], ms(stats->phase_ns[i]));
+    fprintf(out, "},\n%s\"counters\": {", indent);
+    for (u32 i = 0; i < STATS_COUNTER_COUNT; i++)
+        fprintf(out, "%s\"%s\": %llu", (i > 0) ? ", " : "",
+                counter_names[i], (unsigned long long)stats->counters[i]);
+    fprintf(out, "}");
+    if (!tag_names)
+        return;
+    fprintf(out, ",\n%s\"nodes\": {", indent);
+    bool first = true;
+    for (u32 i = 0; i < num_tags; i++) {
+        if (!stats->nodes[i] || !tag_names[i])
+            continue;
+        fprintf(out, "%s", first ? "" : ", ");
+        print_json_string(out, tag_names[i]);
+        fprintf(out, ": %llu", (unsigned long long)stats->nodes[i]);
+        first = false;
+    }
+    fprintf(out, "}");
+}
+
+internal void print_json(FILE* out, u64 wall_ns, const stats_t* total,
+                         const stats_t* files, const char** paths,
+                         u32 num_files, const char* const* tag_names,
+                         u32 num_tags) {
+    fprintf(out, "{\n  \"wall_ms\": %.3f,\n", ms(wall_ns));
+    fprintf(out, "  \"peak_rss_bytes\": %llu,\n",
+            (unsigned long long)stats_peak_rss());
+    fprintf(out, "  \"files\": %u,\n", num_files);
+    print_json_stats(out, total, tag_names, num_tags, "  ");
+    fprintf(out, ",\n  \"per_file\": [");
+    for (u32 i = 0; i < num_files; i++) {
+        fprintf(out, "%s\n    {\n      \"path\": ", (i > 0) ? "," : "");
+        print_json_string(out, paths[i]);
+        fprintf(out, ",\n");
+        print_json_stats(out, &files[i], NULL, 0, "      ");
+        fprintf(out, "\n    }");
+    }
+    fprintf(out, "%s]\n}\n", num_files ? "\n  " : "");
+}
+
+internal void print_text(FILE* out, u64 wall_ns, const stats_t* total,
+                         const stats_t* files, const char** paths,
+                         u32 num_files, const char* const* tag_names,
+                         u32 num_tags) {
+    u64 busy = busy_ns(total);
+    fprintf(out, "=== Statistics ===\n");
+    fprintf(out, "  wall time       %12.3f ms\n", ms(wall_ns));
+    fprintf(out, "  thread time     %12.3f ms\n", ms(busy));
+    fprintf(out, "  peak RSS        %12llu KiB\n",
+            (unsigned long long)(stats_peak_rss() / 1024));
+    fprintf(out, "  files           %12u\n", num_files);
+
+    fprintf(out, "\n  phase                   ms      share\n");
+    for (u32 i = STATS_NONE + 1; i < STATS_PHASE_COUNT; i++)
+        fprintf(out, "  %-12s %12.3f %9.1f%%\n", phase_names[i],
+                ms(total->phase_ns[i]),
+                busy ? 100.0 * (double)total->phase_ns[i] / (double)busy : 0.0);
+
+    fprintf(out, "\n");
+    for (u32 i = 0; i < STATS_COUNTER_COUNT; i++)
+        fprintf(out, "  %-16s %12llu\n", counter_names[i],
+                (unsigned long long)total->counters[i]);
+    u64 lex = total->phase_ns[STATS_LEX];
+    if (lex > 0) {
+        fprintf(out, "  lex throughput   %12.1f MiB/s\n",
+                (double)total->counters[STATS_BYTES_READ] /
+                (1024.0 * 1024.0) / ((double)lex / 1e9));
+        fprintf(out, "  lex throughput   %12.1f Mtokens/s\n",
+                (double)total->counters[STATS_TOKENS] / 1e6 /
+                ((double)lex / 1e9));
+    }
+    u64 parse = total->phase_ns[STATS_PARSE];
+    if (parse > 0)
+        fprintf(out, "  parse throughput %12.1f Mnodes/s\n",
+                (double)total->counters[STATS_NODES] / 1e6 /
+                ((double)parse / 1e9));
+
+    fprintf(out, "\n  nodes by tag\n");
+    for (u32 i = 0; i < num_tags; i++) {
+        if (total->nodes[i] && tag_names[i])
+            fprintf(out, "    %-16s %10llu\n", tag_names[i],
+                    (unsigned long long)total->nodes[i]);
+    }
+
+    fprintf(out, "\n  %10s %10s %10s %10s %10s %10s  file\n",
+            "read ms", "lex ms", "parse ms", "merge ms", "tokens", "nodes");
+    for (u32 i = 0; i < num_files; i++) {
+        const stats_t* file = &files[i];
+        fprintf(out, "  %10.3f %10.3f %10.3f %10.3f %10llu %10llu  %s\n",
+                ms(file->phase_ns[STATS_READ]), ms(file->phase_ns[STATS_LEX]),
+                ms(file->phase_ns[STATS_PARSE]),
+                ms(file->phase_ns[STATS_MERGE]),
+                (unsigned long long)file->counters[STATS_TOKENS],
+                (unsigned long long)file->counters[STATS_NODES], paths[i]);
+    }
+}
+
+void stats_print(FILE* out, stats_format_t format, u64 wall_ns,
+                 const stats_t* files, const char** paths, u32 num_files,
+                 const char* const* tag_names, u32 num_tags) {
+    stats_t total;
+    memset(&total, 0, sizeof(total));
+    for (u32 i = 0; i < num_files; i++)
+        stats_merge(&total, &files[i]);
+    if (num_tags > STATS_MAX_TAGS)
+        num_tags = STATS_MAX_TAGS;
+    if (format == STATS_FORMAT_JSON)
+        print_json(out, wall_ns, &total, files, paths, num_files,
+                   tag_names, num_tags);
+    else
+        print_text(out, wall_ns, &total, files, paths, num_files,
+                   tag_names, num_tags);
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "fly.h"
+
+/* Instrumentation for --stats.
+ *
+ * Every thread charges its time to one phase at a time: stats_begin
+ * switches to a phase and pauses the one it interrupted, stats_end
+ * switches back. Phase times are therefore exclusive, lexing on demand
+ * in the middle of a parse is lexing and not parsing, and the phases of
+ * one thread add up to its busy time.
+ *
+ * Times and counters go to the stats_t the thread is attached to, one
+ * per file in the driver. Times are wall clock time of the thread, so
+ * with more threads than cores they include time spent waiting for one.
+ * Every switch reads the clock, which slows down lexing on demand
+ * (--lazy-bodies) noticeably. Nothing is recorded while stats_enabled is
+ * false, which makes the calls a load and a branch. */
+
+typedef enum {
+    STATS_NONE,     /* not in any phase */
+    STATS_READ,     /* loading source files */
+    STATS_LEX,
+    STATS_PARSE,
+    STATS_MERGE,    /* joining the slices of a file split across threads */
+    STATS_OUTPUT,   /* diagnostics and --dump-ast */
+
+    STATS_PHASE_COUNT,
+} stats_phase_t;
+
+typedef enum {
+    STATS_BYTES_READ,
+    STATS_TOKENS,
+    STATS_NODES,
+    /* growth of the token buffers, syntax trees and source buffers */
+    STATS_ALLOCATIONS,
+    STATS_ALLOCATED_BYTES,
+    /* files found in the AST cache, and files looked up but not found */
+    STATS_CACHE_HITS,
+    STATS_CACHE_MISSES,
+
+    STATS_COUNTER_COUNT,
+} stats_counter_t;
+
+/* syntax tree tags fit in a byte */
+#define STATS_MAX_TAGS 256
+
+typedef struct {
+    u64 phase_ns[STATS_PHASE_COUNT];
+    u64 counters[STATS_COUNTER_COUNT];
+    u64 nodes[STATS_MAX_TAGS];
+} stats_t;
+
+typedef enum {
+    STATS_FORMAT_TEXT,
+    STATS_FORMAT_JSON,
+} stats_format_t;
+
+extern bool stats_enabled;
+
+/* Monotonic clock in nanoseconds */
+u64 stats_now(void);
+
+/* Makes stats the target of this thread's times and counters, or none
+ * for NULL. Returns the previous target. */
+stats_t* stats_attach(stats_t* stats);
+/* The stats_t this thread is attached to, NULL if none */
+stats_t* stats_target(void);
+
+/* Returns the phase that was running, to be handed to stats_end */
+stats_phase_t stats_begin(stats_phase_t phase);
+void stats_end(stats_phase_t previous);
+
+void stats_count(stats_counter_t counter, u64 amount);
+
+/* Adds the times and counters of from */
+void stats_merge(stats_t* stats, const stats_t* from);
+
+/* Peak resident set size of the process in bytes, 0 if unknown */
+u64 stats_peak_rss(void);
+
+/* One report of a whole run: the totals, then a line or object for
+ * each of the num_files files. Node counts are listed under
+ * tag_names[tag], tags without a name are left out. */
+void stats_print(FILE* out, stats_format_t format, u64 wall_ns,
+                 const stats_t* files, const char** paths, u32 num_files,
+                 const char* const* tag_names, u32 num_tags);
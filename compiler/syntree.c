@@ -1,225 +1,745 @@
+#ifdef __linux__
+#define _DEFAULT_SOURCE
+#endif
+
 #include "fly.h"
 #include "parser.h"
+#include "stats.h"
 
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include <stdarg.h>
 
+#ifndef WIN32_BUILD
+#include <sys/mman.h>
+#endif
+
 #define TYPE_LEAF 0
 #define TYPE_TAG 1
 #define TYPE_PAIR 2
 #define TYPE_LIST 4
 
-int init_syntree(syntree_t* tree) {
-    tree->entries = NULL;
-    tree->num_entries = 0;
+#define MIN_CHUNK_SHIFT 10
+#define MAX_FIRST_CHUNK_SHIFT 24
+
+/* Chunks at least this large are backed by transparent huge pages where
+ * the OS offers them. */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+internal u32 highest_bit(u64 x) {
+#if defined(__GNUC__)
+    return 63 - (u32)__builtin_clzll(x);
+#else
+    u32 bit = 0;
+    while (x >>= 1)
+        bit++;
+    return bit;
+#endif
+}
+
+internal size_t chunk_capacity(const syntree_t* tree, u32 chunk) {
+    return ((size_t)1 << tree->first_chunk_shift) << chunk;
+}
+
+/* bytes per entry: payload, tag and type */
+#define ENTRY_SIZE (sizeof(u32) + 2 * sizeof(u8))
+
+internal void* alloc_chunk(size_t size) {
+    stats_count(STATS_ALLOCATIONS, 1);
+    stats_count(STATS_ALLOCATED_BYTES, size);
+#ifdef __linux__
+    if (size >= HUGE_PAGE_SIZE) {
+        void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            return NULL;
+        madvise(mem, size, MADV_HUGEPAGE);
+        return mem;
+    }
+#endif
+    return malloc(size);
+}
+
+internal void free_chunk(void* chunk, size_t size) {
+#ifdef __linux__
+    if (size >= HUGE_PAGE_SIZE) {
+        munmap(chunk, size);
+        return;
+    }
+#endif
+    (void)size;
+    free(chunk);
+}
+
+/* Makes room for count more elements in a growable array. If there is
+ * no memory for them the array stays as it was and the tree is marked
+ * out_of_memory. */
+internal void* reserve(syntree_t* tree, void* array, u32 used, u32* capacity,
+                       size_t count, size_t element_size) {
+    if (tree->out_of_memory || used + count <= *capacity)
+        return array;
+    size_t new_capacity = *capacity ? *capacity : 1024;
+    while (new_capacity < used + count)
+        new_capacity *= 2;
+    void* grown = NULL;
+    if (new_capacity <= 0xffffffffu) {
+        stats_count(STATS_ALLOCATIONS, 1);
+        stats_count(STATS_ALLOCATED_BYTES, new_capacity * element_size);
+        grown = realloc(array, new_capacity * element_size);
+    }
+    if (!grown) {
+        tree->out_of_memory = true;
+        return array;
+    }
+    *capacity = (u32)new_capacity;
+    return grown;
+}
+
+/* False if the tree is out of memory */
+#define RESERVE(tree, array, used, capacity, count) \
+    ((array) = reserve((tree), (array), (used), &(capacity), (count), \
+                       sizeof(*(array))), !(tree)->out_of_memory)
+
+int init_syntree(syntree_t* tree, size_t capacity_hint) {
+    /* tags are stored in a byte */
+    assert(AST_TAG_COUNT <= 0x100);
+    memset(tree, 0, sizeof(*tree));
+    u32 shift = MIN_CHUNK_SHIFT;
+    while (shift < MAX_FIRST_CHUNK_SHIFT && ((size_t)1 << shift) < capacity_hint)
+        shift++;
+    tree->first_chunk_shift = shift;
     return 1;
 }
 
+/* Locates the entry with index i (id - 1). With B = 1 << first_chunk_shift
+ * chunk k starts at index B * (2^k - 1), so i + B has its highest bit at
+ * first_chunk_shift + k. */
+internal syntree_chunk_t* locate(syntree_t* tree, u32 i, u32* offset) {
+    u64 n = (u64)i + ((u64)1 << tree->first_chunk_shift);
+    u32 bit = highest_bit(n);
+    *offset = (u32)(n - ((u64)1 << bit));
+    return &tree->chunks[bit - tree->first_chunk_shift];
+}
+
 void release_syntree(syntree_t* tree) {
-    for (size_t i = 0; i < tree->num_entries; i++) {
-        if (tree->entries[i].type == TYPE_LIST) {
-            free(tree->entries[i].value.list.list);
-        }
+    if (tree->mapping) {
+        /* everything but the scratch stack and the index is in there */
+#ifndef WIN32_BUILD
+        munmap(tree->mapping, tree->mapping_size);
+#else
+        free(tree->mapping);
+#endif
+        free(tree->scratch);
+        free(tree->tag_index);
+        memset(tree, 0, sizeof(*tree));
+        return;
     }
-    free(tree->entries);
-    tree->num_entries = 0;
+    for (u32 i = 0; i < tree->num_chunks; i++)
+        free_chunk(tree->chunks[i].payloads, chunk_capacity(tree, i) * ENTRY_SIZE);
+    free(tree->pairs);
+    free(tree->lists);
+    free(tree->wide);
+    free(tree->children);
+    free(tree->scratch);
+    free(tree->tag_index);
+    memset(tree, 0, sizeof(*tree));
+}
+
+size_t syntree_memory_used(const syntree_t* tree) {
+    return tree->num_entries * ENTRY_SIZE +
+           tree->num_pairs * sizeof(syntree_pair_t) +
+           tree->num_lists * sizeof(syntree_list_t) +
+           tree->num_wide * sizeof(u64) +
+           tree->num_children * sizeof(ast_id);
+}
+
+internal bool is_wide(synentry_tag_t tag) {
+    return tag == AST_CONST_INTL || tag == AST_CONST_UINTL ||
+           tag == AST_CONST_FLOAT64 || tag == AST_LAZY_BLOCK;
 }
 
-synentry_t* syntree_get_entry(syntree_t* tree, ast_id id) {
+synentry_t syntree_get_entry(syntree_t* tree, ast_id id) {
     assert(id <= tree->num_entries);
     assert(id != 0);
-    return &tree->entries[id - 1];
+    u32 offset;
+    syntree_chunk_t* chunk = locate(tree, id - 1, &offset);
+    synentry_t entry;
+    entry.tag = (synentry_tag_t)chunk->tags[offset];
+    entry.type = chunk->types[offset];
+    u32 payload = chunk->payloads[offset];
+    entry.value.unsigned_long = 0;
+    switch (entry.type) {
+        case TYPE_LEAF:
+            if (is_wide(entry.tag))
+                entry.value.unsigned_long = tree->wide[payload];
+            else
+                entry.value.unsigned_int = payload;
+            break;
+        case TYPE_TAG:
+            entry.value.tag = payload;
+            break;
+        case TYPE_PAIR:
+            entry.value.pair.first = tree->pairs[payload].first;
+            entry.value.pair.second = tree->pairs[payload].second;
+            break;
+        case TYPE_LIST:
+            entry.value.list.offset = tree->lists[payload].offset;
+            entry.value.list.length = tree->lists[payload].length;
+            break;
+    }
+    return entry;
 }
 
-void syntree_traverse(syntree_t* tree, ast_id root, syntree_traverse_fnc fnc) {
-    synentry_t* current = syntree_get_entry(tree, root);
-    if (!current)
-        return;
-    int visit_children = fnc(current);
-    if (!visit_children)
-        return;
-    if (current->type == TYPE_TAG) {
-        syntree_traverse(tree, current->value.tag, fnc);
-    } else if (current->type == TYPE_PAIR) {
-        syntree_traverse(tree, current->value.pair.first, fnc);
-        syntree_traverse(tree, current->value.pair.second, fnc);
-    } else if (current->type == TYPE_LIST) {
-        for (size_t i = 0; i < current->value.list.length; i++) {
-            syntree_traverse(tree, current->value.list.list[i], fnc);
+synentry_tag_t syntree_get_tag(syntree_t* tree, ast_id id) {
+    assert(id <= tree->num_entries);
+    assert(id != 0);
+    u32 offset;
+    syntree_chunk_t* chunk = locate(tree, id - 1, &offset);
+    return (synentry_tag_t)chunk->tags[offset];
+}
+
+/* Traversal stack. Small trees never leave the inline frames. */
+typedef struct {
+    ast_id id;
+    u32 expanded; /* post-order: children have been pushed */
+} traverse_frame_t;
+
+#define INLINE_FRAMES 64
+
+typedef struct {
+    traverse_frame_t* frames;
+    u32 top;
+    u32 capacity;
+    traverse_frame_t inline_frames[INLINE_FRAMES];
+} traverse_stack_t;
+
+internal bool push_frame(traverse_stack_t* stack, ast_id id, u32 expanded) {
+    if (stack->top == stack->capacity) {
+        u32 capacity = stack->capacity * 2;
+        traverse_frame_t* frames;
+        if (stack->frames == stack->inline_frames) {
+            frames = malloc(capacity * sizeof(traverse_frame_t));
+            if (frames)
+                memcpy(frames, stack->frames, stack->top * sizeof(traverse_frame_t));
+        } else {
+            frames = realloc(stack->frames, capacity * sizeof(traverse_frame_t));
+        }
+        if (!frames)
+            return false;
+        stack->frames = frames;
+        stack->capacity = capacity;
+    }
+    stack->frames[stack->top].id = id;
+    stack->frames[stack->top].expanded = expanded;
+    stack->top++;
+    return true;
+}
+
+/* Pushes the children in reverse, so that they are popped in order */
+internal bool push_children(syntree_t* tree, traverse_stack_t* stack,
+        const synentry_t* entry) {
+    bool ok = true;
+    if (entry->type == TYPE_TAG) {
+        if (entry->value.tag)
+            ok = push_frame(stack, entry->value.tag, 0);
+    } else if (entry->type == TYPE_PAIR) {
+        if (entry->value.pair.second)
+            ok = push_frame(stack, entry->value.pair.second, 0);
+        if (ok && entry->value.pair.first)
+            ok = push_frame(stack, entry->value.pair.first, 0);
+    } else if (entry->type == TYPE_LIST) {
+        u32 offset = entry->value.list.offset;
+        for (u32 i = entry->value.list.length; ok && i > 0; i--) {
+            ast_id child = tree->children[offset + i - 1];
+            if (child)
+                ok = push_frame(stack, child, 0);
+        }
+    }
+    return ok;
+}
+
+u32 syntree_count_children(syntree_t* tree, const synentry_t* entry) {
+    if (entry->type == TYPE_TAG)
+        return entry->value.tag != AST_INVALID_ID;
+    if (entry->type == TYPE_PAIR)
+        return (entry->value.pair.first != AST_INVALID_ID) +
+               (entry->value.pair.second != AST_INVALID_ID);
+    if (entry->type == TYPE_LIST) {
+        u32 count = 0;
+        const ast_id* children = tree->children + entry->value.list.offset;
+        for (u32 i = 0; i < entry->value.list.length; i++)
+            count += children[i] != AST_INVALID_ID;
+        return count;
+    }
+    return 0;
+}
+
+bool syntree_traverse(syntree_t* tree, ast_id root, syntree_order_t order,
+                      syntree_traverse_fnc fnc, void* ctx) {
+    if (root == AST_INVALID_ID)
+        return true;
+    traverse_stack_t stack;
+    stack.frames = stack.inline_frames;
+    stack.top = 0;
+    stack.capacity = INLINE_FRAMES;
+    push_frame(&stack, root, 0);
+
+    bool ok = true;
+    while (ok && stack.top > 0) {
+        traverse_frame_t frame = stack.frames[--stack.top];
+        synentry_t entry = syntree_get_entry(tree, frame.id);
+        if (order == SYNTREE_PRE_ORDER) {
+            if (fnc(tree, frame.id, &entry, ctx))
+                ok = push_children(tree, &stack, &entry);
+        } else if (frame.expanded) {
+            fnc(tree, frame.id, &entry, ctx);
+        } else {
+            ok = push_frame(&stack, frame.id, 1) &&
+                 push_children(tree, &stack, &entry);
         }
     }
+
+    if (stack.frames != stack.inline_frames)
+        free(stack.frames);
+    return ok;
+}
+
+/* Counting sort of all entries by tag. Reads only the tag arrays.
+ * Returns false if there is no memory for the index. */
+internal bool build_tag_index(syntree_t* tree) {
+    u32 counts[AST_TAG_COUNT] = {0};
+    u32 remaining = tree->num_entries;
+    for (u32 c = 0; c < tree->num_chunks && remaining > 0; c++) {
+        u32 n = (u32)chunk_capacity(tree, c);
+        if (n > remaining)
+            n = remaining;
+        const u8* tags = tree->chunks[c].tags;
+        for (u32 i = 0; i < n; i++)
+            counts[tags[i]]++;
+        remaining -= n;
+    }
+
+    u32 offset = 0;
+    for (u32 t = 0; t < AST_TAG_COUNT; t++) {
+        tree->tag_offsets[t] = offset;
+        offset += counts[t];
+    }
+    tree->tag_offsets[AST_TAG_COUNT] = offset;
+
+    ast_id* index = realloc(tree->tag_index, (tree->num_entries + 1) * sizeof(ast_id));
+    if (!index)
+        return false;
+    tree->tag_index = index;
+
+    u32 next[AST_TAG_COUNT];
+    memcpy(next, tree->tag_offsets, sizeof(next));
+    ast_id id = 1;
+    remaining = tree->num_entries;
+    for (u32 c = 0; c < tree->num_chunks && remaining > 0; c++) {
+        u32 n = (u32)chunk_capacity(tree, c);
+        if (n > remaining)
+            n = remaining;
+        const u8* tags = tree->chunks[c].tags;
+        for (u32 i = 0; i < n; i++)
+            index[next[tags[i]]++] = id++;
+        remaining -= n;
+    }
+    tree->indexed_entries = tree->num_entries;
+    return true;
 }
 
-internal ast_id add_entry(syntree_t* tree, synentry_t entry) {
-    tree->num_entries += 1;
-    tree->entries = realloc(tree->entries, tree->num_entries * sizeof(entry));
-    if (!tree->entries) {
-        fprintf(stderr, "Out of memory!\n");
-        exit(255);
+const ast_id* syntree_get_tagged(syntree_t* tree, synentry_tag_t tag,
+                                 u32* count) {
+    assert(tag < AST_TAG_COUNT);
+    if ((!tree->tag_index || tree->indexed_entries != tree->num_entries) &&
+            !build_tag_index(tree)) {
+        tree->out_of_memory = true;
+        *count = 0;
+        return NULL;
     }
-    tree->entries[tree->num_entries - 1] = entry;
-    return (ast_id)tree->num_entries;
+    *count = tree->tag_offsets[tag + 1] - tree->tag_offsets[tag];
+    return tree->tag_index + tree->tag_offsets[tag];
+}
+
+void syntree_visit_tag(syntree_t* tree, synentry_tag_t tag,
+                       syntree_traverse_fnc fnc, void* ctx) {
+    u32 count;
+    syntree_get_tagged(tree, tag, &count);
+    /* The callback may add entries and rebuild the index. The entries we
+     * started with stay first in their group, so index through the tree
+     * every time and only visit those. */
+    for (u32 i = 0; i < count; i++) {
+        ast_id id = tree->tag_index[tree->tag_offsets[tag] + i];
+        synentry_t entry = syntree_get_entry(tree, id);
+        fnc(tree, id, &entry, ctx);
+    }
+}
+
+internal ast_id add_entry(syntree_t* tree, synentry_tag_t tag, u8 type,
+        u32 payload) {
+    assert(!tree->mapping);
+    if (tree->out_of_memory)
+        return AST_INVALID_ID;
+    /* the chunks hold B * (2^num_chunks - 1) entries */
+    u64 capacity = (((u64)1 << tree->num_chunks) - 1) << tree->first_chunk_shift;
+    if (tree->num_entries == capacity) {
+        u8* mem = NULL;
+        size_t entries = chunk_capacity(tree, tree->num_chunks);
+        if (tree->num_chunks < SYNTREE_MAX_CHUNKS && capacity < 0xffffffffu)
+            mem = alloc_chunk(entries * ENTRY_SIZE);
+        if (!mem) {
+            tree->out_of_memory = true;
+            return AST_INVALID_ID;
+        }
+        syntree_chunk_t* chunk = &tree->chunks[tree->num_chunks++];
+        chunk->payloads = (u32*)mem;
+        chunk->tags = mem + entries * sizeof(u32);
+        chunk->types = chunk->tags + entries;
+    }
+    u32 offset;
+    syntree_chunk_t* chunk = locate(tree, tree->num_entries, &offset);
+    chunk->payloads[offset] = payload;
+    chunk->tags[offset] = (u8)tag;
+    chunk->types[offset] = type;
+    return ++tree->num_entries;
+}
+
+internal ast_id add_leaf(syntree_t* tree, synentry_tag_t tag, u32 value) {
+    return add_entry(tree, tag, TYPE_LEAF, value);
+}
+
+internal ast_id add_wide_leaf(syntree_t* tree, synentry_tag_t tag, u64 value) {
+    assert(!tree->mapping);
+    if (!RESERVE(tree, tree->wide, tree->num_wide, tree->wide_capacity, 1))
+        return AST_INVALID_ID;
+    tree->wide[tree->num_wide] = value;
+    return add_entry(tree, tag, TYPE_LEAF, tree->num_wide++);
 }
 
 ast_id syntree_add_int(syntree_t* tree, i32 i) {
-    synentry_t node;
-    node.tag = AST_CONST_INT;
-    node.type = TYPE_LEAF;
-    node.value.integer = i;
-    return add_entry(tree, node);
+    return add_leaf(tree, AST_CONST_INT, (u32)i);
 }
 
 ast_id syntree_add_uint(syntree_t* tree, u32 u) {
-    synentry_t node;
-    node.tag = AST_CONST_UINT;
-    node.type = TYPE_LEAF;
-    node.value.unsigned_int = u;
-    return add_entry(tree, node);
+    return add_leaf(tree, AST_CONST_UINT, u);
 }
 
 ast_id syntree_add_long(syntree_t* tree, i64 l) {
-    synentry_t node;
-    node.tag = AST_CONST_INTL;
-    node.type = TYPE_LEAF;
-    node.value.long_int = l;
-    return add_entry(tree, node);
+    return add_wide_leaf(tree, AST_CONST_INTL, (u64)l);
 }
 
 ast_id syntree_add_ulong(syntree_t* tree, u64 u) {
-    synentry_t node;
-    node.tag = AST_CONST_UINTL;
-    node.type = TYPE_LEAF;
-    node.value.unsigned_long = u;
-    return add_entry(tree, node);
+    return add_wide_leaf(tree, AST_CONST_UINTL, u);
 }
 
 ast_id syntree_add_f32(syntree_t* tree, f32 f) {
-    synentry_t node;
-    node.tag = AST_CONST_FLOAT32;
-    node.type = TYPE_LEAF;
-    node.value.float32 = f;
-    return add_entry(tree, node);
+    u32 bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return add_leaf(tree, AST_CONST_FLOAT32, bits);
 }
 
 ast_id syntree_add_f64(syntree_t* tree, f64 f) {
-    synentry_t node;
-    node.tag = AST_CONST_FLOAT64;
-    node.type = TYPE_LEAF;
-    node.value.float64 = f;
-    return add_entry(tree, node);
+    u64 bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return add_wide_leaf(tree, AST_CONST_FLOAT64, bits);
 }
 
 ast_id syntree_add_bool(syntree_t* tree, bool b) {
-    synentry_t node;
-    node.tag = AST_CONST_BOOL;
-    node.type = TYPE_LEAF;
-    node.value.boolean = b;
-    return add_entry(tree, node);
+    return add_leaf(tree, AST_CONST_BOOL, b);
 }
 
 ast_id syntree_add_char(syntree_t* tree, char c) {
-    synentry_t node;
-    node.tag = AST_CONST_CHAR;
-    node.type = TYPE_LEAF;
-    node.value.character = c;
-    return add_entry(tree, node);
+    return add_leaf(tree, AST_CONST_CHAR, (u8)c);
 }
 
-ast_id syntree_add_string(syntree_t* tree, const char* s) {
-    synentry_t node;
-    node.tag = AST_CONST_STRING;
-    node.type = TYPE_LEAF;
-    node.value.string = malloc(strlen(s) + 1);
-    if (!node.value.string) {
-        fprintf(stderr, "Out of memory!\n");
-        exit(255);
-    }
-    return add_entry(tree, node);
+ast_id syntree_add_string(syntree_t* tree, symbol_t s) {
+    return add_leaf(tree, AST_CONST_STRING, s);
 }
 
-ast_id syntree_add_id(syntree_t* tree, const char* id) {
-    synentry_t node;
-    node.tag = AST_ID;
-    node.type = TYPE_LEAF;
-    node.value.string = malloc(strlen(id) + 1);
-    if (!node.value.string) {
-        fprintf(stderr, "Out of memory!\n");
-        exit(255);
-    }
-    strcpy(node.value.string, id);
-    return add_entry(tree, node);
+ast_id syntree_add_id(syntree_t* tree, symbol_t id) {
+    return add_leaf(tree, AST_ID, id);
 }
 
 ast_id syntree_add_ellipsis(syntree_t* tree) {
-    synentry_t node;
-    node.tag = AST_ELLIPSIS;
-    node.type = TYPE_LEAF;
-    return add_entry(tree, node);
+    return add_leaf(tree, AST_ELLIPSIS, 0);
+}
+
+ast_id syntree_add_auto(syntree_t* tree) {
+    return add_leaf(tree, AST_AUTO, 0);
 }
 
 ast_id syntree_add_operator(syntree_t* tree, token_tag_t op) {
-    synentry_t node;
-    node.tag = AST_OPERATOR;
-    node.type = TYPE_LEAF;
-    node.value.operator = op;
-    return add_entry(tree, node);
+    return add_leaf(tree, AST_OPERATOR, (u32)op);
+}
+
+ast_id syntree_add_lazy_block(syntree_t* tree, u32 begin, u32 end) {
+    return add_wide_leaf(tree, AST_LAZY_BLOCK, (u64)begin | ((u64)end << 32));
 }
 
 ast_id syntree_add_tag(syntree_t* tree, synentry_tag_t tag, ast_id contained) {
-    synentry_t node;
-    node.tag = tag;
-    node.type = TYPE_TAG;
-    node.value.tag = contained;
-    return add_entry(tree, node);
+    return add_entry(tree, tag, TYPE_TAG, contained);
 }
 
 ast_id syntree_add_pair(syntree_t* tree, synentry_tag_t tag,
         ast_id first, ast_id second) {
-    synentry_t node;
-    node.tag = tag;
-    node.type = TYPE_TAG;
-    node.value.pair.first = first;
-    node.value.pair.second = second;
-    return add_entry(tree, node);
+    assert(!tree->mapping);
+    if (!RESERVE(tree, tree->pairs, tree->num_pairs, tree->pair_capacity, 1))
+        return AST_INVALID_ID;
+    tree->pairs[tree->num_pairs].first = first;
+    tree->pairs[tree->num_pairs].second = second;
+    return add_entry(tree, tag, TYPE_PAIR, tree->num_pairs++);
+}
+
+internal ast_id add_list_entry(syntree_t* tree, synentry_tag_t tag,
+        u32 offset, u32 length) {
+    if (!RESERVE(tree, tree->lists, tree->num_lists, tree->list_capacity, 1))
+        return AST_INVALID_ID;
+    tree->lists[tree->num_lists].offset = offset;
+    tree->lists[tree->num_lists].length = length;
+    return add_entry(tree, tag, TYPE_LIST, tree->num_lists++);
 }
 
 ast_id syntree_add_list(syntree_t* tree, synentry_tag_t tag,
         size_t length, ...) {
-    
-    synentry_t node;
-    node.tag = tag;
-    node.type = TYPE_LIST;
-    node.value.list.length = length;
-    node.value.list.list = malloc(sizeof(ast_id) * length);
-    if (!node.value.list.list) {
-        fprintf(stderr, "Out of memory!\n");
-        exit(255);
-    }
+    assert(!tree->mapping);
+    u32 offset = tree->num_children;
+    if (!RESERVE(tree, tree->children, tree->num_children,
+                 tree->children_capacity, length))
+        return AST_INVALID_ID;
     va_list args;
     va_start(args, length);
     for (size_t i = 0; i < length; i++) {
-        ast_id child = va_arg(args, ast_id);
-        node.value.list.list[i] = child;
+        tree->children[offset + i] = va_arg(args, ast_id);
     }
     va_end(args);
-    return add_entry(tree, node);
+    tree->num_children += (u32)length;
+    return add_list_entry(tree, tag, offset, (u32)length);
+}
+
+internal syntree_list_t* get_list(syntree_t* tree, ast_id id) {
+    assert(id != 0 && id <= tree->num_entries);
+    u32 offset;
+    syntree_chunk_t* chunk = locate(tree, id - 1, &offset);
+    assert(chunk->types[offset] == TYPE_LIST);
+    return &tree->lists[chunk->payloads[offset]];
 }
 
 ast_id syntree_append_list(syntree_t* tree, ast_id _list, ast_id elem) {
-    synentry_t* list = syntree_get_entry(tree, _list);
-    if (!list)
+    assert(!tree->mapping);
+    if (_list == AST_INVALID_ID)
+        return AST_INVALID_ID;
+    syntree_list_t* list = get_list(tree, _list);
+
+    u32 length = list->length;
+    if (!RESERVE(tree, tree->children, tree->num_children,
+                 tree->children_capacity, length + 1))
         return AST_INVALID_ID;
-    
-    size_t new_len = list->value.list.length + 1;
-    ast_id* new_list = realloc(list->value.list.list,
-                                sizeof(ast_id) * new_len);
-    if (!new_list)
-      return AST_INVALID_ID;
-
-    list->value.list.length = new_len;
-    list->value.list.list = new_list;
-    new_list[new_len - 1] = elem;
-    return _list;  
+    if (list->offset + length != tree->num_children) {
+        /* not the last list in the pool, move it there */
+        memcpy(tree->children + tree->num_children,
+               tree->children + list->offset, length * sizeof(ast_id));
+        list->offset = tree->num_children;
+        tree->num_children += length;
+    }
+    tree->children[tree->num_children++] = elem;
+    list->length = length + 1;
+    return _list;
+}
+
+void syntree_replace(syntree_t* tree, ast_id id, ast_id with) {
+    assert(id != 0 && id <= tree->num_entries);
+    assert(with != 0 && with <= tree->num_entries);
+    u32 from_offset, to_offset;
+    syntree_chunk_t* from = locate(tree, with - 1, &from_offset);
+    syntree_chunk_t* to = locate(tree, id - 1, &to_offset);
+    to->payloads[to_offset] = from->payloads[from_offset];
+    to->tags[to_offset] = from->tags[from_offset];
+    to->types[to_offset] = from->types[from_offset];
+    /* the tag of an indexed entry changed */
+    tree->indexed_entries = 0;
+}
+
+u32 syntree_list_begin(syntree_t* tree) {
+    return tree->scratch_top;
+}
+
+void syntree_list_push(syntree_t* tree, ast_id child) {
+    if (RESERVE(tree, tree->scratch, tree->scratch_top,
+                tree->scratch_capacity, 1))
+        tree->scratch[tree->scratch_top++] = child;
+}
+
+ast_id syntree_list_commit(syntree_t* tree, synentry_tag_t tag, u32 mark) {
+    assert(!tree->mapping);
+    assert(mark <= tree->scratch_top);
+    u32 length = tree->scratch_top - mark;
+    u32 offset = tree->num_children;
+    if (!RESERVE(tree, tree->children, tree->num_children,
+                 tree->children_capacity, length)) {
+        tree->scratch_top = mark;
+        return AST_INVALID_ID;
+    }
+    if (length > 0)
+        memcpy(tree->children + offset, tree->scratch + mark,
+               length * sizeof(ast_id));
+    tree->num_children += length;
+    tree->scratch_top = mark;
+    return add_list_entry(tree, tag, offset, length);
+}
+
+void syntree_list_discard(syntree_t* tree, u32 mark) {
+    assert(mark <= tree->scratch_top);
+    tree->scratch_top = mark;
+}
+
+const ast_id* syntree_get_children(syntree_t* tree, ast_id list, u32* length) {
+    syntree_list_t* l = get_list(tree, list);
+    *length = l->length;
+    return tree->children + l->offset;
+}
+
+void syntree_set_child(syntree_t* tree, ast_id list, u32 index,
+                       ast_id child) {
+    assert(!tree->mapping);
+    syntree_list_t* l = get_list(tree, list);
+    assert(index < l->length);
+    tree->children[l->offset + index] = child;
+}
+
+/* Whether every child of entry id is an entry added before it */
+internal bool children_before(const syntree_t* tree, ast_id id, u8 type,
+                              u32 payload) {
+    switch (type) {
+        case TYPE_TAG:
+            return payload < id;
+        case TYPE_PAIR:
+            return tree->pairs[payload].first < id &&
+                   tree->pairs[payload].second < id;
+        case TYPE_LIST: {
+            const syntree_list_t* list = &tree->lists[payload];
+            if (list->offset > tree->num_children ||
+                    list->length > tree->num_children - list->offset)
+                return false;
+            for (u32 i = 0; i < list->length; i++) {
+                if (tree->children[list->offset + i] >= id)
+                    return false;
+            }
+            return true;
+        }
+    }
+    return true;
+}
+
+bool syntree_check(const syntree_t* tree) {
+    u32 id = 1;
+    for (u32 c = 0; c < tree->num_chunks && id <= tree->num_entries; c++) {
+        const syntree_chunk_t* chunk = &tree->chunks[c];
+        u32 n = (u32)chunk_capacity(tree, c);
+        for (u32 i = 0; i < n && id <= tree->num_entries; i++, id++) {
+            synentry_tag_t tag = (synentry_tag_t)chunk->tags[i];
+            u32 payload = chunk->payloads[i];
+            if (tag >= AST_TAG_COUNT)
+                return false;
+            switch (chunk->types[i]) {
+                case TYPE_LEAF:
+                    if (is_wide(tag) && payload >= tree->num_wide)
+                        return false;
+                    break;
+                case TYPE_TAG:
+                    break;
+                case TYPE_PAIR:
+                    if (payload >= tree->num_pairs)
+                        return false;
+                    break;
+                case TYPE_LIST:
+                    if (payload >= tree->num_lists)
+                        return false;
+                    break;
+                default:
+                    return false;
+            }
+            /* identifiers and strings hold a symbol */
+            if ((tag == AST_ID || tag == AST_CONST_STRING) &&
+                    chunk->types[i] != TYPE_LEAF)
+                return false;
+            if (!children_before(tree, id, chunk->types[i], payload))
+                return false;
+        }
+    }
+    return true;
+}
+
+internal inline ast_id remap(ast_id id, ast_id base) {
+    return id ? id + base : AST_INVALID_ID;
+}
+
+ast_id syntree_merge(syntree_t* tree, const syntree_t* src) {
+    assert(!tree->mapping);
+    ast_id base = tree->num_entries;
+    u32 pair_base = tree->num_pairs;
+    u32 list_base = tree->num_lists;
+    u32 wide_base = tree->num_wide;
+    u32 child_base = tree->num_children;
+
+    /* all or nothing: room for everything first */
+    if (!RESERVE(tree, tree->pairs, tree->num_pairs, tree->pair_capacity,
+                 src->num_pairs) ||
+            !RESERVE(tree, tree->lists, tree->num_lists, tree->list_capacity,
+                     src->num_lists) ||
+            !RESERVE(tree, tree->wide, tree->num_wide, tree->wide_capacity,
+                     src->num_wide) ||
+            !RESERVE(tree, tree->children, tree->num_children,
+                     tree->children_capacity, src->num_children))
+        return base;
+    for (u32 i = 0; i < src->num_pairs; i++) {
+        tree->pairs[pair_base + i].first = remap(src->pairs[i].first, base);
+        tree->pairs[pair_base + i].second = remap(src->pairs[i].second, base);
+    }
+    tree->num_pairs += src->num_pairs;
+
+    for (u32 i = 0; i < src->num_lists; i++) {
+        tree->lists[list_base + i].offset = src->lists[i].offset + child_base;
+        tree->lists[list_base + i].length = src->lists[i].length;
+    }
+    tree->num_lists += src->num_lists;
+
+    if (src->num_wide > 0)
+        memcpy(tree->wide + wide_base, src->wide, src->num_wide * sizeof(u64));
+    tree->num_wide += src->num_wide;
+
+    for (u32 i = 0; i < src->num_children; i++)
+        tree->children[child_base + i] = remap(src->children[i], base);
+    tree->num_children += src->num_children;
+
+    u32 remaining = src->num_entries;
+    for (u32 c = 0; c < src->num_chunks && remaining > 0; c++) {
+        u32 n = (u32)chunk_capacity(src, c);
+        if (n > remaining)
+            n = remaining;
+        const syntree_chunk_t* chunk = &src->chunks[c];
+        for (u32 i = 0; i < n; i++) {
+            u32 payload = chunk->payloads[i];
+            synentry_tag_t tag = (synentry_tag_t)chunk->tags[i];
+            switch (chunk->types[i]) {
+                case TYPE_LEAF:
+                    if (is_wide(tag))
+                        payload += wide_base;
+                    break;
+                case TYPE_TAG:
+                    payload = remap(payload, base);
+                    break;
+                case TYPE_PAIR:
+                    payload += pair_base;
+                    break;
+                case TYPE_LIST:
+                    payload += list_base;
+                    break;
+            }
+            if (!add_entry(tree, tag, chunk->types[i], payload))
+                return base;
+        }
+        remaining -= n;
+    }
+    return base;
 }
@@ -0,0 +1,136 @@
+#ifndef WIN32_BUILD
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "thread.h"
+
+#ifndef WIN32_BUILD
+#include <unistd.h>
+#endif
+
+#ifdef WIN32_BUILD
+
+internal DWORD WINAPI thread_main(LPVOID data) {
+    thread_t* thread = data;
+    thread->result = thread->fnc(thread->arg);
+    return 0;
+}
+
+bool thread_create(thread_t* thread, thread_fnc fnc, void* arg) {
+    thread->fnc = fnc;
+    thread->arg = arg;
+    thread->result = 0;
+    thread->handle = CreateThread(NULL, 0, thread_main, thread, 0, NULL);
+    return thread->handle != NULL;
+}
+
+int thread_join(thread_t* thread) {
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+    return thread->result;
+}
+
+u32 thread_cpu_count(void) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (u32)info.dwNumberOfProcessors : 1;
+}
+
+void mutex_init(mutex_t* mutex) {
+    InitializeSRWLock(&mutex->lock);
+}
+
+void mutex_destroy(mutex_t* mutex) {
+    (void)mutex;
+}
+
+void mutex_lock(mutex_t* mutex) {
+    AcquireSRWLockExclusive(&mutex->lock);
+}
+
+void mutex_unlock(mutex_t* mutex) {
+    ReleaseSRWLockExclusive(&mutex->lock);
+}
+
+void condvar_init(condvar_t* cond) {
+    InitializeConditionVariable(&cond->cond);
+}
+
+void condvar_destroy(condvar_t* cond) {
+    (void)cond;
+}
+
+void condvar_wait(condvar_t* cond, mutex_t* mutex) {
+    SleepConditionVariableSRW(&cond->cond, &mutex->lock, INFINITE, 0);
+}
+
+void condvar_signal(condvar_t* cond) {
+    WakeConditionVariable(&cond->cond);
+}
+
+void condvar_broadcast(condvar_t* cond) {
+    WakeAllConditionVariable(&cond->cond);
+}
+
+#else
+
+internal void* thread_main(void* data) {
+    thread_t* thread = data;
+    thread->result = thread->fnc(thread->arg);
+    return NULL;
+}
+
+bool thread_create(thread_t* thread, thread_fnc fnc, void* arg) {
+    thread->fnc = fnc;
+    thread->arg = arg;
+    thread->result = 0;
+    return pthread_create(&thread->handle, NULL, thread_main, thread) == 0;
+}
+
+int thread_join(thread_t* thread) {
+    pthread_join(thread->handle, NULL);
+    return thread->result;
+}
+
+u32 thread_cpu_count(void) {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (u32)count : 1;
+}
+
+void mutex_init(mutex_t* mutex) {
+    pthread_mutex_init(&mutex->lock, NULL);
+}
+
+void mutex_destroy(mutex_t* mutex) {
+    pthread_mutex_destroy(&mutex->lock);
+}
+
+void mutex_lock(mutex_t* mutex) {
+    pthread_mutex_lock(&mutex->lock);
+}
+
+void mutex_unlock(mutex_t* mutex) {
+    pthread_mutex_unlock(&mutex->lock);
+}
+
+void condvar_init(condvar_t* cond) {
+    pthread_cond_init(&cond->cond, NULL);
+}
+
+void condvar_destroy(condvar_t* cond) {
+    pthread_cond_destroy(&cond->cond);
+}
+
+void condvar_wait(condvar_t* cond, mutex_t* mutex) {
+    pthread_cond_wait(&cond->cond, &mutex->lock);
+}
+
+void condvar_signal(condvar_t* cond) {
+    pthread_cond_signal(&cond->cond);
+}
+
+void condvar_broadcast(condvar_t* cond) {
+    pthread_cond_broadcast(&cond->cond);
+}
+
+#endif
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "fly.h"
+
+/* Minimal threads, mutexes and condition variables on top of pthreads
+ * or Win32. */
+
+#ifdef WIN32_BUILD
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+typedef struct {
+    SRWLOCK lock;
+} mutex_t;
+#define MUTEX_INITIALIZER { SRWLOCK_INIT }
+
+typedef struct {
+    CONDITION_VARIABLE cond;
+} condvar_t;
+#else
+#include <pthread.h>
+
+typedef struct {
+    pthread_mutex_t lock;
+} mutex_t;
+#define MUTEX_INITIALIZER { PTHREAD_MUTEX_INITIALIZER }
+
+typedef struct {
+    pthread_cond_t cond;
+} condvar_t;
+#endif
+
+/* Storage class of per-thread variables */
+#ifdef WIN32_BUILD
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+typedef int (*thread_fnc)(void* arg);
+
+/* thread_t has to stay at the same address until it is joined */
+typedef struct {
+#ifdef WIN32_BUILD
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+    thread_fnc fnc;
+    void* arg;
+    int result;
+} thread_t;
+
+bool thread_create(thread_t* thread, thread_fnc fnc, void* arg);
+/* Returns the value returned by the thread function */
+int thread_join(thread_t* thread);
+
+/* Number of logical processors, at least 1 */
+u32 thread_cpu_count(void);
+
+void mutex_init(mutex_t* mutex);
+void mutex_destroy(mutex_t* mutex);
+void mutex_lock(mutex_t* mutex);
+void mutex_unlock(mutex_t* mutex);
+
+void condvar_init(condvar_t* cond);
+void condvar_destroy(condvar_t* cond);
+/* Releases the mutex while waiting and holds it again on return.
+ * May wake up without a signal, so check the condition in a loop. */
+void condvar_wait(condvar_t* cond, mutex_t* mutex);
+void condvar_signal(condvar_t* cond);
+void condvar_broadcast(condvar_t* cond);
@@ -0,0 +1,181 @@
+#include "trace.h"
+#include "stats.h"
+#include "thread.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_CHUNK_SIZE 4096
+
+typedef struct {
+    u64 time;
+    const char* name; /* NULL for an end event */
+    symbol_t detail;
+} trace_event_t;
+
+typedef struct trace_chunk_s {
+    struct trace_chunk_s* next;
+    u32 count;
+    trace_event_t events[TRACE_CHUNK_SIZE];
+} trace_chunk_t;
+
+/* The events of one thread. Only that thread appends to it. */
+typedef struct trace_thread_s {
+    struct trace_thread_s* next;
+    u32 id;
+    trace_chunk_t* first;
+    trace_chunk_t* last;
+} trace_thread_t;
+
+bool trace_enabled;
+
+global_variable u64 trace_start;
+global_variable trace_thread_t* trace_threads;
+global_variable u32 num_trace_threads;
+global_variable mutex_t trace_lock = MUTEX_INITIALIZER;
+global_variable THREAD_LOCAL trace_thread_t* this_thread;
+/* Set once an allocation for the thread failed; it records nothing
+ * from then on, so that its spans stay balanced. */
+global_variable THREAD_LOCAL bool this_thread_failed;
+
+/* NULL if out of memory */
+internal trace_thread_t* register_thread(void) {
+    trace_thread_t* thread = calloc(1, sizeof(trace_thread_t));
+    if (!thread)
+        return NULL;
+    mutex_lock(&trace_lock);
+    thread->id = ++num_trace_threads;
+    /* keep them in order of their ids */
+    trace_thread_t** last = &trace_threads;
+    while (*last)
+        last = &(*last)->next;
+    *last = thread;
+    mutex_unlock(&trace_lock);
+    return thread;
+}
+
+void trace_init(void) {
+    trace_start = stats_now();
+    trace_enabled = true;
+    /* the calling thread is "main" */
+    if (!this_thread && !(this_thread = register_thread()))
+        this_thread_failed = true;
+}
+
+internal void record(const char* name, symbol_t detail) {
+    if (this_thread_failed)
+        return;
+    trace_thread_t* thread = this_thread;
+    if (!thread)
+        thread = this_thread = register_thread();
+    if (!thread) {
+        this_thread_failed = true;
+        return;
+    }
+    trace_chunk_t* chunk = thread->last;
+    if (!chunk || chunk->count == TRACE_CHUNK_SIZE) {
+        chunk = malloc(sizeof(trace_chunk_t));
+        if (!chunk) {
+            this_thread_failed = true;
+            return;
+        }
+        chunk->next = NULL;
+        chunk->count = 0;
+        if (thread->last)
+            thread->last->next = chunk;
+        else
+            thread->first = chunk;
+        thread->last = chunk;
+    }
+    trace_event_t* event = &chunk->events[chunk->count++];
+    event->time = stats_now();
+    event->name = name;
+    event->detail = detail;
+}
+
+void trace_begin(const char* name, symbol_t detail) {
+    if (trace_enabled)
+        record(name, detail);
+}
+
+void trace_begin_string(const char* name, const char* detail) {
+    if (trace_enabled)
+        record(name, intern_string(detail, strlen(detail)));
+}
+
+void trace_end(void) {
+    if (trace_enabled)
+        record(NULL, SYMBOL_INVALID);
+}
+
+internal void write_escaped(FILE* out, const char* str) {
+    for (const unsigned char* c = (const unsigned char*)str; *c; c++) {
+        if (*c == '"' || *c == '\\')
+            fprintf(out, "\\%c", *c);
+        else if (*c < 0x20)
+            fprintf(out, "\\u%04x", *c);
+        else
+            fputc(*c, out);
+    }
+}
+
+bool trace_write(const char* path) {
+    FILE* out = fopen(path, "w");
+    if (!out)
+        return false;
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    for (trace_thread_t* thread = trace_threads; thread;
+            thread = thread->next) {
+        fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}",
+                first ? "" : ",\n", thread->id,
+                (thread->id == 1) ? "main" : "thread", thread->id);
+        first = false;
+        for (trace_chunk_t* chunk = thread->first; chunk;
+                chunk = chunk->next) {
+            for (u32 i = 0; i < chunk->count; i++) {
+                trace_event_t* event = &chunk->events[i];
+                double ts = (double)(event->time - trace_start) / 1000.0;
+                if (!event->name) {
+                    fprintf(out, ",\n{\"ph\":\"E\",\"pid\":1,\"tid\":%u,"
+                            "\"ts\":%.3f}", thread->id, ts);
+                    continue;
+                }
+                fprintf(out, ",\n{\"name\":\"");
+                write_escaped(out, event->name);
+                if (event->detail != SYMBOL_INVALID) {
+                    fputc(' ', out);
+                    write_escaped(out, symbol_string(event->detail));
+                }
+                fprintf(out, "\",\"ph\":\"B\",\"pid\":1,\"tid\":%u,"
+                        "\"ts\":%.3f}", thread->id, ts);
+            }
+        }
+    }
+    fprintf(out, "\n]}\n");
+    bool ok = !ferror(out);
+    if (fclose(out) != 0)
+        ok = false;
+    return ok;
+}
+
+void release_trace(void) {
+    trace_enabled = false;
+    trace_thread_t* thread = trace_threads;
+    while (thread) {
+        trace_chunk_t* chunk = thread->first;
+        while (chunk) {
+            trace_chunk_t* next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }
+        trace_thread_t* next = thread->next;
+        free(thread);
+        thread = next;
+    }
+    trace_threads = NULL;
+    num_trace_threads = 0;
+    this_thread = NULL;
+    this_thread_failed = false;
+}
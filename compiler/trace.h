@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "fly.h"
+#include "intern.h"
+
+/* Chrome trace events for --trace, viewable in chrome://tracing or
+ * Perfetto.
+ *
+ * Every thread appends begin and end events to a buffer of its own,
+ * without taking a lock; the buffer is registered once, on the first
+ * event of the thread. trace_write puts all buffers into one file after
+ * the worker threads have been joined. While trace_enabled is false the
+ * calls return right away. A thread that runs out of memory for its
+ * buffer stops recording; the spans it has open end with the trace. */
+
+extern bool trace_enabled;
+
+/* Turns tracing on, times are relative to this call */
+void trace_init(void);
+
+/* Begins a span on the calling thread. name has to be a string literal
+ * or live as long as the trace; detail is shown after it, e.g. the name
+ * of a declaration. Spans nest and are closed by trace_end. */
+void trace_begin(const char* name, symbol_t detail);
+void trace_end(void);
+
+/* Begins a span whose detail is a path or other string, which is
+ * interned */
+void trace_begin_string(const char* name, const char* detail);
+
+/* Writes every event recorded so far as a JSON trace. No thread may be
+ * recording at the same time. Returns false if the file cannot be
+ * written. */
+bool trace_write(const char* path);
+
+/* Frees the buffers and turns tracing off */
+void release_trace(void);